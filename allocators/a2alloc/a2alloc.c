@@ -3,12 +3,17 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <pthread.h>
 #include "memlib.h"
+#include "malloc.h"
 #include "mm_thread.h"
 #include <sched.h>
+#ifdef A2ALLOC_AVL_INDEX
+#include "avl_index.h"
+#endif
 
 ////////////////////////////////////////////////////////
 ///////////////////// MACROS ///////////////////////////
@@ -18,14 +23,108 @@
  * @brief We assume that page size is 4096 bytes which was
  * asked and confirmed on piazza
  * 
+ * FREE_PAGE_THRESHOLD and SUPERBLOCK_PAGE_SIZE are tunables and can be set
+ * on the compiler command line to build variants (see allocators/Makefile).
+ * SUPERBLOCK_PAGE_SIZE must be a power of two multiple of the page size.
+ *
+ * The allocator's own metadata (the heap array, index nodes, and objects
+ * from the metadata pools) lives in superblocks of its own, never in
+ * superblocks that hold user blocks, and is reported by mm_stats.
+ *
+ * Built with -DA2ALLOC_AVL_INDEX, mm_free finds the page ref of a block
+ * in an address index (allocators/index) instead of by masking the
+ * address, to measure what a general lookup costs in place of aligned
+ * superblocks.
+ *
+ * The size classes are the powers of two from 8 to 2048 unless
+ * A2ALLOC_SIZE_CLASSES names a header, made by sizeclasses.pl, that
+ * defines LARGEST_SUPERBLOCK_BLOCK_SIZE and SIZE_CLASSES(C), the list
+ * of classes as C(size) C(size) ...; the tables below are expanded from
+ * it, so NSIZES and the blocks per superblock of each class are
+ * constants. Built with -DA2ALLOC_SIZE_HISTOGRAM, every heap counts the
+ * requested sizes in SIZE_HIST_STEP-byte buckets up to the largest
+ * class, and the counts of all heaps are written at exit to the file
+ * named by $A2ALLOC_HISTOGRAM (stderr if unset), in the format
+ * sizeclasses.pl reads.
+ *
+ * A2ALLOC_PROFILE names a deployment profile (profiles/<name>.h) that fixes
+ * all of these at compile time, along with the number of heaps
+ * (A2ALLOC_HEAPS, one per processor if unset) and the lock type
+ * (A2ALLOC_MUTEX_LOCKS for pthread mutexes instead of spinlocks).
+ * allocators/Makefile builds one library per profile.
+ *
+ * Built with -DA2ALLOC_FREE_BUFFER=n, mm_free puts small blocks in a
+ * buffer of n blocks per thread instead of taking the heap's locks for
+ * each. When the buffer is full it is sorted by page and each page gets
+ * its blocks back under one acquisition of the locks, so a thread holds
+ * at most n freed blocks. The buffer is also emptied before a heap takes
+ * another superblock for a size the buffer holds blocks of, and when the
+ * thread exits; until then mm_stats counts its blocks as in use.
+ *
+ * The allocation path prefetches the block that becomes the head of a
+ * freelist, whose next pointer the following allocation of that size
+ * reads, and the page ref that becomes the head of the free pages
+ * list. Flushing a free buffer prefetches the page ref of the next run
+ * while the current one is given back. -DA2ALLOC_NO_PREFETCH leaves them
+ * out, for comparison (see benchmarks/freelist-order).
  */
-#define NSIZES 9
-#define GLOBAL_HEAP_ID 0
-#define BLOCKTYPE_FREE 10
-#define BLOCKTYPE_LARGE 11
+#ifdef A2ALLOC_PROFILE
+#include A2ALLOC_PROFILE
+#endif
+#ifndef FREE_PAGE_THRESHOLD
 #define FREE_PAGE_THRESHOLD 2
+#endif
+#ifndef SUPERBLOCK_PAGE_SIZE
 #define SUPERBLOCK_PAGE_SIZE (2 * 4096)
+#endif
+#ifdef A2ALLOC_SIZE_CLASSES
+#include A2ALLOC_SIZE_CLASSES
+#endif
+#ifndef SIZE_CLASSES
 #define LARGEST_SUPERBLOCK_BLOCK_SIZE 2048
+#define SIZE_CLASSES(C) C(8) C(16) C(32) C(64) C(128) C(256) C(512) C(1024) C(2048)
+#endif
+#define CLASS_COUNT(size) +1
+#define CLASS_SIZE(size) size,
+#define CLASS_NBLOCKS(size) (int)((SUPERBLOCK_PAGE_SIZE - sizeof(struct pageref)) / (size)),
+#define NSIZES (0 SIZE_CLASSES(CLASS_COUNT))
+#ifdef A2ALLOC_HEAPS
+#define NHEAPS A2ALLOC_HEAPS
+#else
+#define NHEAPS number_of_processors
+#endif
+#ifdef A2ALLOC_MUTEX_LOCKS
+typedef pthread_mutex_t lock_t;
+#define LOCK_INIT(l) pthread_mutex_init((l), NULL)
+#define LOCK(l) pthread_mutex_lock(l)
+#define UNLOCK(l) pthread_mutex_unlock(l)
+#else
+typedef pthread_spinlock_t lock_t;
+#define LOCK_INIT(l) pthread_spin_init((l), 0)
+#define LOCK(l) pthread_spin_lock(l)
+#define UNLOCK(l) pthread_spin_unlock(l)
+#endif
+#define GLOBAL_HEAP_ID 0
+#define BLOCKTYPE_FREE (NSIZES + 1)
+#define BLOCKTYPE_LARGE (NSIZES + 2)
+#define CACHE_LINE 64
+#ifdef A2ALLOC_NO_PREFETCH
+#define PREFETCH(p) ((void)(p))
+#define PREFETCH_WRITE(p) ((void)(p))
+#else
+#define PREFETCH(p) __builtin_prefetch((p), 0, 3)
+// a plain prefetch unless the target has prefetchw (-mprfchw)
+#define PREFETCH_WRITE(p) __builtin_prefetch((p), 1, 3)
+#endif
+#ifdef A2ALLOC_SIZE_HISTOGRAM
+#define SIZE_HIST_STEP 8
+// a bucket for every step up to the largest class, and one for larger sizes
+#define SIZE_HIST_BUCKETS ((LARGEST_SUPERBLOCK_BLOCK_SIZE + SIZE_HIST_STEP - 1) / SIZE_HIST_STEP + 1)
+#define SIZE_HIST_MAX_SIZE ((SIZE_HIST_BUCKETS - 1) * SIZE_HIST_STEP)
+#if SIZE_HIST_BUCKETS * 8 > SUPERBLOCK_PAGE_SIZE
+#error "the size histogram does not fit in a superblock"
+#endif
+#endif
 
 typedef ptrdiff_t vaddr_t;
 
@@ -78,15 +177,16 @@ struct pageref
  * large_pages: pointer to the linked list of large pages in the heap
  * sizebases[]: array of size NSIZE where the ith cell is a pointer to a linked
  * list of pages that have at least one free and one used block and these pages
- * have block size 2^(3+i)
+ * have block size sizes[i]
  * spinlock_free_pages: spinlock for free_pages list
  * spinlock_complete_pages: spinlock for complete_pages list
  * spinlock_large_pages: spinlock for large_pages list
  * spinlock_sizebases[]: array of size NSIZE where ith cell contains a spinlock
  * for list in sizebases[i]
- * int pad[10]:an auxiliary array to reduce false sharing between processes
- * Note: this struct is padded to 192 bytes to fit in 3 cache lines as without the
- * padding the size of this struct is 152 bytes
+ * (the spinlock_* locks are pthread mutexes with A2ALLOC_MUTEX_LOCKS)
+ * Note: this struct is aligned to a cache line, so the heaps in heap_array
+ * never share one whatever NSIZES, the lock type and the options make its
+ * size
  */
 struct heap
 {
@@ -95,12 +195,78 @@ struct heap
 	struct pageref *complete_pages;
 	struct pageref *large_pages;
 	struct pageref *sizebases[NSIZES];
-	pthread_spinlock_t spinlock_free_pages;
-	pthread_spinlock_t spinlock_complete_pages;
-	pthread_spinlock_t spinlock_large_pages;
-	pthread_spinlock_t spinlock_sizebases[NSIZES];
-	int pad[10];
+	lock_t spinlock_free_pages;
+	lock_t spinlock_complete_pages;
+	lock_t spinlock_large_pages;
+	lock_t spinlock_sizebases[NSIZES];
+#ifdef A2ALLOC_SIZE_HISTOGRAM
+	struct size_histogram *hist;
+#endif
+} __attribute__((aligned(CACHE_LINE)));
+
+/**
+ * @brief pool of fixed-size objects for the allocator's internal metadata,
+ * so that new per-thread or per-heap state does not have to come from
+ * mm_malloc. Objects are carved from superblocks that only hold objects
+ * of this pool, and their size is rounded up to a cache line so that
+ * objects used by different threads never share one.
+ * 
+ * size: object size, a multiple of CACHE_LINE
+ * flist: free objects
+ * nobjects: objects handed out and not given back
+ * npages: superblocks carved into objects
+ * lock: spinlock for the pool
+ */
+struct meta_pool
+{
+	size_t size;
+	struct freelist *flist;
+	long nobjects;
+	long npages;
+	lock_t lock;
+};
+
+#ifdef A2ALLOC_FREE_BUFFER
+/**
+ * @brief a block waiting in a free buffer
+ * 
+ * ptr: the block
+ * page_ref: pageref of the page of the block
+ */
+struct freed
+{
+	void *ptr;
+	struct pageref *page_ref;
+};
+
+/**
+ * @brief blocks freed by one thread and not yet given back to their pages
+ * 
+ * n: number of blocks in entries
+ * nclass[]: number of blocks in entries of each size class
+ * entries[]: the blocks, in the order they were freed
+ */
+struct free_buffer
+{
+	int n;
+	int nclass[NSIZES];
+	struct freed entries[A2ALLOC_FREE_BUFFER];
+};
+#endif
+
+#ifdef A2ALLOC_SIZE_HISTOGRAM
+/**
+ * @brief requests counted by size, in the metadata of one heap
+ * 
+ * count[i]: requests of i * SIZE_HIST_STEP + 1 to (i + 1) * SIZE_HIST_STEP bytes
+ * (0 counts with the first bucket), count[SIZE_HIST_BUCKETS - 1] requests
+ * of more than SIZE_HIST_MAX_SIZE bytes
+ */
+struct size_histogram
+{
+	unsigned long count[SIZE_HIST_BUCKETS];
 };
+#endif
 
 ////////////////////////////////////////////////////////
 ////////////////// Global Variables ////////////////////
@@ -108,32 +274,315 @@ struct heap
 
 static int number_of_processors;				// number of processors in the system
 static struct heap *heap_array;					// pointer to the array of heaps
-static pthread_spinlock_t spinlock_global_sbrk; // spinlock used for sbrk function
+static lock_t spinlock_global_sbrk;				// spinlock used for sbrk function
+static long meta_pages;							// superblocks holding metadata, under spinlock_global_sbrk
+#ifdef A2ALLOC_AVL_INDEX
+static struct avl_index page_index;		// superblocks and large pages by address
+static lock_t spinlock_index;					// spinlock for page_index
+#endif
+#ifdef A2ALLOC_SIZE_HISTOGRAM
+static struct meta_pool size_hist_pool;			// size_histogram of every heap
+#endif
+#ifdef A2ALLOC_FREE_BUFFER
+static struct meta_pool free_buffer_pool;		// free_buffer of every thread
+static pthread_key_t free_buffer_key;			// flushes the free buffer at thread exit
+static __thread struct free_buffer *free_buf;	// free buffer of this thread
+#endif
 // array of sizes represents the possible sizes of the blocks
-static const size_t sizes[NSIZES] = {8, 16, 32, 64, 128, 256, 512, 1024, 2048};
+static const size_t sizes[NSIZES] = {SIZE_CLASSES(CLASS_SIZE)};
+// number of blocks of each size that fit in a superblock after the page ref
+static const int blocks_per_page[NSIZES] = {SIZE_CLASSES(CLASS_NBLOCKS)};
 
 ////////////////////////////////////////////////////////
 ////////////////// Helper Functions ////////////////////
 ////////////////////////////////////////////////////////
 
 /**
- * @brief helper function to figure out the block type of a given size
+ * @brief helper function to figure out the block type of a given size, the
+ * number of classes too small for it. NSIZES and sizes[] are constants, so
+ * the loop unrolls into compares and adds without branches.
+ * 
+ * @pre size is at most LARGEST_SUPERBLOCK_BLOCK_SIZE
+ */
+static inline int get_block_type(size_t size)
+{
+	int block_type = 0;
+
+	for (int i = 0; i < NSIZES - 1; i++)
+	{
+		block_type += (size > sizes[i]);
+	}
+	return block_type;
+}
+
+/**
+ * @brief helper function that picks the heap of the calling thread: the
+ * heap of its processor, or the only one if the profile has a single heap
+ */
+static inline int get_heap_id(void)
+{
+#if defined(A2ALLOC_HEAPS) && A2ALLOC_HEAPS == 1
+	return 1;
+#else
+	return (sched_getcpu() % NHEAPS) + 1;
+#endif
+}
+
+////////////////////////////////////////////////////////
+/////////////////// Metadata Pools /////////////////////
+////////////////////////////////////////////////////////
+
+/**
+ * @brief gets npages superblocks for metadata and counts them
+ * 
+ * @return void* NULL if the segment is full
+ */
+static void *meta_page(int npages)
+{
+	void *page;
+
+	LOCK(&spinlock_global_sbrk);
+	page = mem_sbrk((size_t)npages * SUPERBLOCK_PAGE_SIZE);
+	if (page != NULL)
+	{
+		meta_pages += npages;
+	}
+	UNLOCK(&spinlock_global_sbrk);
+	return page;
+}
+
+/**
+ * @brief sets up an empty pool of objects of at least size bytes
+ * 
+ * @return int -1 if the objects do not fit in a superblock, 0 otherwise
+ */
+static inline int meta_pool_init(struct meta_pool *pool, size_t size)
+{
+	size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+	if (size > SUPERBLOCK_PAGE_SIZE)
+	{
+		return -1;
+	}
+	pool->size = size;
+	pool->flist = NULL;
+	pool->nobjects = 0;
+	pool->npages = 0;
+	LOCK_INIT(&(pool->lock));
+	return 0;
+}
+
+/**
+ * @brief takes an object from pool, carving a new superblock into
+ * objects when the pool is empty. The object is not cleared.
+ * 
+ * @return void* NULL if the segment is full
+ */
+static inline void *meta_alloc(struct meta_pool *pool)
+{
+	struct freelist *obj;
+	vaddr_t page;
+
+	LOCK(&(pool->lock));
+	if (pool->flist == NULL)
+	{
+		page = (vaddr_t)meta_page(1);
+		if (page == 0)
+		{
+			UNLOCK(&(pool->lock));
+			return NULL;
+		}
+		for (size_t off = 0; off + pool->size <= SUPERBLOCK_PAGE_SIZE; off += pool->size)
+		{
+			obj = (struct freelist *)(page + off);
+			obj->next = pool->flist;
+			pool->flist = obj;
+		}
+		pool->npages++;
+	}
+	obj = pool->flist;
+	pool->flist = obj->next;
+	pool->nobjects++;
+	UNLOCK(&(pool->lock));
+	return obj;
+}
+
+/**
+ * @brief gives an object back to the pool it came from; its superblock
+ * stays with the pool
+ */
+static inline void meta_free(struct meta_pool *pool, void *ptr)
+{
+	struct freelist *obj = (struct freelist *)ptr;
+
+	LOCK(&(pool->lock));
+	obj->next = pool->flist;
+	pool->flist = obj;
+	pool->nobjects--;
+	UNLOCK(&(pool->lock));
+}
+
+/**
+ * @brief bytes of the objects of pool that are handed out
+ */
+static inline size_t meta_pool_in_use(struct meta_pool *pool)
+{
+	size_t bytes;
+
+	LOCK(&(pool->lock));
+	bytes = (size_t)pool->nobjects * pool->size;
+	UNLOCK(&(pool->lock));
+	return bytes;
+}
+
+#ifdef A2ALLOC_SIZE_HISTOGRAM
+////////////////////////////////////////////////////////
+/////////////////// Size Histogram /////////////////////
+////////////////////////////////////////////////////////
+
+/**
+ * @brief counts a request of size bytes in the histogram of heap h. The
+ * add is atomic but unordered, on counters only threads of the same CPU
+ * write.
+ */
+static inline void size_hist_record(struct heap *h, size_t size)
+{
+	size_t bucket = size > SIZE_HIST_MAX_SIZE ? SIZE_HIST_BUCKETS - 1 : (size + (size == 0) - 1) / SIZE_HIST_STEP;
+
+	__atomic_fetch_add(&(h->hist->count[bucket]), 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief writes the counts of all heaps at exit, one "size count" line for
+ * every bucket that has requests, size being the largest in the bucket
+ */
+__attribute__((destructor)) static void size_hist_dump(void)
+{
+	const char *path = getenv("A2ALLOC_HISTOGRAM");
+	unsigned long count;
+	FILE *f = stderr;
+
+	if (heap_array == NULL)
+	{
+		return;
+	}
+	if (path != NULL && (f = fopen(path, "w")) == NULL)
+	{
+		perror(path);
+		return;
+	}
+	fprintf(f, "# a2alloc request sizes: size count, %d-byte buckets\n", SIZE_HIST_STEP);
+	for (int i = 0; i < SIZE_HIST_BUCKETS; i++)
+	{
+		count = 0;
+		for (int j = 0; j <= NHEAPS; j++)
+		{
+			count += heap_array[j].hist->count[i];
+		}
+		if (count == 0)
+		{
+			continue;
+		}
+		if (i == SIZE_HIST_BUCKETS - 1)
+		{
+			fprintf(f, "# larger than %d bytes: %lu\n", SIZE_HIST_MAX_SIZE, count);
+		}
+		else
+		{
+			fprintf(f, "%d %lu\n", (i + 1) * SIZE_HIST_STEP, count);
+		}
+	}
+	if (f != stderr)
+	{
+		fclose(f);
+	}
+}
+#endif
+
+#ifdef A2ALLOC_AVL_INDEX
+////////////////////////////////////////////////////////
+///////////////////// Page Index ///////////////////////
+////////////////////////////////////////////////////////
+
+/**
+ * @brief gets memory for the nodes of the page index, one superblock
+ * at a time
+ */
+static void *index_chunk(size_t size)
+{
+	return meta_page((size + SUPERBLOCK_PAGE_SIZE - 1) / SUPERBLOCK_PAGE_SIZE);
+}
+
+/**
+ * @brief adds the npages superblocks starting at page_ref to the index
  * 
+ * @return int -1 if there is no memory for the index node, 0 otherwise
  */
-static int get_block_type(size_t size)
+static int index_add(struct pageref *page_ref, int npages)
 {
-	for (int i = 0; i < NSIZES; i++)
+	int ret;
+
+	LOCK(&spinlock_index);
+	ret = avl_index_insert(&page_index, (uintptr_t)page_ref,
+						   (size_t)npages * SUPERBLOCK_PAGE_SIZE, page_ref);
+	UNLOCK(&spinlock_index);
+	return ret;
+}
+
+/**
+ * @brief replaces the index entry of a freed large page by one entry for
+ * each of its superblocks, which are reused one by one. If there is no
+ * memory for the nodes, the entries added are taken out again and the
+ * large page's entry is put back, which reuses the node it had.
+ * 
+ * @return int -1 if the index still holds the large page, 0 otherwise
+ */
+static int index_split(struct pageref *page_ref, int npages)
+{
+	vaddr_t prpage = (vaddr_t)page_ref;
+	int i;
+
+	LOCK(&spinlock_index);
+	avl_index_remove(&page_index, (uintptr_t)page_ref);
+	for (i = 0; i < npages; i++, prpage += SUPERBLOCK_PAGE_SIZE)
+	{
+		if (avl_index_insert(&page_index, (uintptr_t)prpage, SUPERBLOCK_PAGE_SIZE,
+							 (void *)prpage) != 0)
+		{
+			break;
+		}
+	}
+	if (i < npages)
 	{
-		if (size <= sizes[i])
+		while (i-- > 0)
 		{
-			return i;
+			prpage -= SUPERBLOCK_PAGE_SIZE;
+			avl_index_remove(&page_index, (uintptr_t)prpage);
 		}
+		avl_index_insert(&page_index, (uintptr_t)page_ref,
+						 (size_t)npages * SUPERBLOCK_PAGE_SIZE, page_ref);
+		UNLOCK(&spinlock_index);
+		return -1;
 	}
-	// Allocator cannot handle allocation of size
-	exit(1);
+	UNLOCK(&spinlock_index);
 	return 0;
 }
 
+/**
+ * @brief finds the page ref of the superblock or large page containing addr
+ * 
+ * @return struct pageref* NULL if addr is not in any of them
+ */
+static struct pageref *index_find(vaddr_t addr)
+{
+	struct pageref *page_ref;
+
+	LOCK(&spinlock_index);
+	page_ref = (struct pageref *)avl_index_lookup(&page_index, (uintptr_t)addr);
+	UNLOCK(&spinlock_index);
+	return page_ref;
+}
+#endif
+
 ////////////////////////////////////////////////////////
 /////////////// Page Relocation Functions //////////////
 ////////////////////////////////////////////////////////
@@ -149,15 +598,15 @@ static void move_page_global(struct heap *h)
 	struct heap *global_heap = NULL;
 	struct pageref *page = NULL;
 
-	// Don't move to global heap if there is only one processor
+	// Don't move to global heap if there is only one heap
 	// since all the threads will be sharing the same heap
-	if (number_of_processors > 1)
+	if (NHEAPS > 1)
 	{
 		// Get pointer to global heap
 		global_heap = (heap_array + GLOBAL_HEAP_ID);
 
 		// Get the lock for the free_pages list in heap h
-		pthread_spin_lock(&(h->spinlock_free_pages));
+		LOCK(&(h->spinlock_free_pages));
 		if (h->n_free_pages > FREE_PAGE_THRESHOLD)
 		{
 			// There are more than FREE_PAGE_THRESHOLD free
@@ -166,21 +615,21 @@ static void move_page_global(struct heap *h)
 			page = h->free_pages;
 			h->free_pages = h->free_pages->next;
 			h->n_free_pages--;
-			pthread_spin_unlock(&(h->spinlock_free_pages));
+			UNLOCK(&(h->spinlock_free_pages));
 
 			// Add the removed page to the global list of free pages
 			page->prev = NULL;
 			page->heap_ID = GLOBAL_HEAP_ID;
-			pthread_spin_lock(&(global_heap->spinlock_free_pages));
+			LOCK(&(global_heap->spinlock_free_pages));
 			page->next = global_heap->free_pages;
 			global_heap->free_pages = page;
 			global_heap->n_free_pages++;
-			pthread_spin_unlock(&(global_heap->spinlock_free_pages));
+			UNLOCK(&(global_heap->spinlock_free_pages));
 		}
 		else
 		{
 			// Not enough free pages in the local heap so don't do anything
-			pthread_spin_unlock(&(h->spinlock_free_pages));
+			UNLOCK(&(h->spinlock_free_pages));
 		}
 	}
 }
@@ -196,11 +645,11 @@ static void move_page_free(struct pageref *page_ref, struct heap *h)
 {
 	page_ref->prev = NULL;
 	page_ref->block_type = BLOCKTYPE_FREE;
-	pthread_spin_lock(&(h->spinlock_free_pages));
+	LOCK(&(h->spinlock_free_pages));
 	page_ref->next = h->free_pages;
 	h->free_pages = page_ref;
 	h->n_free_pages++;
-	pthread_spin_unlock(&(h->spinlock_free_pages));
+	UNLOCK(&(h->spinlock_free_pages));
 	move_page_global(h);
 }
 
@@ -208,6 +657,10 @@ static void move_page_free(struct pageref *page_ref, struct heap *h)
 //////////////////// Main functions ////////////////////
 ////////////////////////////////////////////////////////
 
+#ifdef A2ALLOC_FREE_BUFFER
+static void free_buffer_flush(struct free_buffer *buf);
+#endif
+
 /**
  * @brief function to allocate blocks of size at most 
  * LARGEST_SUPERBLOCK_BLOCK_SIZE in the heap with id heap
@@ -240,7 +693,7 @@ static void *small_malloc(size_t size, int heap)
 
 	// check to see if there are any available blocks of
 	// the correct size in the sizebases array
-	pthread_spin_lock(&((h->spinlock_sizebases)[block_type]));
+	LOCK(&((h->spinlock_sizebases)[block_type]));
 	page_ref = (h->sizebases)[block_type];
 	if (page_ref != NULL)
 	{
@@ -249,6 +702,8 @@ static void *small_malloc(size_t size, int heap)
 		result = page_ref->flist;
 		page_ref->flist = page_ref->flist->next;
 		page_ref->count--;
+		// the next allocation of this size reads the new head's next
+		PREFETCH(page_ref->flist);
 		if (page_ref->count == 0)
 		{
 			// Page has no more free blocks
@@ -262,46 +717,57 @@ static void *small_malloc(size_t size, int heap)
 			page_ref->next = NULL;
 
 			// Move page to complete_pages
-			pthread_spin_lock(&(h->spinlock_complete_pages));
+			LOCK(&(h->spinlock_complete_pages));
 			if (h->complete_pages != NULL)
 			{
 				h->complete_pages->prev = page_ref;
 			}
 			page_ref->next = h->complete_pages;
 			h->complete_pages = page_ref;
-			pthread_spin_unlock(&(h->spinlock_complete_pages));
-			pthread_spin_unlock(&((h->spinlock_sizebases)[block_type]));
+			UNLOCK(&(h->spinlock_complete_pages));
+			UNLOCK(&((h->spinlock_sizebases)[block_type]));
 		}
 		else
 		{
-			pthread_spin_unlock(&((h->spinlock_sizebases)[block_type]));
+			UNLOCK(&((h->spinlock_sizebases)[block_type]));
 		}
 		return result;
 	}
 	// did not find any free block in the coresponding list in the sizebases
-	pthread_spin_unlock(&((h->spinlock_sizebases)[block_type]));
+	UNLOCK(&((h->spinlock_sizebases)[block_type]));
+#ifdef A2ALLOC_FREE_BUFFER
+	if (free_buf != NULL && free_buf->nclass[block_type] > 0)
+	{
+		// blocks of this size this thread freed are waiting, give
+		// them back before taking another page
+		free_buffer_flush(free_buf);
+		return small_malloc(size, heap);
+	}
+#endif
 
 	// could not find a block so far so check free pages
-	pthread_spin_lock(&(h->spinlock_free_pages));
+	LOCK(&(h->spinlock_free_pages));
 	if (h->free_pages)
 	{
 		page_ref = h->free_pages;
 		h->free_pages = h->free_pages->next;
 		h->n_free_pages--;
+		// the next page this heap takes, written when it is set up
+		PREFETCH_WRITE(h->free_pages);
 	}
-	pthread_spin_unlock(&(h->spinlock_free_pages));
+	UNLOCK(&(h->spinlock_free_pages));
 
 	if (page_ref == NULL)
 	{
 		// could not find a block so far so check global heap's free page list
-		pthread_spin_lock(&(global_heap->spinlock_free_pages));
+		LOCK(&(global_heap->spinlock_free_pages));
 		if (global_heap->free_pages != NULL)
 		{
 			page_ref = global_heap->free_pages;
 			global_heap->free_pages = global_heap->free_pages->next;
 			global_heap->n_free_pages--;
 		}
-		pthread_spin_unlock(&(global_heap->spinlock_free_pages));
+		UNLOCK(&(global_heap->spinlock_free_pages));
 	}
 
 	if (page_ref == NULL)
@@ -309,21 +775,28 @@ static void *small_malloc(size_t size, int heap)
 		// no page of the right size available get a new one
 		// the first couple of bytes will be used to store the
 		// page ref of this new page
-		pthread_spin_lock(&spinlock_global_sbrk);
+		LOCK(&spinlock_global_sbrk);
 		page_ref = (struct pageref *)mem_sbrk(SUPERBLOCK_PAGE_SIZE);
-		pthread_spin_unlock(&spinlock_global_sbrk);
+		UNLOCK(&spinlock_global_sbrk);
 		if (page_ref == NULL)
 		{
 			// out of memory
 			return NULL;
 		}
+#ifdef A2ALLOC_AVL_INDEX
+		if (index_add(page_ref, 1) != 0)
+		{
+			// out of memory for the index
+			return NULL;
+		}
+#endif
 	}
 	// get the address of the page
 	prpage = (vaddr_t)(page_ref + 1);
 
 	// set page info
 	page_ref->block_type = block_type;
-	page_ref->count = (SUPERBLOCK_PAGE_SIZE - sizeof(struct pageref)) / sizes[block_type];
+	page_ref->count = blocks_per_page[block_type];
 	page_ref->heap_ID = heap;
 	page_ref->prev = NULL;
 
@@ -344,14 +817,14 @@ static void *small_malloc(size_t size, int heap)
 	page_ref->count--;
 
 	// add the page ref to the corresponding list in the sizebases array
-	pthread_spin_lock(&((h->spinlock_sizebases)[block_type]));
+	LOCK(&((h->spinlock_sizebases)[block_type]));
 	if ((h->sizebases)[block_type] != NULL)
 	{
 		(h->sizebases)[block_type]->prev = page_ref;
 	}
 	page_ref->next = (h->sizebases)[block_type];
 	(h->sizebases)[block_type] = page_ref;
-	pthread_spin_unlock(&((h->spinlock_sizebases)[block_type]));
+	UNLOCK(&((h->spinlock_sizebases)[block_type]));
 
 	return result;
 }
@@ -378,15 +851,22 @@ static void *large_malloc(int size, int heap)
 
 	h = (heap_array + heap);
 	npages = (sizeof(struct pageref) + size + SUPERBLOCK_PAGE_SIZE - 1) / SUPERBLOCK_PAGE_SIZE;
-	pthread_spin_lock(&spinlock_global_sbrk);
+	LOCK(&spinlock_global_sbrk);
 	page_ref = (struct pageref *)mem_sbrk(npages * SUPERBLOCK_PAGE_SIZE);
-	pthread_spin_unlock(&spinlock_global_sbrk);
+	UNLOCK(&spinlock_global_sbrk);
 
 	if (page_ref == NULL)
 	{
 		// out of memory
 		return NULL;
 	}
+#ifdef A2ALLOC_AVL_INDEX
+	if (index_add(page_ref, npages) != 0)
+	{
+		// out of memory for the index
+		return NULL;
+	}
+#endif
 	// get the address of the block
 	result = (vaddr_t)(page_ref + 1);
 	// set page info
@@ -396,14 +876,14 @@ static void *large_malloc(int size, int heap)
 	page_ref->heap_ID = heap;
 
 	// Add the page to the large_pages list in the current heap
-	pthread_spin_lock(&(h->spinlock_large_pages));
+	LOCK(&(h->spinlock_large_pages));
 	if (h->large_pages != NULL)
 	{
 		h->large_pages->prev = page_ref;
 	}
 	page_ref->next = h->large_pages;
 	h->large_pages = page_ref;
-	pthread_spin_unlock(&(h->spinlock_large_pages));
+	UNLOCK(&(h->spinlock_large_pages));
 
 	return ((void *)result);
 }
@@ -417,13 +897,22 @@ static void *large_malloc(int size, int heap)
  * belongs to
  * @param page_ref pointer to the page ref of the page that the block 
  * belongs to
+ * @return int -1 if there was no memory to index the freed superblocks
+ * and the block stays allocated, 0 otherwise
  */
 static int large_free(void *ptr, struct heap *heap_pt, struct pageref *page_ref)
 {
 	vaddr_t prpage; // address of the page_ref 
 
+#ifdef A2ALLOC_AVL_INDEX
+	if (index_split(page_ref, page_ref->count) != 0)
+	{
+		// out of memory for the index, the page stays allocated
+		return -1;
+	}
+#endif
 	// Remove the page from list of large pages in the corresponding heap
-	pthread_spin_lock(&(heap_pt->spinlock_large_pages));
+	LOCK(&(heap_pt->spinlock_large_pages));
 	if (page_ref->next != NULL)
 	{
 		page_ref->next->prev = page_ref->prev;
@@ -436,7 +925,7 @@ static int large_free(void *ptr, struct heap *heap_pt, struct pageref *page_ref)
 	{
 		page_ref->prev->next = page_ref->next;
 	}
-	pthread_spin_unlock(&(heap_pt->spinlock_large_pages));
+	UNLOCK(&(heap_pt->spinlock_large_pages));
 
 	page_ref->block_type = BLOCKTYPE_FREE;
 	// divide the large block into SUPERBLOCK_PAGE_SIZE pages
@@ -456,7 +945,7 @@ static int large_free(void *ptr, struct heap *heap_pt, struct pageref *page_ref)
 	new_header->prev = NULL;
 
 	// add the chopped up pages to the free list to be used later
-	pthread_spin_lock(&(heap_pt->spinlock_free_pages));
+	LOCK(&(heap_pt->spinlock_free_pages));
 	if (heap_pt->free_pages != NULL)
 	{
 		heap_pt->free_pages->prev = new_tail;
@@ -464,62 +953,46 @@ static int large_free(void *ptr, struct heap *heap_pt, struct pageref *page_ref)
 	new_tail->next = heap_pt->free_pages;
 	heap_pt->free_pages = new_header;
 	heap_pt->n_free_pages += page_ref->count;
-	pthread_spin_unlock(&(heap_pt->spinlock_free_pages));
+	UNLOCK(&(heap_pt->spinlock_free_pages));
 	// move to global free pages list if possible
 	move_page_global(heap_pt);
 	return 0;
 }
 
 /**
- * @brief function to free blocks of size at most 
- * LARGEST_SUPERBLOCK_BLOCK_SIZE. If the ptr points to a
- * block with larger size than LARGEST_SUPERBLOCK_BLOCK_SIZE
- * it call large_free function to handle it.
+ * @brief function that gives n blocks back to the page of page_ref, one
+ * lock acquisition for all of them. The blocks are already linked
+ * through their freelist entries, first to last.
  * 
- * @param ptr pointer to the block to be freed
+ * @param page_ref pointer to the page ref of the page the blocks belong to
+ * @param first first block of the chain
+ * @param last last block of the chain
+ * @param n number of blocks in the chain
  */
-static int small_free(void *ptr)
+static void free_run(struct pageref *page_ref, struct freelist *first,
+					 struct freelist *last, int n)
 {
-	vaddr_t ptraddr;				 // same as ptr
-	struct pageref *page_ref = NULL; // pageref for page of the block we're freeing
-	struct heap *heap_pt = NULL;	 // pointer to heap of the page of the block we're freeing
-	int block_type;					 // index into sizes[]
+	struct heap *heap_pt = NULL; // pointer to heap of the page of the blocks we're freeing
+	int block_type;				 // index into sizes[]
+	int was_complete;			 // page had no free blocks, so it was in complete_pages
 
-	ptraddr = (vaddr_t)ptr;
-	// gigure out the page ref for the page of the block 
-	page_ref = (struct pageref *)(ptraddr - (ptraddr % SUPERBLOCK_PAGE_SIZE));
 	block_type = page_ref->block_type;
-
-	if (block_type == BLOCKTYPE_FREE)
-	{
-		// trying to free a block that has already been freed.
-		return 0;
-	}
-
 	heap_pt = (heap_array + (page_ref->heap_ID));
-	if (block_type == BLOCKTYPE_LARGE)
-	{
-		return large_free(ptr, heap_pt, page_ref);
-	}
 
 	// take both locks since the page can be in either block
 	// we might also have to move from sizebases to complete_pages
-	pthread_spin_lock((heap_pt->spinlock_sizebases) + block_type);
-	pthread_spin_lock(&(heap_pt->spinlock_complete_pages));
+	LOCK((heap_pt->spinlock_sizebases) + block_type);
+	LOCK(&(heap_pt->spinlock_complete_pages));
 
-	// add the block to the free list of that page
-	((struct freelist *)ptr)->next = page_ref->flist;
-	page_ref->flist = (struct freelist *)ptr;
-	page_ref->count++;
+	// add the blocks to the free list of that page
+	was_complete = (page_ref->count == 0);
+	last->next = page_ref->flist;
+	page_ref->flist = first;
+	page_ref->count += n;
 
-	if (page_ref->count == (SUPERBLOCK_PAGE_SIZE - sizeof(struct pageref)) / sizes[block_type])
+	if (page_ref->count == blocks_per_page[block_type])
 	{
 		// all the blocks in the page are empty
-		// unlock complete_pages lock since we know that the page can't belong
-		// to complete pages as there must have been other empty blocks besides
-		// the block that we just freed
-		pthread_spin_unlock(&(heap_pt->spinlock_complete_pages));
-
 		// remove the page from the list it belongs to
 		if (page_ref->next != NULL)
 		{
@@ -529,20 +1002,25 @@ static int small_free(void *ptr)
 		{
 			page_ref->prev->next = page_ref->next;
 		}
+		else if (was_complete)
+		{
+			heap_pt->complete_pages = page_ref->next;
+		}
 		else
 		{
 			(heap_pt->sizebases)[block_type] = page_ref->next;
 		}
+		UNLOCK(&(heap_pt->spinlock_complete_pages));
 		page_ref->block_type = BLOCKTYPE_FREE;
-		pthread_spin_unlock((heap_pt->spinlock_sizebases) + block_type);
+		UNLOCK((heap_pt->spinlock_sizebases) + block_type);
 		// move the page to free pages list
 		move_page_free(page_ref, heap_pt);
 	}
-	else if (page_ref->count == 1)
+	else if (was_complete)
 	{
-		// there is only one free block in the page (which is the block
-		// we just freed). The page is no longer a complete page so we
-		// remove it from complete pages list
+		// the page had no free blocks before these, so it is no
+		// longer a complete page and we remove it from complete
+		// pages list
 		if (page_ref->next != NULL)
 		{
 			page_ref->next->prev = page_ref->prev;
@@ -555,7 +1033,7 @@ static int small_free(void *ptr)
 		{
 			heap_pt->complete_pages = page_ref->next;
 		}
-		pthread_spin_unlock(&(heap_pt->spinlock_complete_pages));
+		UNLOCK(&(heap_pt->spinlock_complete_pages));
 
 		// add the page to the corresponding list in the sizebases array
 		// of the corresponding heap
@@ -566,13 +1044,157 @@ static int small_free(void *ptr)
 		}
 		page_ref->next = (heap_pt->sizebases)[block_type];
 		(heap_pt->sizebases)[block_type] = page_ref;
-		pthread_spin_unlock((heap_pt->spinlock_sizebases) + block_type);
+		UNLOCK((heap_pt->spinlock_sizebases) + block_type);
 	}
 	else
 	{
-		pthread_spin_unlock(&(heap_pt->spinlock_complete_pages));
-		pthread_spin_unlock((heap_pt->spinlock_sizebases) + block_type);
+		UNLOCK(&(heap_pt->spinlock_complete_pages));
+		UNLOCK((heap_pt->spinlock_sizebases) + block_type);
 	}
+}
+
+#ifdef A2ALLOC_FREE_BUFFER
+/**
+ * @brief function that gives back every block in the free buffer buf,
+ * sorted by page so that the blocks of a page go back as one run
+ * under one acquisition of its heap's locks
+ */
+static void free_buffer_flush(struct free_buffer *buf)
+{
+	struct freed tmp;		 // entry being sorted
+	struct freelist *first; // first block of the run
+	struct freelist *last;	 // last block of the run
+	int i, j, n;
+
+	// insertion sort, the buffer is small
+	for (i = 1; i < buf->n; i++)
+	{
+		tmp = buf->entries[i];
+		for (j = i; j > 0 && buf->entries[j - 1].page_ref > tmp.page_ref; j--)
+		{
+			buf->entries[j] = buf->entries[j - 1];
+		}
+		buf->entries[j] = tmp;
+	}
+
+	// chain each run of blocks of the same page and free it
+	for (i = 0; i < buf->n; i += n)
+	{
+		first = last = (struct freelist *)buf->entries[i].ptr;
+		for (n = 1; i + n < buf->n && buf->entries[i + n].page_ref == buf->entries[i].page_ref; n++)
+		{
+			last->next = (struct freelist *)buf->entries[i + n].ptr;
+			last = last->next;
+		}
+		// the page ref of the next run, while this one is freed
+		if (i + n < buf->n)
+		{
+			PREFETCH_WRITE(buf->entries[i + n].page_ref);
+		}
+		free_run(buf->entries[i].page_ref, first, last, n);
+	}
+	buf->n = 0;
+	memset(buf->nclass, 0, sizeof(buf->nclass));
+}
+
+/**
+ * @brief thread exit destructor of free_buffer_key: flushes the buffer
+ * of the exiting thread and gives it back to its pool
+ */
+static void free_buffer_release(void *ptr)
+{
+	struct free_buffer *buf = (struct free_buffer *)ptr;
+
+	free_buffer_flush(buf);
+	free_buf = NULL;
+	meta_free(&free_buffer_pool, buf);
+}
+
+/**
+ * @brief function that gets the free buffer of the calling thread,
+ * taking one from the pool on its first free
+ * 
+ * @return struct free_buffer* NULL if there is no memory for one
+ */
+static inline struct free_buffer *free_buffer_get(void)
+{
+	struct free_buffer *buf = free_buf;
+
+	if (buf == NULL)
+	{
+		buf = (struct free_buffer *)meta_alloc(&free_buffer_pool);
+		if (buf == NULL)
+		{
+			return NULL;
+		}
+		buf->n = 0;
+		memset(buf->nclass, 0, sizeof(buf->nclass));
+		pthread_setspecific(free_buffer_key, buf);
+		free_buf = buf;
+	}
+	return buf;
+}
+#endif
+
+/**
+ * @brief function to free blocks of size at most 
+ * LARGEST_SUPERBLOCK_BLOCK_SIZE. If the ptr points to a
+ * block with larger size than LARGEST_SUPERBLOCK_BLOCK_SIZE
+ * it call large_free function to handle it. With
+ * A2ALLOC_FREE_BUFFER the block goes into the free buffer of
+ * the thread and is given back when the buffer is full.
+ * 
+ * @param ptr pointer to the block to be freed
+ */
+static int small_free(void *ptr)
+{
+	vaddr_t ptraddr;				 // same as ptr
+	struct pageref *page_ref = NULL; // pageref for page of the block we're freeing
+	int block_type;					 // index into sizes[]
+#ifdef A2ALLOC_FREE_BUFFER
+	struct free_buffer *buf;		 // free buffer of this thread
+#endif
+
+	ptraddr = (vaddr_t)ptr;
+	// gigure out the page ref for the page of the block 
+#ifdef A2ALLOC_AVL_INDEX
+	page_ref = index_find(ptraddr);
+	if (page_ref == NULL)
+	{
+		// not a block of ours
+		return 0;
+	}
+#else
+	page_ref = (struct pageref *)(ptraddr - (ptraddr % SUPERBLOCK_PAGE_SIZE));
+#endif
+	block_type = page_ref->block_type;
+
+	if (block_type == BLOCKTYPE_FREE)
+	{
+		// trying to free a block that has already been freed.
+		return 0;
+	}
+
+	if (block_type == BLOCKTYPE_LARGE)
+	{
+		return large_free(ptr, heap_array + (page_ref->heap_ID), page_ref);
+	}
+
+#ifdef A2ALLOC_FREE_BUFFER
+	buf = free_buffer_get();
+	if (buf != NULL)
+	{
+		buf->entries[buf->n].ptr = ptr;
+		buf->entries[buf->n].page_ref = page_ref;
+		buf->nclass[block_type]++;
+		if (++(buf->n) == A2ALLOC_FREE_BUFFER)
+		{
+			free_buffer_flush(buf);
+		}
+		return 0;
+	}
+#endif
+	free_run(page_ref, (struct freelist *)ptr, (struct freelist *)ptr, 1);
 	return 0;
 }
 
@@ -587,7 +1209,10 @@ static int small_free(void *ptr)
 
 void *mm_malloc(size_t size)
 {
-	int heap_id = (sched_getcpu() % number_of_processors) + 1;
+	int heap_id = get_heap_id();
+#ifdef A2ALLOC_SIZE_HISTOGRAM
+	size_hist_record(heap_array + heap_id, size);
+#endif
 	if (size > LARGEST_SUPERBLOCK_BLOCK_SIZE)
 	{
 		return large_malloc(size, heap_id);
@@ -634,13 +1259,30 @@ int mm_init(void)
 	int diff = abs(((long)dseg_lo) % SUPERBLOCK_PAGE_SIZE);
 	if (diff > 0)
 	{
-		mem_sbrk(diff);
+		mem_sbrk(SUPERBLOCK_PAGE_SIZE - diff);
 	}
 
-	pthread_spin_init(&spinlock_global_sbrk, 0);
+	LOCK_INIT(&spinlock_global_sbrk);
+#ifdef A2ALLOC_AVL_INDEX
+	LOCK_INIT(&spinlock_index);
+	avl_index_init(&page_index, index_chunk, SUPERBLOCK_PAGE_SIZE);
+#endif
 	number_of_processors = getNumProcessors();
-	npages = ((heap_size * (number_of_processors + 1)) + SUPERBLOCK_PAGE_SIZE - 1) / SUPERBLOCK_PAGE_SIZE;
-	heap_array = (struct heap *)mem_sbrk(npages * SUPERBLOCK_PAGE_SIZE);
+#ifdef A2ALLOC_SIZE_HISTOGRAM
+	if (meta_pool_init(&size_hist_pool, sizeof(struct size_histogram)) != 0)
+	{
+		return -1;
+	}
+#endif
+#ifdef A2ALLOC_FREE_BUFFER
+	if (meta_pool_init(&free_buffer_pool, sizeof(struct free_buffer)) != 0 ||
+		pthread_key_create(&free_buffer_key, free_buffer_release) != 0)
+	{
+		return -1;
+	}
+#endif
+	npages = ((heap_size * (NHEAPS + 1)) + SUPERBLOCK_PAGE_SIZE - 1) / SUPERBLOCK_PAGE_SIZE;
+	heap_array = (struct heap *)meta_page(npages);
 
 	if (heap_array == NULL)
 	{
@@ -648,7 +1290,7 @@ int mm_init(void)
 		return -1;
 	}
 
-	for (int i = 0; i <= number_of_processors; i++)
+	for (int i = 0; i <= NHEAPS; i++)
 	{
 		struct heap *h = (heap_array + i);
 		h->n_free_pages = 0;
@@ -657,15 +1299,102 @@ int mm_init(void)
 		h->complete_pages = NULL;
 		h->large_pages = NULL;
 
-		pthread_spin_init(&(h->spinlock_free_pages), 0);
-		pthread_spin_init(&(h->spinlock_complete_pages), 0);
+		LOCK_INIT(&(h->spinlock_free_pages));
+		LOCK_INIT(&(h->spinlock_complete_pages));
 		for (int j = 0; j < NSIZES; j++)
 		{
-			pthread_spin_init(&((h->spinlock_sizebases)[j]), 0);
+			LOCK_INIT(&((h->spinlock_sizebases)[j]));
 			h->sizebases[j] = NULL;
 		}
-		pthread_spin_init(&(h->spinlock_large_pages), 0);
+		LOCK_INIT(&(h->spinlock_large_pages));
+#ifdef A2ALLOC_SIZE_HISTOGRAM
+		h->hist = (struct size_histogram *)meta_alloc(&size_hist_pool);
+		if (h->hist == NULL)
+		{
+			return -1;
+		}
+		memset(h->hist, 0, sizeof(struct size_histogram));
+#endif
 	}
 
 	return 0;
 }
+
+/**
+ * @brief function that reports how many bytes are in live blocks and how many
+ * are held free, by walking the page lists of every heap. Each list is walked
+ * under its own lock, so the result is a consistent snapshot of each list but
+ * not of the whole allocator. meta is every superblock taken for metadata,
+ * which is in neither in_use nor free, and meta_in_use the part of it that
+ * holds the heap array, index nodes and metadata pool objects in use.
+ * 
+ * @param st statistics to fill in
+ */
+void mm_stats(struct mm_stats *st)
+{
+	struct pageref *page_ref = NULL; // pageref of the page being counted
+	size_t nblocks;					 // number of blocks in a page of a block type
+
+	st->in_use = 0;
+	st->free = 0;
+	st->meta = 0;
+	st->meta_in_use = 0;
+	if (heap_array == NULL)
+	{
+		return;
+	}
+
+	LOCK(&spinlock_global_sbrk);
+	st->meta = (size_t)meta_pages * SUPERBLOCK_PAGE_SIZE;
+	UNLOCK(&spinlock_global_sbrk);
+	st->meta_in_use = sizeof(struct heap) * (NHEAPS + 1);
+#ifdef A2ALLOC_AVL_INDEX
+	LOCK(&spinlock_index);
+	st->meta_in_use += (size_t)page_index.nspans * sizeof(struct avl_node);
+	UNLOCK(&spinlock_index);
+#endif
+#ifdef A2ALLOC_SIZE_HISTOGRAM
+	st->meta_in_use += meta_pool_in_use(&size_hist_pool);
+#endif
+#ifdef A2ALLOC_FREE_BUFFER
+	st->meta_in_use += meta_pool_in_use(&free_buffer_pool);
+#endif
+
+	for (int i = 0; i <= NHEAPS; i++)
+	{
+		struct heap *h = (heap_array + i);
+
+		for (int j = 0; j < NSIZES; j++)
+		{
+			nblocks = blocks_per_page[j];
+			LOCK(&((h->spinlock_sizebases)[j]));
+			for (page_ref = (h->sizebases)[j]; page_ref != NULL; page_ref = page_ref->next)
+			{
+				st->in_use += (nblocks - page_ref->count) * sizes[j];
+				st->free += page_ref->count * sizes[j];
+			}
+			UNLOCK(&((h->spinlock_sizebases)[j]));
+		}
+
+		// complete pages have no free blocks
+		LOCK(&(h->spinlock_complete_pages));
+		for (page_ref = h->complete_pages; page_ref != NULL; page_ref = page_ref->next)
+		{
+			nblocks = blocks_per_page[page_ref->block_type];
+			st->in_use += nblocks * sizes[page_ref->block_type];
+		}
+		UNLOCK(&(h->spinlock_complete_pages));
+
+		// count is the number of pages in large pages
+		LOCK(&(h->spinlock_large_pages));
+		for (page_ref = h->large_pages; page_ref != NULL; page_ref = page_ref->next)
+		{
+			st->in_use += (size_t)page_ref->count * SUPERBLOCK_PAGE_SIZE - sizeof(struct pageref);
+		}
+		UNLOCK(&(h->spinlock_large_pages));
+
+		LOCK(&(h->spinlock_free_pages));
+		st->free += (size_t)h->n_free_pages * SUPERBLOCK_PAGE_SIZE;
+		UNLOCK(&(h->spinlock_free_pages));
+	}
+}
@@ -0,0 +1,13 @@
+/*
+ * a2alloc deployment profile: latency
+ *
+ * Short and predictable malloc and free. There is a heap per
+ * processor, so threads rarely meet on a lock, and the locks are
+ * spinlocks that never sleep. Each heap keeps a few more free
+ * superblocks before it hands them to the global heap, so a thread
+ * that frees and allocates again seldom goes there.
+ */
+#define SUPERBLOCK_PAGE_SIZE 8192
+#define FREE_PAGE_THRESHOLD 4
+#define LARGEST_SUPERBLOCK_BLOCK_SIZE 2048
+#define SIZE_CLASSES(C) C(8) C(16) C(32) C(64) C(128) C(256) C(512) C(1024) C(2048)
@@ -0,0 +1,17 @@
+/*
+ * a2alloc deployment profile: memory
+ *
+ * The smallest footprint. Superblocks are a single page, and the 15
+ * classes each fill the 4056 bytes after the page ref to within 24
+ * bytes, where powers of two round a request up by half on average.
+ * Requests of more than 1352 bytes take whole pages. All threads share
+ * one heap, so no memory sits idle in the heap of another processor.
+ * Its locks are mutexes, so threads waiting on a busy heap sleep
+ * instead of spinning.
+ */
+#define SUPERBLOCK_PAGE_SIZE 4096
+#define LARGEST_SUPERBLOCK_BLOCK_SIZE 1352
+#define SIZE_CLASSES(C) C(8) C(16) C(24) C(32) C(48) C(64) C(96) C(144) C(192) C(288) \
+			C(336) C(448) C(672) C(1008) C(1352)
+#define A2ALLOC_HEAPS 1
+#define A2ALLOC_MUTEX_LOCKS
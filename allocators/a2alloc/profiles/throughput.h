@@ -0,0 +1,15 @@
+/*
+ * a2alloc deployment profile: throughput
+ *
+ * The most operations per second for many threads. 16K superblocks
+ * hold twice the blocks, so a heap takes new superblocks and moves
+ * them between lists half as often. Blocks of up to 4096 bytes stay
+ * in superblocks instead of taking the large path. Each heap keeps up
+ * to 8 free superblocks, and each thread gives freed blocks back 64
+ * at a time, grouped by superblock.
+ */
+#define SUPERBLOCK_PAGE_SIZE 16384
+#define FREE_PAGE_THRESHOLD 8
+#define LARGEST_SUPERBLOCK_BLOCK_SIZE 4096
+#define SIZE_CLASSES(C) C(8) C(16) C(32) C(64) C(128) C(256) C(512) C(1024) C(2048) C(4096)
+#define A2ALLOC_FREE_BUFFER 64
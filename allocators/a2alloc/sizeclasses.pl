@@ -0,0 +1,187 @@
+#!/usr/bin/perl
+
+# Size-class generator for a2alloc.
+#
+# Reads request sizes, either a histogram written by an a2alloc built
+# with -DA2ALLOC_SIZE_HISTOGRAM ("size count" lines) or a trace with
+# one size per line, and chooses the table of --classes size classes
+# that wastes the fewest bytes per request. The waste of a request of
+# s bytes in class c is c - s plus its share of the tail of the
+# superblock that no block of class c fits in:
+#
+#     nblocks(c) = floor((superblock - header) / c)
+#     waste(s, c) = c - s + ((superblock - header) - nblocks(c) * c) / nblocks(c)
+#
+# Classes are multiples of --align, and the largest is --max, which
+# becomes LARGEST_SUPERBLOCK_BLOCK_SIZE; larger requests take whole
+# superblocks in a2alloc and are left out. The best table is found by
+# dynamic programming over the candidate sizes: best[k][j] is the
+# least waste of all requests up to candidate j with k classes, the
+# largest being j.
+#
+# The table is written as a header for a2alloc, e.g.
+#     sizeclasses.pl --output classes.h sizes.hist
+#     make -C allocators variant NAME=a2alloc-tuned SRC=a2alloc/a2alloc.c \
+#         DEFS='-DA2ALLOC_SIZE_CLASSES=\"classes.h\"'
+# along with the waste of the new table and of the powers of two.
+
+use strict;
+use warnings;
+use Getopt::Long;
+
+sub usage {
+    print "usage: sizeclasses.pl [options] <histogram or trace>...\n";
+    print "options:\n";
+    print "    --classes n      number of size classes (default 9)\n";
+    print "    --superblock n   superblock size in bytes (default 8192)\n";
+    print "    --header n       bytes of the page ref at the start of a superblock (default 40)\n";
+    print "    --max n          largest class, LARGEST_SUPERBLOCK_BLOCK_SIZE (default 2048)\n";
+    print "    --align n        classes are multiples of n (default 8)\n";
+    print "    --output file    write the header to file instead of stdout\n";
+    exit(1);
+}
+
+my $nclasses = 9;
+my $superblock = 8192;
+my $header = 40;
+my $max = 2048;
+my $align = 8;
+my $output;
+
+GetOptions("classes=i" => \$nclasses,
+           "superblock=i" => \$superblock,
+           "header=i" => \$header,
+           "max=i" => \$max,
+           "align=i" => \$align,
+           "output=s" => \$output) or usage();
+usage() if (@ARGV == 0);
+die "sizeclasses.pl: --max must be a multiple of --align\n" if ($max % $align != 0);
+die "sizeclasses.pl: a block of --max bytes does not fit in a superblock\n"
+    if ($max > $superblock - $header);
+
+my $ncand = $max / $align;
+die "sizeclasses.pl: --classes must be between 1 and $ncand\n"
+    if ($nclasses < 1 || $nclasses > $ncand);
+
+# Requests and their bytes by candidate: sizes ($j - 1) * align + 1 .. $j * align
+my @count = (0) x ($ncand + 1);
+my @bytes = (0) x ($ncand + 1);
+my ($requests, $large) = (0, 0);
+
+foreach my $file (@ARGV) {
+    open(my $fh, "<", $file) or die "sizeclasses.pl: $file: $!\n";
+    while (my $line = <$fh>) {
+        if ($line =~ /^#\s*larger than \d+ bytes:\s*(\d+)/) {
+            $large += $1;
+            next;
+        }
+        next if ($line =~ /^\s*(#|$)/);
+        my ($size, $n) = split(' ', $line);
+        $n = 1 if (!defined($n) || $n eq "");
+        die "sizeclasses.pl: $file: bad line: $line" if ($size !~ /^\d+$/ || $n !~ /^\d+$/);
+        if ($size > $max) {
+            $large += $n;
+            next;
+        }
+        my $j = $size == 0 ? 1 : int(($size + $align - 1) / $align);
+        $count[$j] += $n;
+        $bytes[$j] += $n * $size;
+        $requests += $n;
+    }
+    close($fh);
+}
+die "sizeclasses.pl: no requests of at most $max bytes\n" if ($requests == 0);
+
+# Waste of one block of class c: c per request, less the request, plus its tail share
+sub block_cost {
+    my ($c) = @_;
+    my $usable = $superblock - $header;
+    my $nblocks = int($usable / $c);
+    return $c + ($usable - $nblocks * $c) / $nblocks;
+}
+
+# Prefix sums, so the waste of class j covering candidates i+1 .. j is O(1)
+my @ccount = (0);
+my @cbytes = (0);
+for my $j (1 .. $ncand) {
+    $ccount[$j] = $ccount[$j - 1] + $count[$j];
+    $cbytes[$j] = $cbytes[$j - 1] + $bytes[$j];
+}
+sub span_cost {
+    my ($i, $j) = @_;
+    return ($ccount[$j] - $ccount[$i]) * block_cost($j * $align) - ($cbytes[$j] - $cbytes[$i]);
+}
+
+my @best;
+my @from;
+for my $j (1 .. $ncand) {
+    $best[1][$j] = span_cost(0, $j);
+    $from[1][$j] = 0;
+}
+for my $k (2 .. $nclasses) {
+    for my $j ($k .. $ncand) {
+        my ($min, $arg);
+        for my $i ($k - 1 .. $j - 1) {
+            my $c = $best[$k - 1][$i] + span_cost($i, $j);
+            if (!defined($min) || $c < $min) {
+                ($min, $arg) = ($c, $i);
+            }
+        }
+        $best[$k][$j] = $min;
+        $from[$k][$j] = $arg;
+    }
+}
+
+my @classes;
+for (my ($k, $j) = ($nclasses, $ncand); $k > 0; $j = $from[$k][$j], $k--) {
+    unshift(@classes, $j * $align);
+}
+
+# The same measure for a table, to compare with the powers of two
+sub waste {
+    my @table = @_;
+    my ($total, $i) = (0, 0);
+    foreach my $c (@table) {
+        my $j = $c / $align;
+        $total += span_cost($i, $j) if ($j > $i);
+        $i = $j if ($j > $i);
+    }
+    return $total;
+}
+my @pow2;
+for (my $c = $align; $c < $max; $c *= 2) {
+    push(@pow2, $c);
+}
+push(@pow2, $max);
+
+my $waste = waste(@classes);
+my $waste_pow2 = waste(@pow2);
+my $requested = $cbytes[$ncand];
+my $summary = sprintf("%d requests of at most %d bytes (%d larger left out), superblock %d, header %d",
+                      $requests, $max, $large, $superblock, $header);
+my $new = sprintf("%.2f bytes per request, %.2f%% of the bytes requested",
+                  $waste / $requests, 100 * $waste / $requested);
+my $old = sprintf("%.2f bytes per request, %.2f%% of the bytes requested",
+                  $waste_pow2 / $requests, 100 * $waste_pow2 / $requested);
+
+printf STDERR "%s\n", $summary;
+printf STDERR "classes: %s\n", join(" ", @classes);
+printf STDERR "waste: %s\n", $new;
+printf STDERR "waste with %s: %s\n", join(" ", @pow2), $old;
+
+my $fh = \*STDOUT;
+if (defined($output)) {
+    open($fh, ">", $output) or die "sizeclasses.pl: $output: $!\n";
+}
+print $fh "/*\n";
+print $fh " * a2alloc size classes, made by sizeclasses.pl from " . join(" ", @ARGV) . ":\n";
+print $fh " * $summary.\n";
+print $fh " * Waste $new;\n";
+print $fh " * powers of two: $old.\n";
+print $fh " */\n";
+print $fh "#if SUPERBLOCK_PAGE_SIZE != $superblock\n";
+print $fh "#warning \"size classes chosen for $superblock-byte superblocks\"\n";
+print $fh "#endif\n";
+printf $fh "#define LARGEST_SUPERBLOCK_BLOCK_SIZE %d\n", $max;
+printf $fh "#define SIZE_CLASSES(C) %s\n", join(" ", map { "C($_)" } @classes);
+close($fh) if (defined($output));
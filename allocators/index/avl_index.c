@@ -0,0 +1,308 @@
+/*
+ * Address index, see avl_index.h.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "avl_index.h"
+
+/* An AVL tree of n nodes is less than 1.45 log2(n + 2) high */
+#define AVL_MAX_HEIGHT 96
+
+static inline int height(const struct avl_node *n)
+{
+	return n ? n->height : 0;
+}
+
+static inline size_t max_len(const struct avl_node *n)
+{
+	return n ? n->max_len : 0;
+}
+
+/* Recompute height and max_len of n from its children */
+static inline void update(struct avl_node *n)
+{
+	int hl = height(n->left), hr = height(n->right);
+	size_t m = n->len;
+
+	n->height = (hl > hr ? hl : hr) + 1;
+	if (max_len(n->left) > m) {
+		m = max_len(n->left);
+	}
+	if (max_len(n->right) > m) {
+		m = max_len(n->right);
+	}
+	n->max_len = m;
+}
+
+static struct avl_node *rotate_left(struct avl_node *n)
+{
+	struct avl_node *root = n->right;
+
+	n->right = root->left;
+	root->left = n;
+	update(n);
+	update(root);
+	return root;
+}
+
+static struct avl_node *rotate_right(struct avl_node *n)
+{
+	struct avl_node *root = n->left;
+
+	n->left = root->right;
+	root->right = n;
+	update(n);
+	update(root);
+	return root;
+}
+
+/* Restore the balance of the subtree *link after one of its children changed */
+static void rebalance(struct avl_node **link)
+{
+	struct avl_node *n = *link;
+	int diff;
+
+	update(n);
+	diff = height(n->left) - height(n->right);
+	if (diff > 1) {
+		if (height(n->left->left) < height(n->left->right)) {
+			n->left = rotate_left(n->left);
+		}
+		*link = rotate_right(n);
+	} else if (diff < -1) {
+		if (height(n->right->right) < height(n->right->left)) {
+			n->right = rotate_right(n->right);
+		}
+		*link = rotate_left(n);
+	}
+}
+
+static struct avl_node *node_alloc(struct avl_index *ix)
+{
+	struct avl_node *n, *chunk;
+	size_t i, count;
+
+	if (ix->free_nodes == NULL) {
+		count = ix->chunk_size / sizeof(struct avl_node);
+		chunk = (struct avl_node *)ix->get_chunk(ix->chunk_size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		for (i = 0; i < count; i++) {
+			chunk[i].right = (i + 1 < count) ? &chunk[i + 1] : NULL;
+		}
+		ix->free_nodes = chunk;
+		ix->nchunks++;
+	}
+	n = ix->free_nodes;
+	ix->free_nodes = n->right;
+	return n;
+}
+
+static void node_free(struct avl_index *ix, struct avl_node *n)
+{
+	n->right = ix->free_nodes;
+	ix->free_nodes = n;
+}
+
+/*
+ * Start an empty index. get_chunk(chunk_size) is called whenever the
+ * node pool is empty. Returns -1 if a chunk cannot hold a node.
+ */
+int avl_index_init(struct avl_index *ix, void *(*get_chunk)(size_t size), size_t chunk_size)
+{
+	ix->root = NULL;
+	ix->free_nodes = NULL;
+	ix->get_chunk = get_chunk;
+	ix->chunk_size = chunk_size;
+	ix->nspans = 0;
+	ix->nchunks = 0;
+	return chunk_size < sizeof(struct avl_node) ? -1 : 0;
+}
+
+/*
+ * Add the span [start, start + len). Returns -1 if it is empty,
+ * overlaps a span already in the index, or no node can be allocated.
+ */
+int avl_index_insert(struct avl_index *ix, uintptr_t start, size_t len, void *data)
+{
+	struct avl_node **path[AVL_MAX_HEIGHT];
+	struct avl_node **link = &ix->root;
+	struct avl_node *n;
+	int depth = 0;
+
+	if (len == 0 || start + len < start) {
+		return -1;
+	}
+	while ((n = *link) != NULL) {
+		path[depth++] = link;
+		if (start + len <= n->start) {
+			link = &n->left;
+		} else if (start >= n->start + n->len) {
+			link = &n->right;
+		} else {
+			return -1;
+		}
+	}
+
+	n = node_alloc(ix);
+	if (n == NULL) {
+		return -1;
+	}
+	n->left = n->right = NULL;
+	n->start = start;
+	n->len = len;
+	n->max_len = len;
+	n->data = data;
+	n->height = 1;
+	*link = n;
+	ix->nspans++;
+
+	while (depth > 0) {
+		rebalance(path[--depth]);
+	}
+	return 0;
+}
+
+/* Remove the span that starts at start. Returns -1 if there is none. */
+int avl_index_remove(struct avl_index *ix, uintptr_t start)
+{
+	struct avl_node **path[AVL_MAX_HEIGHT];
+	struct avl_node **link = &ix->root;
+	struct avl_node **slink;
+	struct avl_node *n, *succ;
+	int depth = 0, at;
+
+	while ((n = *link) != NULL && n->start != start) {
+		path[depth++] = link;
+		link = (start < n->start) ? &n->left : &n->right;
+	}
+	if (n == NULL) {
+		return -1;
+	}
+
+	if (n->left == NULL || n->right == NULL) {
+		*link = n->left ? n->left : n->right;
+	} else {
+		/* Replace n with its successor, the leftmost node on its right */
+		at = depth;
+		path[depth++] = link;
+		slink = &n->right;
+		while ((*slink)->left != NULL) {
+			path[depth++] = slink;
+			slink = &(*slink)->left;
+		}
+		succ = *slink;
+		*slink = succ->right;
+		succ->left = n->left;
+		succ->right = n->right;
+		*link = succ;
+		/* The path went through n->right, which is now succ->right */
+		if (depth > at + 1) {
+			path[at + 1] = &succ->right;
+		}
+	}
+	node_free(ix, n);
+	ix->nspans--;
+
+	while (depth > 0) {
+		rebalance(path[--depth]);
+	}
+	return 0;
+}
+
+/* Find the span containing addr. Returns 0, or -1 if there is none. */
+int avl_index_find(const struct avl_index *ix, uintptr_t addr, struct avl_span *span)
+{
+	const struct avl_node *n = ix->root;
+
+	while (n != NULL) {
+		if (addr < n->start) {
+			n = n->left;
+		} else if (addr - n->start >= n->len) {
+			n = n->right;
+		} else {
+			span->start = n->start;
+			span->len = n->len;
+			span->data = n->data;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Find the lowest-addressed span of at least len bytes. Returns 0, or
+ * -1 if there is none.
+ */
+int avl_index_first_fit(const struct avl_index *ix, size_t len, struct avl_span *span)
+{
+	const struct avl_node *n = ix->root;
+
+	if (n == NULL || n->max_len < len) {
+		return -1;
+	}
+	for (;;) {
+		if (max_len(n->left) >= len) {
+			n = n->left;
+		} else if (n->len >= len) {
+			break;
+		} else {
+			n = n->right;	/* max_len says it is there */
+		}
+	}
+	span->start = n->start;
+	span->len = n->len;
+	span->data = n->data;
+	return 0;
+}
+
+/*
+ * Check the order, balance, heights and max_len of every node and the
+ * span count. Returns 0 if the index is consistent, -1 otherwise.
+ */
+int avl_index_check(const struct avl_index *ix)
+{
+	const struct avl_node *stack[AVL_MAX_HEIGHT];
+	const struct avl_node *n = ix->root, *prev = NULL;
+	long count = 0;
+	size_t m;
+	int depth = 0, hl, hr;
+
+	/* In-order walk: spans must be sorted and disjoint */
+	while (n != NULL || depth > 0) {
+		while (n != NULL) {
+			if (depth == AVL_MAX_HEIGHT) {
+				return -1;
+			}
+			stack[depth++] = n;
+			n = n->left;
+		}
+		n = stack[--depth];
+
+		if (prev != NULL && prev->start + prev->len > n->start) {
+			return -1;
+		}
+		hl = height(n->left);
+		hr = height(n->right);
+		if (hl - hr > 1 || hr - hl > 1 || n->height != (hl > hr ? hl : hr) + 1) {
+			return -1;
+		}
+		m = n->len;
+		if (max_len(n->left) > m) {
+			m = max_len(n->left);
+		}
+		if (max_len(n->right) > m) {
+			m = max_len(n->right);
+		}
+		if (n->len == 0 || n->max_len != m) {
+			return -1;
+		}
+		count++;
+		prev = n;
+		n = n->right;
+	}
+	return count == ix->nspans ? 0 : -1;
+}
@@ -0,0 +1,75 @@
+#ifndef _AVL_INDEX_H_
+#define _AVL_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Address index: a balanced (AVL) tree of disjoint address spans
+ * [start, start + len), each carrying a data pointer. It grew out of
+ * the tree in final_report/avl_alloc.c, which mapped a block address
+ * to its pageref.
+ *
+ * avl_index_lookup() maps an address to the data of the span that
+ * contains it, e.g. a block to its page's metadata. Every node also
+ * records the longest span in its subtree, so avl_index_first_fit()
+ * finds the lowest-addressed span of at least a given length, e.g.
+ * when the index holds free spans.
+ *
+ * Nothing is recursive, and errors are returned, never printed. Nodes
+ * come from a pool that is refilled with chunks of chunk_size bytes
+ * from get_chunk (mem_sbrk() in an allocator), and freed nodes are
+ * reused; chunks are never given back. The index does no locking.
+ */
+
+struct avl_node {
+	struct avl_node *left;
+	struct avl_node *right;
+	uintptr_t start;
+	size_t len;
+	size_t max_len;		/* longest len in this subtree */
+	void *data;
+	int height;		/* 1 for a leaf */
+};
+
+struct avl_index {
+	struct avl_node *root;
+	struct avl_node *free_nodes;
+	void *(*get_chunk)(size_t size);
+	size_t chunk_size;
+	long nspans;
+	long nchunks;
+};
+
+struct avl_span {
+	uintptr_t start;
+	size_t len;
+	void *data;
+};
+
+extern int avl_index_init (struct avl_index *ix, void *(*get_chunk)(size_t size),
+			   size_t chunk_size);
+extern int avl_index_insert (struct avl_index *ix, uintptr_t start, size_t len, void *data);
+extern int avl_index_remove (struct avl_index *ix, uintptr_t start);
+extern int avl_index_find (const struct avl_index *ix, uintptr_t addr, struct avl_span *span);
+extern int avl_index_first_fit (const struct avl_index *ix, size_t len, struct avl_span *span);
+extern int avl_index_check (const struct avl_index *ix);
+
+/* Data of the span containing addr, NULL if there is none */
+static inline void *avl_index_lookup(const struct avl_index *ix, uintptr_t addr)
+{
+	const struct avl_node *n = ix->root;
+
+	while (n != NULL) {
+		if (addr < n->start) {
+			n = n->left;
+		} else if (addr - n->start >= n->len) {
+			n = n->right;
+		} else {
+			return n->data;
+		}
+	}
+	return NULL;
+}
+
+#endif /* _AVL_INDEX_H_ */
@@ -0,0 +1,588 @@
+/*
+ * Address index, see btree_index.h.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "btree_index.h"
+
+/* Every node but the root has 9 or more children */
+#define BTREE_MAX_HEIGHT 24
+
+/* Number of keys of n that are <= addr; the padding never is */
+static inline int rank_generic(const struct btree_node *n, uintptr_t addr)
+{
+	int i, r = 0;
+
+	for (i = 0; i < BTREE_KEYS; i++) {
+		r += n->keys[i] <= addr;
+	}
+	return r;
+}
+
+#if defined(__x86_64__)
+/* The same with AVX2; keys and addr are below 2^63, so signed compares do */
+__attribute__((target("avx2,popcnt")))
+static inline int rank_avx2(const struct btree_node *n, uintptr_t addr)
+{
+	const __m256i *k = (const __m256i *)n->keys;
+	__m256i a = _mm256_set1_epi64x((long long)addr);
+	unsigned int gt;
+
+	gt = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_load_si256(k), a)));
+	gt |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_load_si256(k + 1), a))) << 4;
+	gt |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_load_si256(k + 2), a))) << 8;
+	gt |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_load_si256(k + 3), a))) << 12;
+	return BTREE_KEYS - __builtin_popcount(gt);
+}
+#endif
+
+/*
+ * Body of a lookup with the given rank function. A separator may be
+ * below the first key of its right subtree after removals, so when
+ * addr is below every key of its leaf, the span it may be in is the
+ * last one of the previous leaf.
+ */
+#define BTREE_LOOKUP(rank)						\
+	const struct btree_node *n = ix->root;				\
+	int i;								\
+									\
+	if (n == NULL || addr >= BTREE_NOKEY) {				\
+		return NULL;						\
+	}								\
+	while (!n->leaf) {						\
+		n = n->child[rank(n, addr)];				\
+	}								\
+	i = rank(n, addr);						\
+	if (i == 0) {							\
+		if ((n = n->prev) == NULL) {				\
+			return NULL;					\
+		}							\
+		i = n->nkeys;						\
+	}								\
+	i--;								\
+	return addr - n->keys[i] < n->len[i] ? n->data[i] : NULL;
+
+static void *lookup_generic(const struct btree_index *ix, uintptr_t addr)
+{
+	BTREE_LOOKUP(rank_generic)
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,popcnt")))
+static void *lookup_avx2(const struct btree_index *ix, uintptr_t addr)
+{
+	BTREE_LOOKUP(rank_avx2)
+}
+#endif
+
+/* Refill the pool until it holds at least count nodes */
+static int node_reserve(struct btree_index *ix, long count)
+{
+	struct btree_node *n;
+	uintptr_t p, end;
+
+	while (ix->nfree < count) {
+		p = (uintptr_t)ix->get_chunk(ix->chunk_size);
+		if (p == 0) {
+			return -1;
+		}
+		end = p + ix->chunk_size;
+		p = (p + 63) & ~(uintptr_t)63;
+		for (; p + sizeof(struct btree_node) <= end; p += sizeof(struct btree_node)) {
+			n = (struct btree_node *)p;
+			n->child[0] = ix->free_nodes;
+			ix->free_nodes = n;
+			ix->nfree++;
+		}
+		ix->nchunks++;
+	}
+	return 0;
+}
+
+/* An empty node from the pool, which node_reserve() has filled */
+static struct btree_node *node_alloc(struct btree_index *ix, int leaf)
+{
+	struct btree_node *n = ix->free_nodes;
+	int i;
+
+	ix->free_nodes = n->child[0];
+	ix->nfree--;
+	for (i = 0; i < BTREE_KEYS; i++) {
+		n->keys[i] = BTREE_NOKEY;
+	}
+	n->nkeys = 0;
+	n->leaf = leaf;
+	if (leaf) {
+		n->prev = n->next = NULL;
+	}
+	return n;
+}
+
+static void node_free(struct btree_index *ix, struct btree_node *n)
+{
+	n->child[0] = ix->free_nodes;
+	ix->free_nodes = n;
+	ix->nfree++;
+}
+
+/* Fill the key slots from nkeys on with BTREE_NOKEY */
+static inline void pad(struct btree_node *n)
+{
+	int i;
+
+	for (i = n->nkeys; i < BTREE_KEYS; i++) {
+		n->keys[i] = BTREE_NOKEY;
+	}
+}
+
+/* Put a span at position i of a leaf that has room */
+static void leaf_insert(struct btree_node *n, int i, uintptr_t start, size_t len, void *data)
+{
+	int m = n->nkeys - i;
+
+	memmove(&n->keys[i + 1], &n->keys[i], m * sizeof(n->keys[0]));
+	memmove(&n->len[i + 1], &n->len[i], m * sizeof(n->len[0]));
+	memmove(&n->data[i + 1], &n->data[i], m * sizeof(n->data[0]));
+	n->keys[i] = start;
+	n->len[i] = len;
+	n->data[i] = data;
+	n->nkeys++;
+}
+
+static void leaf_delete(struct btree_node *n, int i)
+{
+	int m = n->nkeys - i - 1;
+
+	memmove(&n->keys[i], &n->keys[i + 1], m * sizeof(n->keys[0]));
+	memmove(&n->len[i], &n->len[i + 1], m * sizeof(n->len[0]));
+	memmove(&n->data[i], &n->data[i + 1], m * sizeof(n->data[0]));
+	n->nkeys--;
+	pad(n);
+}
+
+/* Move the spans from position i of leaf from to the end of leaf to */
+static void leaf_move(struct btree_node *to, struct btree_node *from, int i)
+{
+	int m = from->nkeys - i;
+
+	memcpy(&to->keys[to->nkeys], &from->keys[i], m * sizeof(from->keys[0]));
+	memcpy(&to->len[to->nkeys], &from->len[i], m * sizeof(from->len[0]));
+	memcpy(&to->data[to->nkeys], &from->data[i], m * sizeof(from->data[0]));
+	to->nkeys += m;
+	from->nkeys = i;
+	pad(to);
+	pad(from);
+}
+
+/* Put separator key and its right child at position i of an inner node with room */
+static void inner_insert(struct btree_node *n, int i, uintptr_t key, struct btree_node *right)
+{
+	int m = n->nkeys - i;
+
+	memmove(&n->keys[i + 1], &n->keys[i], m * sizeof(n->keys[0]));
+	memmove(&n->child[i + 2], &n->child[i + 1], m * sizeof(n->child[0]));
+	n->keys[i] = key;
+	n->child[i + 1] = right;
+	n->nkeys++;
+}
+
+/* Remove separator i and the child to its right */
+static void inner_delete(struct btree_node *n, int i)
+{
+	int m = n->nkeys - i - 1;
+
+	memmove(&n->keys[i], &n->keys[i + 1], m * sizeof(n->keys[0]));
+	memmove(&n->child[i + 1], &n->child[i + 2], m * sizeof(n->child[0]));
+	n->nkeys--;
+	pad(n);
+}
+
+/*
+ * Start an empty index. get_chunk(chunk_size) is called whenever the
+ * node pool is empty. Returns -1 if a chunk cannot hold a node.
+ */
+int btree_index_init(struct btree_index *ix, void *(*get_chunk)(size_t size), size_t chunk_size)
+{
+	const char *simd = getenv("MM_BTREE_SIMD");
+
+	ix->root = NULL;
+	ix->free_nodes = NULL;
+	ix->get_chunk = get_chunk;
+	ix->chunk_size = chunk_size;
+	ix->nfree = 0;
+	ix->nspans = 0;
+	ix->nchunks = 0;
+	ix->height = 0;
+	ix->lookup = lookup_generic;
+	ix->simd = 0;
+#if defined(__x86_64__)
+	if (!(simd && strcmp(simd, "0") == 0) && __builtin_cpu_supports("avx2")) {
+		ix->lookup = lookup_avx2;
+		ix->simd = 1;
+	}
+#else
+	(void)simd;
+#endif
+	return chunk_size < sizeof(struct btree_node) + 63 ? -1 : 0;
+}
+
+/*
+ * Add the span [start, start + len). Returns -1 if it is empty, ends
+ * above BTREE_NOKEY, overlaps a span already in the index, or no node
+ * can be allocated.
+ */
+int btree_index_insert(struct btree_index *ix, uintptr_t start, size_t len, void *data)
+{
+	struct btree_node *path[BTREE_MAX_HEIGHT];
+	int pos[BTREE_MAX_HEIGHT];
+	struct btree_node *n, *p, *right, *newroot;
+	uintptr_t key, keys[BTREE_KEYS + 1];
+	struct btree_node *child[BTREE_KEYS + 2];
+	int depth = 0, i, j, need;
+
+	if (len == 0 || start + len < start || start + len > BTREE_NOKEY) {
+		return -1;
+	}
+	if (ix->root == NULL) {
+		if (node_reserve(ix, 1) != 0) {
+			return -1;
+		}
+		ix->root = node_alloc(ix, 1);
+		ix->height = 1;
+	}
+
+	n = ix->root;
+	while (!n->leaf) {
+		i = rank_generic(n, start);
+		path[depth] = n;
+		pos[depth++] = i;
+		n = n->child[i];
+	}
+	i = rank_generic(n, start);
+
+	/* The spans either side must end before start and begin after it */
+	p = n;
+	j = i - 1;
+	if (i == 0 && (p = n->prev) != NULL) {
+		j = p->nkeys - 1;
+	}
+	if (p != NULL && j >= 0 && p->keys[j] + p->len[j] > start) {
+		return -1;
+	}
+	if (i < n->nkeys ? start + len > n->keys[i] :
+	    (n->next != NULL && start + len > n->next->keys[0])) {
+		return -1;
+	}
+
+	/* Every full node on the way up splits, and a full root adds a level */
+	need = 0;
+	if (n->nkeys == BTREE_KEYS) {
+		need = 1;
+		for (j = depth - 1; j >= 0 && path[j]->nkeys == BTREE_KEYS; j--) {
+			need++;
+		}
+		if (j < 0) {
+			need++;
+		}
+	}
+	if (node_reserve(ix, need) != 0) {
+		return -1;
+	}
+	ix->nspans++;
+
+	if (n->nkeys < BTREE_KEYS) {
+		leaf_insert(n, i, start, len, data);
+		return 0;
+	}
+
+	/* Split the leaf in halves, linked in order, and put the span in one */
+	right = node_alloc(ix, 1);
+	leaf_move(right, n, BTREE_KEYS / 2);
+	right->next = n->next;
+	right->prev = n;
+	if (n->next != NULL) {
+		n->next->prev = right;
+	}
+	n->next = right;
+	if (i <= BTREE_KEYS / 2) {
+		leaf_insert(n, i, start, len, data);
+	} else {
+		leaf_insert(right, i - BTREE_KEYS / 2, start, len, data);
+	}
+	key = right->keys[0];
+
+	/* Hand the separator up, splitting full inner nodes */
+	while (depth > 0) {
+		p = path[--depth];
+		i = pos[depth];
+		if (p->nkeys < BTREE_KEYS) {
+			inner_insert(p, i, key, right);
+			return 0;
+		}
+
+		memcpy(keys, p->keys, i * sizeof(keys[0]));
+		keys[i] = key;
+		memcpy(&keys[i + 1], &p->keys[i], (BTREE_KEYS - i) * sizeof(keys[0]));
+		memcpy(child, p->child, (i + 1) * sizeof(child[0]));
+		child[i + 1] = right;
+		memcpy(&child[i + 2], &p->child[i + 1], (BTREE_KEYS - i) * sizeof(child[0]));
+
+		/* The middle key of the BTREE_KEYS + 1 goes up */
+		right = node_alloc(ix, 0);
+		p->nkeys = BTREE_KEYS / 2;
+		memcpy(p->keys, keys, p->nkeys * sizeof(keys[0]));
+		memcpy(p->child, child, (p->nkeys + 1) * sizeof(child[0]));
+		pad(p);
+		right->nkeys = BTREE_KEYS / 2;
+		memcpy(right->keys, &keys[BTREE_KEYS / 2 + 1], right->nkeys * sizeof(keys[0]));
+		memcpy(right->child, &child[BTREE_KEYS / 2 + 1], (right->nkeys + 1) * sizeof(child[0]));
+		key = keys[BTREE_KEYS / 2];
+	}
+
+	newroot = node_alloc(ix, 0);
+	newroot->nkeys = 1;
+	newroot->keys[0] = key;
+	newroot->child[0] = ix->root;
+	newroot->child[1] = right;
+	ix->root = newroot;
+	ix->height++;
+	return 0;
+}
+
+/* Give n, child ci of p, the last entry of its left sibling l */
+static void borrow_left(struct btree_node *p, int ci, struct btree_node *l, struct btree_node *n)
+{
+	int last = l->nkeys - 1;
+
+	if (n->leaf) {
+		leaf_insert(n, 0, l->keys[last], l->len[last], l->data[last]);
+		p->keys[ci - 1] = n->keys[0];
+		l->nkeys--;
+	} else {
+		memmove(&n->keys[1], &n->keys[0], n->nkeys * sizeof(n->keys[0]));
+		memmove(&n->child[1], &n->child[0], (n->nkeys + 1) * sizeof(n->child[0]));
+		n->keys[0] = p->keys[ci - 1];
+		n->child[0] = l->child[last + 1];
+		n->nkeys++;
+		p->keys[ci - 1] = l->keys[last];
+		l->nkeys--;
+	}
+	pad(l);
+}
+
+/* Give n, child ci of p, the first entry of its right sibling r */
+static void borrow_right(struct btree_node *p, int ci, struct btree_node *n, struct btree_node *r)
+{
+	if (n->leaf) {
+		leaf_insert(n, n->nkeys, r->keys[0], r->len[0], r->data[0]);
+		leaf_delete(r, 0);
+		p->keys[ci] = r->keys[0];
+	} else {
+		n->keys[n->nkeys] = p->keys[ci];
+		n->child[n->nkeys + 1] = r->child[0];
+		n->nkeys++;
+		p->keys[ci] = r->keys[0];
+		memmove(&r->keys[0], &r->keys[1], (r->nkeys - 1) * sizeof(r->keys[0]));
+		memmove(&r->child[0], &r->child[1], r->nkeys * sizeof(r->child[0]));
+		r->nkeys--;
+		pad(r);
+	}
+}
+
+/* Append r, child k + 1 of p, to its left sibling l and free it */
+static void merge(struct btree_index *ix, struct btree_node *p, int k,
+		  struct btree_node *l, struct btree_node *r)
+{
+	if (l->leaf) {
+		leaf_move(l, r, 0);
+		l->next = r->next;
+		if (r->next != NULL) {
+			r->next->prev = l;
+		}
+	} else {
+		l->keys[l->nkeys] = p->keys[k];
+		memcpy(&l->keys[l->nkeys + 1], r->keys, r->nkeys * sizeof(r->keys[0]));
+		memcpy(&l->child[l->nkeys + 1], r->child, (r->nkeys + 1) * sizeof(r->child[0]));
+		l->nkeys += r->nkeys + 1;
+	}
+	inner_delete(p, k);
+	node_free(ix, r);
+}
+
+/* Remove the span that starts at start. Returns -1 if there is none. */
+int btree_index_remove(struct btree_index *ix, uintptr_t start)
+{
+	struct btree_node *path[BTREE_MAX_HEIGHT];
+	int pos[BTREE_MAX_HEIGHT];
+	struct btree_node *n = ix->root, *p, *l, *r;
+	int depth = 0, i, ci;
+
+	if (n == NULL || start >= BTREE_NOKEY) {
+		return -1;
+	}
+	while (!n->leaf) {
+		i = rank_generic(n, start);
+		path[depth] = n;
+		pos[depth++] = i;
+		n = n->child[i];
+	}
+	i = rank_generic(n, start) - 1;
+	if (i < 0 || n->keys[i] != start) {
+		return -1;
+	}
+	leaf_delete(n, i);
+	ix->nspans--;
+
+	/* Refill nodes that ran low from a sibling, or merge them with one */
+	while (depth > 0 && n->nkeys < BTREE_MIN_KEYS) {
+		p = path[--depth];
+		ci = pos[depth];
+		l = ci > 0 ? p->child[ci - 1] : NULL;
+		r = ci < p->nkeys ? p->child[ci + 1] : NULL;
+		if (l != NULL && l->nkeys > BTREE_MIN_KEYS) {
+			borrow_left(p, ci, l, n);
+			break;
+		}
+		if (r != NULL && r->nkeys > BTREE_MIN_KEYS) {
+			borrow_right(p, ci, n, r);
+			break;
+		}
+		if (l != NULL) {
+			merge(ix, p, ci - 1, l, n);
+		} else {
+			merge(ix, p, ci, n, r);
+		}
+		n = p;
+	}
+
+	n = ix->root;
+	if (!n->leaf && n->nkeys == 0) {
+		ix->root = n->child[0];
+		ix->height--;
+		node_free(ix, n);
+	} else if (n->leaf && n->nkeys == 0) {
+		ix->root = NULL;
+		ix->height = 0;
+		node_free(ix, n);
+	}
+	return 0;
+}
+
+/* Find the span containing addr. Returns 0, or -1 if there is none. */
+int btree_index_find(const struct btree_index *ix, uintptr_t addr, struct btree_span *span)
+{
+	const struct btree_node *n = ix->root;
+	int i;
+
+	if (n == NULL || addr >= BTREE_NOKEY) {
+		return -1;
+	}
+	while (!n->leaf) {
+		n = n->child[rank_generic(n, addr)];
+	}
+	i = rank_generic(n, addr);
+	if (i == 0) {
+		if ((n = n->prev) == NULL) {
+			return -1;
+		}
+		i = n->nkeys;
+	}
+	i--;
+	if (addr - n->keys[i] >= n->len[i]) {
+		return -1;
+	}
+	span->start = n->keys[i];
+	span->len = n->len[i];
+	span->data = n->data[i];
+	return 0;
+}
+
+/*
+ * Check key order, bounds, padding and fill of every node, that all
+ * leaves are at the same depth, the leaf links, and the span count.
+ * Returns 0 if the index is consistent, -1 otherwise.
+ */
+int btree_index_check(const struct btree_index *ix)
+{
+	struct {
+		const struct btree_node *n;
+		uintptr_t lo, hi;	/* keys of n are in [lo, hi) */
+		int depth;
+	} stack[BTREE_MAX_HEIGHT * (BTREE_KEYS + 1)];
+	const struct btree_node *n, *prev;
+	uintptr_t lo, hi, end = 0;
+	long leaves = 0, count = 0;
+	int top = 0, depth, i;
+
+	if (ix->root == NULL) {
+		return ix->nspans == 0 && ix->height == 0 ? 0 : -1;
+	}
+
+	stack[top].n = ix->root;
+	stack[top].lo = 0;
+	stack[top].hi = BTREE_NOKEY;
+	stack[top++].depth = 1;
+	while (top > 0) {
+		top--;
+		n = stack[top].n;
+		lo = stack[top].lo;
+		hi = stack[top].hi;
+		depth = stack[top].depth;
+
+		if (n->nkeys > BTREE_KEYS || n->nkeys < (n == ix->root ? 1 : BTREE_MIN_KEYS)) {
+			return -1;
+		}
+		for (i = 0; i < BTREE_KEYS; i++) {
+			if (i < n->nkeys) {
+				if (n->keys[i] < lo || n->keys[i] >= hi ||
+				    (i > 0 && n->keys[i] <= n->keys[i - 1])) {
+					return -1;
+				}
+			} else if (n->keys[i] != BTREE_NOKEY) {
+				return -1;
+			}
+		}
+		if (n->leaf) {
+			if (depth != ix->height) {
+				return -1;
+			}
+			leaves++;
+			continue;
+		}
+		if (depth >= BTREE_MAX_HEIGHT) {
+			return -1;
+		}
+		for (i = 0; i <= n->nkeys; i++) {
+			stack[top].n = n->child[i];
+			stack[top].lo = i > 0 ? n->keys[i - 1] : lo;
+			stack[top].hi = i < n->nkeys ? n->keys[i] : hi;
+			stack[top++].depth = depth + 1;
+		}
+	}
+
+	/* Leaves from the leftmost on: spans sorted and disjoint */
+	for (n = ix->root; !n->leaf; n = n->child[0])
+		;
+	for (prev = NULL; n != NULL; prev = n, n = n->next) {
+		if (n->prev != prev) {
+			return -1;
+		}
+		for (i = 0; i < n->nkeys; i++) {
+			if (n->len[i] == 0 || n->keys[i] < end) {
+				return -1;
+			}
+			end = n->keys[i] + n->len[i];
+			count++;
+		}
+		leaves--;
+	}
+	return leaves == 0 && count == ix->nspans ? 0 : -1;
+}
@@ -0,0 +1,83 @@
+#ifndef _BTREE_INDEX_H_
+#define _BTREE_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Address index: a B+tree of disjoint address spans [start, start +
+ * len), each carrying a data pointer, with the insert, remove and find
+ * interface of avl_index.h (but no first fit).
+ *
+ * Where an AVL lookup chases one pointer per level across nodes that
+ * each hold a single span, a node here holds BTREE_KEYS sorted keys in
+ * its first two cache lines, so a lookup touches about log16(n) nodes.
+ * Inner nodes hold separators and children, leaves hold the spans and
+ * are linked in address order. Within a node the position is found by
+ * counting the keys not above the address, without branches; on x86
+ * with AVX2 that is four 4-wide compares, chosen at btree_index_init()
+ * unless MM_BTREE_SIMD=0 is in the environment. Unused key slots hold
+ * BTREE_NOKEY so every compare can cover the whole node; spans must
+ * therefore end below it, which user addresses always do.
+ *
+ * Nodes come from a pool refilled with chunks of chunk_size bytes from
+ * get_chunk, as in avl_index.h, and are 64-byte aligned within them.
+ * Nothing is recursive, errors are returned, and the index does no
+ * locking.
+ */
+
+#define BTREE_KEYS 16			/* keys per node */
+#define BTREE_MIN_KEYS (BTREE_KEYS / 2)	/* in every node but the root */
+#define BTREE_NOKEY ((uintptr_t)INT64_MAX)
+
+struct btree_node {
+	uintptr_t keys[BTREE_KEYS];	/* sorted; BTREE_NOKEY from nkeys on */
+	int nkeys;
+	int leaf;
+	union {
+		struct btree_node *child[BTREE_KEYS + 1];	/* inner */
+		struct {					/* leaf */
+			size_t len[BTREE_KEYS];
+			void *data[BTREE_KEYS];
+			struct btree_node *prev;
+			struct btree_node *next;
+		};
+	};
+} __attribute__((aligned(64)));
+
+struct btree_index;
+typedef void *(*btree_lookup_fn)(const struct btree_index *ix, uintptr_t addr);
+
+struct btree_index {
+	struct btree_node *root;
+	btree_lookup_fn lookup;		/* SIMD or generic, see btree_index_init() */
+	struct btree_node *free_nodes;
+	void *(*get_chunk)(size_t size);
+	size_t chunk_size;
+	long nfree;
+	long nspans;
+	long nchunks;
+	int height;			/* 1 for a single leaf, 0 if empty */
+	int simd;			/* lookups use SIMD compares */
+};
+
+struct btree_span {
+	uintptr_t start;
+	size_t len;
+	void *data;
+};
+
+extern int btree_index_init (struct btree_index *ix, void *(*get_chunk)(size_t size),
+			     size_t chunk_size);
+extern int btree_index_insert (struct btree_index *ix, uintptr_t start, size_t len, void *data);
+extern int btree_index_remove (struct btree_index *ix, uintptr_t start);
+extern int btree_index_find (const struct btree_index *ix, uintptr_t addr, struct btree_span *span);
+extern int btree_index_check (const struct btree_index *ix);
+
+/* Data of the span containing addr, NULL if there is none */
+static inline void *btree_index_lookup(const struct btree_index *ix, uintptr_t addr)
+{
+	return ix->lookup(ix, addr);
+}
+
+#endif /* _BTREE_INDEX_H_ */
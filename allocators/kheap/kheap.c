@@ -63,10 +63,29 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    To find the page a freed block belongs to, a page map indexed by
+//    page number within the data segment points at each subpage
+//    page's pageref.  The map is two-level, and its leaves are pages
+//    taken with mem_sbrk() when a part of the segment first holds a
+//    subpage page, so it grows with the heap like the pagerefs do.
+//
 
 #undef  SLOW	/* consistency checks */
 #undef SLOWER	/* lots of consistency checks */
 
+//
+//    Locking: by default everything runs under the single malloc_lock,
+//    taken in mm_malloc and mm_free. Built with -DKHEAP_FINE_LOCKS,
+//    there is instead one lock per size class, one for the pageref
+//    lists, one for the big chunks and one for mem_sbrk(), so threads
+//    working on different size classes do not wait for each other.
+//    The page map is read without a lock: the entry for a live block
+//    does not change, and a page never moves between the subpage
+//    pool and the big chunks. Locks are taken in the order size
+//    class, pagerefs, big chunks, sbrk. The SLOW checks assume a
+//    single thread.
+//
+
 ////////////////////////////////////////
 
 
@@ -93,14 +112,16 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next;
+	struct pageref *prev;	/* only while on a sizebases list */
 	struct freelist *flist;
 	vaddr_t pageaddr_and_blocktype;
 	int nfree;
 };
 
 struct big_freelist {
-	int npages;
+	int npages;		/* same place as the header of a big block */
 	struct big_freelist *next;
+	struct big_freelist *prev;
 };
 
 #define INVALID_OFFSET   (0xffff)
@@ -122,16 +143,120 @@ struct big_freelist {
  * recycled_refs == pagerefs that refer to a completely empty
  *                  page of memory
  * sizebases == array of lists of pagerefs; each entry corresponds
- *              to a particular object size, and holds the list
- *              of in-use pagerefs for that size.
+ *              to a particular object size, and holds the
+ *              pagerefs for that size that have free blocks.
+ *              Full pages are on no list, they are found
+ *              through the page map when a block is freed.
  *
- * We also have a special list for large allocations.
+ * We also have special lists for large allocations: bigbins[k]
+ * holds the free chunks of 2^k to 2^(k+1)-1 pages, and bit k of
+ * bigbin_mask is set when it is not empty. The first and last
+ * page of every big chunk, free or allocated, carry a boundary
+ * tag in the page map, so a freed chunk can be merged with free
+ * neighbours. The tags cannot live in the chunks themselves,
+ * because the neighbour of a big chunk may be a subpage page whose
+ * words all belong to the user.
  */
 
 static struct pageref *fresh_refs; /* static global, initially 0 */
 static struct pageref *recycled_refs;
 static struct pageref *sizebases[NSIZES];
-static struct big_freelist *bigchunks;
+#define NBIGBINS 32
+static struct big_freelist *bigbins[NBIGBINS];
+static unsigned int bigbin_mask;
+static long big_pages_in_use;	/* for mm_stats */
+
+/*
+ * Page map: pagemap[n / PAGEMAP_LEAF][n % PAGEMAP_LEAF] is the pageref
+ * of page n of the data segment if that page holds subpage blocks,
+ * a boundary tag if it is the first or last page of a big chunk, and
+ * NULL otherwise.
+ */
+#define PAGEMAP_LEAF (PAGE_SIZE / sizeof(struct pageref *))
+#define PAGEMAP_DIR  (DSEG_MAX / PAGE_SIZE / PAGEMAP_LEAF + 1)
+
+static struct pageref **pagemap[PAGEMAP_DIR];
+
+#ifdef KHEAP_FINE_LOCKS
+static pthread_mutex_t size_locks[NSIZES] = {
+	[0 ... NSIZES-1] = PTHREAD_MUTEX_INITIALIZER
+};
+static pthread_mutex_t ref_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+#define FINE_LOCK(l)	pthread_mutex_lock(&(l))
+#define FINE_UNLOCK(l)	pthread_mutex_unlock(&(l))
+#else
+#define FINE_LOCK(l)	((void)0)
+#define FINE_UNLOCK(l)	((void)0)
+#endif
+
+static
+void *
+kheap_sbrk(ptrdiff_t increment)
+{
+	void *p;
+
+	FINE_LOCK(sbrk_lock);
+	p = mem_sbrk(increment);
+	FINE_UNLOCK(sbrk_lock);
+	return p;
+}
+
+/* Boundary tags have the low bit set, which a pageref address never has */
+#define BIG_TAG(npages, isfree) \
+	((struct pageref *)(((vaddr_t)(npages) << 2) | ((isfree) ? 2 : 0) | 1))
+#define IS_BIG_TAG(pr)   ((vaddr_t)(pr) & 1)
+#define BIG_ISFREE(pr)   ((vaddr_t)(pr) & 2)
+#define BIG_NPAGES(pr)   ((int)((vaddr_t)(pr) >> 2))
+
+static
+struct pageref *
+pagemap_lookup(vaddr_t addr)
+{
+	size_t n;
+
+	if (addr < (vaddr_t)dseg_lo || addr > (vaddr_t)dseg_hi) {
+		return NULL;
+	}
+	n = (addr - (vaddr_t)dseg_lo) / PAGE_SIZE;
+	if (pagemap[n / PAGEMAP_LEAF] == NULL) {
+		return NULL;
+	}
+	return pagemap[n / PAGEMAP_LEAF][n % PAGEMAP_LEAF];
+}
+
+/* Returns -1 if there is no memory for a new leaf */
+static
+int
+pagemap_set(vaddr_t pageaddr, struct pageref *pr)
+{
+	size_t n = (pageaddr - (vaddr_t)dseg_lo) / PAGE_SIZE;
+	struct pageref **leaf = pagemap[n / PAGEMAP_LEAF];
+
+	if (leaf == NULL) {
+		if (pr == NULL) {
+			return 0;
+		}
+		/* Another size class may be adding the same leaf */
+		FINE_LOCK(sbrk_lock);
+		leaf = pagemap[n / PAGEMAP_LEAF];
+		if (leaf == NULL) {
+			leaf = (struct pageref **)mem_sbrk(PAGE_SIZE);
+			if (leaf != NULL) {
+				bzero(leaf, PAGE_SIZE);
+				__sync_synchronize();
+				pagemap[n / PAGEMAP_LEAF] = leaf;
+			}
+		}
+		FINE_UNLOCK(sbrk_lock);
+		if (leaf == NULL) {
+			return -1;
+		}
+	}
+	leaf[n % PAGEMAP_LEAF] = pr;
+	return 0;
+}
 
 static
 struct pageref *
@@ -139,12 +264,15 @@ allocpageref(void)
 {
 	struct pageref *ref;
 
+	FINE_LOCK(ref_lock);
+
 	/* Use a pageref that already has a page allocated,
 	 * if there are any.
 	 */
 	if (recycled_refs) {
 		ref = recycled_refs;
 		recycled_refs = recycled_refs->next;
+		FINE_UNLOCK(ref_lock);
 		return ref;
 	}
 
@@ -152,6 +280,7 @@ allocpageref(void)
 	if (fresh_refs) {
 		ref = fresh_refs;
 		fresh_refs = fresh_refs->next;
+		FINE_UNLOCK(ref_lock);
 		return ref;
 	}
 
@@ -159,7 +288,7 @@ allocpageref(void)
 	 * getting a page with mem_sbrk()
 	 */
 
-	ref = (struct pageref *)mem_sbrk(PAGE_SIZE);
+	ref = (struct pageref *)kheap_sbrk(PAGE_SIZE);
 	if (ref) {
 		bzero(ref, PAGE_SIZE);
 		fresh_refs = ref+1;
@@ -172,6 +301,7 @@ allocpageref(void)
 		}
 		tmp->next = NULL;
 	}
+	FINE_UNLOCK(ref_lock);
 	return ref;
 
 }
@@ -180,8 +310,10 @@ static
 void
 freepageref(struct pageref *p)
 {
+	FINE_LOCK(ref_lock);
 	p->next = recycled_refs;
 	recycled_refs = p;
+	FINE_UNLOCK(ref_lock);
 }
 
 
@@ -237,6 +369,9 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next) {
 			checksubpage(pr);
+			assert(pr->nfree > 0);
+			assert(pr->next == NULL || pr->next->prev == pr);
+			assert(pagemap_lookup(PR_PAGEADDR(pr)) == pr);
 			sc++;
 		}
 	}
@@ -252,18 +387,32 @@ static
 void
 remove_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
-
 	assert(blktype>=0 && blktype<NSIZES);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next;
-			break;
-		}
+	if (pr->prev) {
+		pr->prev->next = pr->next;
+	} else {
+		assert(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next;
+	}
+	if (pr->next) {
+		pr->next->prev = pr->prev;
 	}
+	pr->next = pr->prev = NULL;
+}
+
+static
+void
+insert_lists(struct pageref *pr, int blktype)
+{
+	assert(blktype>=0 && blktype<NSIZES);
 
+	pr->prev = NULL;
+	pr->next = sizebases[blktype];
+	if (pr->next) {
+		pr->next->prev = pr;
+	}
+	sizebases[blktype] = pr;
 }
 
 static
@@ -305,35 +454,37 @@ subpage_kmalloc(size_t sz)
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next) {
+	/* Every page on the list has a free block */
+	pr = sizebases[blktype];
+	if (pr != NULL) {
 
 		/* check for corruption */
 		assert(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
+		assert(pr->nfree > 0);
 
-		if (pr->nfree > 0) {
+	doalloc: /* comes here after getting a whole fresh page */
 
-		doalloc: /* comes here after getting a whole fresh page */
+		prpage = PR_PAGEADDR(pr);
+		fl = pr->flist;
 
-			prpage = PR_PAGEADDR(pr);
-			fl = pr->flist;
-
-			retptr = pr->flist;
-			pr->flist = pr->flist->next;
-			pr->nfree--;
-
-			if (pr->flist != NULL) {
-				assert(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				assert(fla - prpage < PAGE_SIZE);
-			}
-			else {
-				assert(pr->nfree == 0);
-			}
+		retptr = pr->flist;
+		pr->flist = pr->flist->next;
+		pr->nfree--;
 
-			checksubpages();
-			return retptr;
+		if (pr->flist != NULL) {
+			assert(pr->nfree > 0);
+			fla = (vaddr_t)fl;
+			assert(fla - prpage < PAGE_SIZE);
+		}
+		else {
+			/* Page is full, take it off the list */
+			assert(pr->nfree == 0);
+			remove_lists(pr, blktype);
 		}
+
+		checksubpages();
+		return retptr;
 	}
 
 	/*
@@ -350,7 +501,7 @@ subpage_kmalloc(size_t sz)
 
 	prpage = PR_PAGEADDR(pr);
 	if (prpage == 0) {
-		prpage = (vaddr_t)mem_sbrk(PAGE_SIZE);
+		prpage = (vaddr_t)kheap_sbrk(PAGE_SIZE);
 		if (prpage==0) {
 			/* Out of memory. */
 			freepageref(pr);
@@ -358,6 +509,13 @@ subpage_kmalloc(size_t sz)
 			return NULL;
 		}
 	}
+	if (pagemap_set(prpage, pr) != 0) {
+		/* The page stays with the pageref for next time */
+		pr->pageaddr_and_blocktype = MKPAB(prpage, 0);
+		freepageref(pr);
+		printf("malloc: Subpage allocator couldn't extend the page map\n");
+		return NULL;
+	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
@@ -375,8 +533,7 @@ subpage_kmalloc(size_t sz)
 	pr->flist = fl;
 	assert((vaddr_t)pr->flist == prpage+(pr->nfree-1)*sizes[blktype]);
 
-	pr->next = sizebases[blktype];
-	sizebases[blktype] = pr;
+	insert_lists(pr, blktype);
 
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
@@ -392,34 +549,28 @@ subpage_kfree(void *ptr)
 	struct pageref *pr=NULL;// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t offset;		// offset into page
-	int i;
 
 	ptraddr = (vaddr_t)ptr;
 
 	checksubpages();
 
-	/* Nasty search to find the page that this block came from */
-
-	for (i=0; i < NSIZES && pr==NULL; i++) {
-		for (pr = sizebases[i]; pr; pr = pr->next) {
-			prpage = PR_PAGEADDR(pr);
-			blktype = PR_BLOCKTYPE(pr);
-
-			/* check for corruption */
-			assert(blktype>=0 && blktype<NSIZES);
-			checksubpage(pr);
-
-			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-				break;
-			}
-		}
-	}
-
-	if (pr==NULL) {
+	/* Find the page that this block came from */
+	pr = pagemap_lookup(ptraddr);
+	if (pr==NULL || IS_BIG_TAG(pr)) {
 		/* Not on any of our pages - not a subpage allocation */
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	assert(blktype>=0 && blktype<NSIZES);
+	assert(ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE);
+
+	FINE_LOCK(size_locks[blktype]);
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -445,12 +596,76 @@ subpage_kfree(void *ptr)
 	assert(pr->nfree <= PAGE_SIZE / sizes[blktype]);
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
-		remove_lists(pr, blktype);
+		if (pr->nfree > 1) {
+			remove_lists(pr, blktype);
+		}
+		pagemap_set(prpage, NULL);
 		freepageref(pr);
+	} else if (pr->nfree == 1) {
+		/* Was full, can be allocated from again */
+		insert_lists(pr, blktype);
 	}
 
 	checksubpages();
+	FINE_UNLOCK(size_locks[blktype]);
+
+	return 0;
+}
+
+static
+inline
+int
+bigbin(int npages)
+{
+	return 31 - __builtin_clz((unsigned int)npages);
+}
+
+static
+void
+bigbin_insert(struct big_freelist *bf)
+{
+	int k = bigbin(bf->npages);
+
+	bf->prev = NULL;
+	bf->next = bigbins[k];
+	if (bf->next) {
+		bf->next->prev = bf;
+	}
+	bigbins[k] = bf;
+	bigbin_mask |= 1U << k;
+}
+
+static
+void
+bigbin_remove(struct big_freelist *bf)
+{
+	int k = bigbin(bf->npages);
+
+	if (bf->prev) {
+		bf->prev->next = bf->next;
+	} else {
+		bigbins[k] = bf->next;
+		if (bigbins[k] == NULL) {
+			bigbin_mask &= ~(1U << k);
+		}
+	}
+	if (bf->next) {
+		bf->next->prev = bf->prev;
+	}
+}
+
+/* Tag the first and last page of a big chunk. Returns -1 if out of memory. */
+static
+int
+big_settags(void *chunk, int npages, int isfree)
+{
+	vaddr_t first = (vaddr_t)chunk;
+	vaddr_t last = first + (vaddr_t)(npages - 1) * PAGE_SIZE;
 
+	if (pagemap_set(first, BIG_TAG(npages, isfree)) != 0 ||
+	    pagemap_set(last, BIG_TAG(npages, isfree)) != 0) {
+		return -1;
+	}
 	return 0;
 }
 
@@ -462,66 +677,125 @@ static void *big_kmalloc(int sz)
 	 * pages.
 	 */
 	
-	void *result = NULL;
+	struct big_freelist *tmp = NULL;
+	int *hdr_ptr = NULL;
+	unsigned int mask;
+	int k;
 
 	sz += SMALLEST_SUBPAGE_SIZE;
 	/* Round up to a whole number of pages. */
 	int npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 
-	/* Check if we happen to have a chunk of the right size already */
-	struct big_freelist *tmp = bigchunks;
-	struct big_freelist *prev = NULL;
-	while (tmp != NULL) {
+	/*
+	 * First fit in the bin of npages, whose chunks may be too
+	 * small. Any chunk in a higher bin is big enough, take the
+	 * smallest such bin.
+	 */
+	k = bigbin(npages);
+	for (tmp = bigbins[k]; tmp != NULL; tmp = tmp->next) {
+		if (tmp->npages >= npages) {
+			break;
+		}
+	}
+	mask = (k + 1 < NBIGBINS) ? bigbin_mask & ~((2U << k) - 1) : 0;
+	if (tmp == NULL && mask != 0) {
+		tmp = bigbins[__builtin_ctz(mask)];
+	}
+
+	if (tmp != NULL) {
+		bigbin_remove(tmp);
 		if (tmp->npages > npages) {
-			/* Carve the block in two pieces */
+			/* Carve the block in two pieces, the end is ours */
 			tmp->npages -= npages;
-			int *hdr_ptr = (int *)((char *)tmp+(tmp->npages*PAGE_SIZE));
-			*hdr_ptr = npages;
-			result = (void *)((char *)hdr_ptr + SMALLEST_SUBPAGE_SIZE);
-			break;
-		} else if (tmp->npages == npages) {
-			/* Remove block from freelist */
-			if (prev) {
-				prev->next = tmp->next;
-			} else {
-				bigchunks = tmp->next;
+			hdr_ptr = (int *)((char *)tmp+(tmp->npages*PAGE_SIZE));
+			if (big_settags(tmp, tmp->npages, 1) != 0 ||
+			    big_settags(hdr_ptr, npages, 0) != 0) {
+				/*
+				 * The new tags in the middle need a map leaf
+				 * there is no memory for. Put the chunk back
+				 * whole: its own end tags are still mapped,
+				 * and the middle ones must not stay behind.
+				 */
+				pagemap_set((vaddr_t)hdr_ptr - PAGE_SIZE, NULL);
+				pagemap_set((vaddr_t)hdr_ptr, NULL);
+				tmp->npages += npages;
+				big_settags(tmp, tmp->npages, 1);
+				bigbin_insert(tmp);
+				printf("malloc: big allocator couldn't extend the page map\n");
+				return NULL;
 			}
-			int *hdr_ptr = (int *)tmp;
-			assert(*hdr_ptr == npages);
-			result = (void *)((char *)hdr_ptr + SMALLEST_SUBPAGE_SIZE);
-			break;
+			bigbin_insert(tmp);
 		} else {
-			prev = tmp;
-			tmp = tmp->next;
+			hdr_ptr = (int *)tmp;
 		}
-	}
-
-	if (result == NULL) {
+	} else {
 		/* Nothing suitable in freelist... grab space with mem_sbrk */
-		int *hdr_ptr = (int *)mem_sbrk(npages*PAGE_SIZE);
-		if (hdr_ptr != NULL) {
-			*hdr_ptr = npages;
-			result = (void *)((char *)hdr_ptr + SMALLEST_SUBPAGE_SIZE);
+		hdr_ptr = (int *)kheap_sbrk(npages*PAGE_SIZE);
+		if (hdr_ptr == NULL) {
+			return NULL;
 		}
 	}
 
-	return result;
+	/*
+	 * Tagging a fresh chunk may need a new map leaf. Without memory
+	 * for one, the chunk is lost, like any memory this close to the
+	 * end of the segment.
+	 */
+	if (big_settags(hdr_ptr, npages, 0) != 0) {
+		printf("malloc: big allocator couldn't extend the page map\n");
+		return NULL;
+	}
+	*hdr_ptr = npages;
+	big_pages_in_use += npages;
+	return (void *)((char *)hdr_ptr + SMALLEST_SUBPAGE_SIZE);
 }
 
 static void big_kfree(void *ptr)
 {
-	/* Coalescing is unlikely to do much good (other page allocations
-	 * for small objects are likely to prevent big chunks from fitting
-	 * together), so we don't bother trying.
+	/* Merge with free chunks on either side, found through the
+	 * boundary tags. Subpage pages and allocated chunks in between
+	 * still keep free chunks from growing together.
 	 */
 
 	int *hdr_ptr = (int *)((char *)ptr - SMALLEST_SUBPAGE_SIZE);
-	//int npages = *hdr_ptr;
-
 	struct big_freelist *newfree = (struct big_freelist *) hdr_ptr;
+	struct big_freelist *nb;
+	struct pageref *tag;
+	int npages = *hdr_ptr;
+	vaddr_t first = (vaddr_t)hdr_ptr;
+	vaddr_t end = first + (vaddr_t)npages * PAGE_SIZE;
+
 	assert(newfree->npages == *hdr_ptr);
-	newfree->next = bigchunks;
-	bigchunks = newfree;
+	assert(pagemap_lookup(first) == BIG_TAG(npages, 0));
+	big_pages_in_use -= npages;
+
+	/* Chunk after this one */
+	tag = pagemap_lookup(end);
+	if (tag != NULL && IS_BIG_TAG(tag) && BIG_ISFREE(tag)) {
+		nb = (struct big_freelist *)end;
+		assert(nb->npages == BIG_NPAGES(tag));
+		bigbin_remove(nb);
+		pagemap_set(end - PAGE_SIZE, NULL);
+		pagemap_set(end, NULL);
+		npages += nb->npages;
+	}
+
+	/* Chunk before this one */
+	tag = (first > (vaddr_t)dseg_lo) ? pagemap_lookup(first - PAGE_SIZE) : NULL;
+	if (tag != NULL && IS_BIG_TAG(tag) && BIG_ISFREE(tag)) {
+		nb = (struct big_freelist *)(first - (vaddr_t)BIG_NPAGES(tag) * PAGE_SIZE);
+		assert(nb->npages == BIG_NPAGES(tag));
+		bigbin_remove(nb);
+		pagemap_set(first - PAGE_SIZE, NULL);
+		pagemap_set(first, NULL);
+		npages += nb->npages;
+		newfree = nb;
+	}
+
+	/* Both ends are already in the map, this cannot fail */
+	newfree->npages = npages;
+	big_settags(newfree, npages, 1);
+	bigbin_insert(newfree);
 }
 
 //
@@ -529,6 +803,41 @@ static void big_kfree(void *ptr)
 
 pthread_mutex_t malloc_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Everything, for mm_stats */
+static
+void
+lock_all(void)
+{
+#ifdef KHEAP_FINE_LOCKS
+	int i;
+
+	for (i = 0; i < NSIZES; i++) {
+		pthread_mutex_lock(&size_locks[i]);
+	}
+	pthread_mutex_lock(&ref_lock);
+	pthread_mutex_lock(&big_lock);
+#else
+	pthread_mutex_lock(&malloc_lock);
+#endif
+}
+
+static
+void
+unlock_all(void)
+{
+#ifdef KHEAP_FINE_LOCKS
+	int i;
+
+	pthread_mutex_unlock(&big_lock);
+	pthread_mutex_unlock(&ref_lock);
+	for (i = 0; i < NSIZES; i++) {
+		pthread_mutex_unlock(&size_locks[i]);
+	}
+#else
+	pthread_mutex_unlock(&malloc_lock);
+#endif
+}
+
 int mm_init(void)
 {
 	if (dseg_lo == NULL && dseg_hi == NULL) {
@@ -541,8 +850,14 @@ void *
 mm_malloc(size_t sz)
 {
 	void *result;
+#ifdef KHEAP_FINE_LOCKS
+	pthread_mutex_t *lock = (sz>=LARGEST_SUBPAGE_SIZE) ?
+		&big_lock : &size_locks[blocktype(sz)];
+#else
+	pthread_mutex_t *lock = &malloc_lock;
+#endif
 
-	pthread_mutex_lock(&malloc_lock);
+	pthread_mutex_lock(lock);
 
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		result = big_kmalloc(sz);
@@ -550,7 +865,7 @@ mm_malloc(size_t sz)
 		result = subpage_kmalloc(sz);
 	}
 
-	pthread_mutex_unlock(&malloc_lock);
+	pthread_mutex_unlock(lock);
 
 	return result;
 }
@@ -564,11 +879,63 @@ mm_free(void *ptr)
 	if (ptr == NULL) {
 		return;
 	} else {
+#ifdef KHEAP_FINE_LOCKS
+	  /* subpage_kfree takes the size class lock once it knows it */
+	  if (subpage_kfree(ptr)) {
+		  pthread_mutex_lock(&big_lock);
+		  big_kfree(ptr);
+		  pthread_mutex_unlock(&big_lock);
+	  }
+#else
 	  pthread_mutex_lock(&malloc_lock);
 	  if (subpage_kfree(ptr)) {
 		  big_kfree(ptr);
 	  }
 	  pthread_mutex_unlock(&malloc_lock);
+#endif
 	}
 }
 
+/*
+ * Walk the page map and the free lists to find how much memory is in
+ * live blocks and how much is held free. Big allocations count as
+ * whole pages.
+ */
+void
+mm_stats(struct mm_stats *st)
+{
+	struct pageref *pr;
+	struct big_freelist *bf;
+	size_t i, j, sz;
+	int k;
+
+	st->in_use = 0;
+	st->free = 0;
+
+	lock_all();
+	for (i = 0; i < PAGEMAP_DIR; i++) {
+		if (pagemap[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < PAGEMAP_LEAF; j++) {
+			pr = pagemap[i][j];
+			if (pr != NULL && !IS_BIG_TAG(pr)) {
+				sz = sizes[PR_BLOCKTYPE(pr)];
+				st->in_use += PAGE_SIZE - (PAGE_SIZE % sz) - pr->nfree * sz;
+				st->free += pr->nfree * sz;
+			}
+		}
+	}
+	for (pr = recycled_refs; pr != NULL; pr = pr->next) {
+		if (PR_PAGEADDR(pr) != 0) {
+			st->free += PAGE_SIZE;
+		}
+	}
+	for (k = 0; k < NBIGBINS; k++) {
+		for (bf = bigbins[k]; bf != NULL; bf = bf->next) {
+			st->free += (size_t)bf->npages * PAGE_SIZE;
+		}
+	}
+	st->in_use += (size_t)big_pages_in_use * PAGE_SIZE;
+	unlock_all();
+}
@@ -11,6 +11,11 @@ void mm_free(void *ptr)
   free(ptr);
 }
 
+void *mm_realloc(void *ptr, size_t sz)
+{
+  return realloc(ptr, sz);
+}
+
 
 int mm_init(void)
 {
@@ -34,6 +34,15 @@
  *  cache-scratch-hoard P 1000 1 1000000
  *
  *  The ideal is a P-fold speedup.
+ *
+ * nthreads and objSize may also be ranges or lists, "1-8" (doubling)
+ * or "1,3,6", to sweep them in one process:
+ *
+ *  cache-scratch 1-8 1000 1-256 1000000
+ *
+ * Each point is run timed and then once more counting the cache
+ * lines written by objects of more than one thread (see sharing.h),
+ * and the two are printed as heatmap tables, sizes by thread counts.
 */
 
 
@@ -45,6 +54,8 @@
 #include "memlib.h"
 #include "timer.h"
 #include "malloc.h"
+#include "bench.h"
+#include "sharing.h"
 
 // This struct just holds arguments to each thread.
 struct workerArg {
@@ -52,11 +63,17 @@ struct workerArg {
   int _objSize;
   int _iterations;
   int _repetitions;
-  int _cpu;
 };
 
+static int nthreads;
+static int iterations;
+static int objSize;
+static int repetitions;
+static int counting;		/* record lines instead of writing */
+static struct workerArg **args;
 
-extern void * worker (void * arg)
+
+static void worker (struct bench_thread *t)
 {
   // free the object we were given.
   // Then, repeatedly do the following:
@@ -66,13 +83,17 @@ extern void * worker (void * arg)
 
   int i, j, k; /* Loop control variables */
 
-  struct workerArg * w = (struct workerArg *) arg;
-  setCPU(w->_cpu);
+  struct workerArg * w = args[t->id];
   
   mm_free(w->_object);
   for (i = 0; i < w->_iterations; i++) {
     // Allocate the object.
     char * obj = (char *)mm_malloc(w->_objSize);
+    if (counting) {
+      sharing_touch(t->id, obj, w->_objSize);
+      mm_free(obj);
+      continue;
+    }
     // Write into it a bunch of times.
     for (j = 0; j < w->_repetitions; j++) {
       for (k = 0; k < w->_objSize; k++) {
@@ -84,55 +105,25 @@ extern void * worker (void * arg)
     // Free the object.
     mm_free(obj);
   }
+  t->ops = w->_iterations;
   mm_free(w);
-
-  return NULL;
 }
 
 
-int main (int argc, char * argv[]) {
-	int nthreads;
-	int iterations;
-	int objSize;
-	int repetitions;
-	pthread_attr_t attr;
-	int numCPU;
-	int i;
+/*
+ * Allocate nthreads objects and distribute them among the threads.
+ * The main thread allocates them, so neighbouring objects (possibly
+ * in one cache line) are handed to different threads.
+ */
+static void setup (struct bench *b, int run)
+{
 	char **objs;
-	struct timespec start_time;
-	struct timespec end_time;
-	
-	if (argc > 4) {
-		nthreads = atoi(argv[1]);
-		iterations = atoi(argv[2]);
-		objSize = atoi(argv[3]);
-		repetitions = atoi(argv[4]);
-	} else {
-		fprintf (stderr, "Usage: %s nthreads iterations objSize repetitions\n", argv[0]);
-		return 1;
-	}
-
-	/* Declare threads[] array here after nthreads is set, so we
-	 * can use stack-allocated space for the array.
-	 */
-	pthread_t threads[nthreads];
-
-	numCPU = getNumProcessors();
-
-	/* Call allocator-specific initialization function */
-	mm_init();
+	int i;
 
-	// Allocate nthreads objects and distribute them among the threads.
 	objs = (char **)mm_malloc(nthreads * sizeof(char *));
 	for (i = 0; i < nthreads; i++) {
 		objs[i] = (char *)mm_malloc(objSize);
 	}
-  
-	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10, PTHREAD_EXPLICIT_SCHED, 
-				PTHREAD_SCOPE_SYSTEM, &attr);
-
-	/* Get the starting time */
-	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
 
 	for (i = 0; i < nthreads; i++) {
 		struct workerArg * w = (struct workerArg *)mm_malloc(sizeof(struct workerArg));
@@ -140,22 +131,100 @@ int main (int argc, char * argv[]) {
 		w->_objSize = objSize;
 		w->_repetitions = repetitions / nthreads;
 		w->_iterations = iterations;
-		w->_cpu = (i+1)%numCPU;
-		pthread_create(&threads[i], &attr, &worker, (void *)w);
+		args[i] = w;
+	}
+	mm_free(objs);
+}
+
+
+/*
+ * Run every (objSize, nthreads) point twice: timed, and then counting
+ * the cache lines written by more than one thread. Prints one line per
+ * point and both tables.
+ */
+static void sweep (struct bench *b, const int *sizes, int nsizes,
+		   const int *threads, int nthr)
+{
+	double *times, *shared;
+	long touched;
+	int r, c;
+
+	times = (double *)calloc(nsizes * nthr, sizeof(double));
+	shared = (double *)calloc(nsizes * nthr, sizeof(double));
+
+	for (r = 0; r < nsizes; r++) {
+		for (c = 0; c < nthr; c++) {
+			objSize = sizes[r];
+			nthreads = threads[c];
+			b->nthreads = nthreads;
+
+			counting = 0;
+			if (bench_run(b) != 0) {
+				exit(1);
+			}
+			times[r * nthr + c] = bench_elapsed() / bench_runs();
+
+			counting = 1;
+			if (sharing_reset(nthreads) != 0 || bench_run(b) != 0) {
+				exit(1);
+			}
+			shared[r * nthr + c] = sharing_count(&touched);
+
+			printf("objSize %d, %d threads: time %f seconds, %.0f of %ld lines shared\n",
+			       objSize, nthreads, times[r * nthr + c], shared[r * nthr + c], touched);
+		}
 	}
 
-	for (i = 0; i < nthreads; i++) {
-		pthread_join(threads[i], NULL);
+	sharing_heatmap("Time elapsed (seconds):", sizes, nsizes, threads, nthr, times, "%.4f");
+	sharing_heatmap("Cache lines written by more than one thread:",
+			sizes, nsizes, threads, nthr, shared, "%.0f");
+	free(times);
+	free(shared);
+}
+
+
+int main (int argc, char * argv[]) {
+	struct bench b = { .name = "cache-scratch", .setup = setup, .worker = worker };
+	int sizes[SHARING_MAX_POINTS], threads[SHARING_MAX_POINTS];
+	int nsizes = 0, nthr = 0, i;
+
+	bench_init(&argc, argv);
+
+	if (argc > 4) {
+		nsizes = sharing_parse(argv[3], sizes, SHARING_MAX_POINTS);
+		nthr = sharing_parse(argv[1], threads, SHARING_MAX_POINTS);
+		iterations = atoi(argv[2]);
+		repetitions = atoi(argv[4]);
+	}
+	if (nsizes < 1 || nthr < 1) {
+		bench_usage("nthreads iterations objSize repetitions");
+		return 1;
+	}
+	objSize = sizes[0];
+	nthreads = threads[0];
+	for (i = 1; i < nthr; i++) {
+		if (threads[i] > nthreads) {
+			nthreads = threads[i];
+		}
 	}
 
-	/* Get the finish time */
-	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	args = (struct workerArg **)malloc(nthreads * sizeof(struct workerArg *));
 
-	double t = timespec_diff(&start_time, &end_time);
+	if (nsizes > 1 || nthr > 1) {
+		sweep(&b, sizes, nsizes, threads, nthr);
+		free(args);
+		return 0;
+	}
 
-	mm_free(objs);
+	b.nthreads = nthreads;
+	if (bench_run(&b) != 0) {
+		return 1;
+	}
+	bench_report(&b);
 
-	printf ("Time elapsed = %f seconds\n", t);
-	printf ("Memory used = %ld bytes\n",mem_usage());
+	free(args);
 	return 0;
 }
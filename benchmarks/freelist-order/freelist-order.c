@@ -0,0 +1,266 @@
+/*
+ * freelist-order
+ *
+ * Cost of taking blocks off cold freelists, and what the allocator's
+ * prefetching saves of it. Popping a block reads the next pointer
+ * stored in the block, so when the blocks are not in the cache every
+ * allocation waits for a miss into memory the program has not touched
+ * for a while, unless the allocator fetched it ahead.
+ *
+ * Every thread allocates blocks blocks of size bytes, frees them in
+ * one of two orders and then reads evict_mb megabytes of other memory
+ * so that neither the blocks nor the allocator's headers are cached.
+ * Only then are blocks blocks allocated again, and this phase alone is
+ * timed and counted:
+ *
+ *   address  freed in the reverse of the order they were allocated,
+ *            so the freelists come back in address order, which the
+ *            hardware prefetchers follow
+ *   random   freed in random order, so each freelist jumps around
+ *            its superblock and only the next pointer says where the
+ *            next block is
+ *
+ * Between two allocations a thread writes the block it got and does
+ * work steps of dependent arithmetic, standing in for the code that
+ * uses the block; the time a prefetch has to land.
+ *
+ * Each order is reported on its own, with the time per allocation and,
+ * where perf events are available, the L1 and LLC misses per
+ * allocation of the timed phase. Compare the allocator with its
+ * prefetches (--alloc=a2alloc) and without (--alloc=a2alloc-noprefetch)
+ * for the miss reduction.
+ *
+ * Usage: freelist-order nthreads size blocks work [evict_mb [seed]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "perfctr.h"
+#include "malloc.h"
+#include "bench.h"
+#include "xorshift.h"
+
+#define MAX_THREADS 64
+#define LINE 64
+
+enum { ORDER_ADDRESS, ORDER_RANDOM, NORDERS };
+static const char *order_names[NORDERS] = { "address", "random" };
+
+/* Per-thread arguments and results, one cache line apart. */
+struct workerArg {
+	uint64_t seed;
+	void **blocks;
+	long *order;		/* indexes into blocks, in the order they are freed */
+
+	uint64_t ticks;		/* timed phase of all runs */
+	unsigned long long counts[PERFCTR_NEVENTS];	/* perf events of the timed phase */
+	int mask;		/* events counted in every run */
+	unsigned long failures;
+	long check;
+} __attribute__((aligned(64)));
+
+static int nthreads;
+static size_t size;
+static long nblocks;
+static long work;
+static long evict_mb = 64;
+static uint64_t seed = 1;
+static int order;
+static struct workerArg *args;
+static char *evict_buf;
+
+/* Read the whole eviction buffer, a line at a time */
+static long evict(void)
+{
+	long i, sum = 0;
+
+	for (i = 0; i < evict_mb * 1024 * 1024; i += LINE) {
+		sum += evict_buf[i];
+	}
+	return sum;
+}
+
+/* Dependent arithmetic the compiler cannot drop */
+static inline long spin(long x)
+{
+	long i;
+
+	for (i = 0; i < work; i++) {
+		x = x * 6364136223846793005L + 1442695040888963407L;
+		__asm__ __volatile__("" : "+r"(x));
+	}
+	return x;
+}
+
+static void worker(struct bench_thread *t)
+{
+	struct workerArg *w = &args[t->id];
+	unsigned long long before[PERFCTR_NEVENTS], after[PERFCTR_NEVENTS];
+	long i, j, tmp, check = 0;
+	uint64_t t0;
+	int mask;
+	char *p;
+
+	/* Freelists in the chosen order */
+	for (i = 0; i < nblocks; i++) {
+		w->blocks[i] = mm_malloc(size);
+		if (w->blocks[i] == NULL) {
+			fprintf(stderr, "thread %d: out of memory\n", t->id);
+			exit(1);
+		}
+		w->order[i] = nblocks - 1 - i;
+	}
+	if (order == ORDER_RANDOM) {
+		for (i = nblocks - 1; i > 0; i--) {
+			j = next_rand(&w->seed) % (i + 1);
+			tmp = w->order[i];
+			w->order[i] = w->order[j];
+			w->order[j] = tmp;
+		}
+	}
+	for (i = 0; i < nblocks; i++) {
+		mm_free(w->blocks[w->order[i]]);
+	}
+	check += evict();
+
+	/* The timed phase */
+	perfctr_read(before);
+	t0 = timer_start();
+	for (i = 0; i < nblocks; i++) {
+		p = (char *)mm_malloc(size);
+		if (p == NULL) {
+			w->failures++;
+			continue;
+		}
+		*(long *)p = i;
+		check = spin(check + i);
+		w->blocks[i] = p;
+	}
+	w->ticks += timer_stop() - t0;
+	mask = perfctr_read(after);
+	for (i = 0; i < PERFCTR_NEVENTS; i++) {
+		w->counts[i] += after[i] - before[i];
+	}
+	w->mask = (t->run <= 0 ? mask : w->mask & mask);
+
+	for (i = 0; i < nblocks; i++) {
+		if (w->blocks[i] != NULL) {
+			mm_free(w->blocks[i]);
+			w->blocks[i] = NULL;
+		}
+	}
+	w->check = check;
+	t->ops = nblocks;
+}
+
+/* Results cover all measured runs, so start over before the first one. */
+static void setup(struct bench *b, int run)
+{
+	int i;
+
+	if (run <= 0) {
+		for (i = 0; i < nthreads; i++) {
+			args[i].seed = seed * 0x9e3779b97f4a7c15ULL + i + 1;
+			args[i].ticks = 0;
+			args[i].failures = 0;
+			memset(args[i].counts, 0, sizeof(args[i].counts));
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char name[32];
+	struct bench b = { .name = name, .setup = setup, .worker = worker, .units = "allocations" };
+	unsigned long long counts[PERFCTR_NEVENTS];
+	unsigned long failures;
+	double ops, ns;
+	int i, e, mask;
+
+	bench_init(&argc, argv);
+
+	if (argc < 5) {
+		bench_usage("nthreads size blocks work [evict_mb [seed]]");
+		return 1;
+	}
+	nthreads = atoi(argv[1]);
+	size = strtoul(argv[2], NULL, 0);
+	nblocks = atol(argv[3]);
+	work = atol(argv[4]);
+	if (argc > 5) {
+		evict_mb = atol(argv[5]);
+	}
+	if (argc > 6) {
+		seed = strtoull(argv[6], NULL, 0);
+	}
+	if (nthreads < 1 || nthreads > MAX_THREADS || size < sizeof(long) || nblocks < 1 ||
+	    work < 0 || evict_mb < 0 || seed == 0) {
+		fprintf(stderr, "freelist-order: invalid arguments\n");
+		return 1;
+	}
+
+	printf("Running freelist-order for %d threads, %ld blocks of %lu bytes, %ld work, %ld MB evicted\n",
+	       nthreads, nblocks, (unsigned long)size, work, evict_mb);
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	/* Keep the benchmark's own memory out of the allocator under test. */
+	args = (struct workerArg *)aligned_alloc(64, nthreads * sizeof(struct workerArg));
+	evict_buf = (char *)malloc(evict_mb * 1024 * 1024 + 1);
+	if (args == NULL || evict_buf == NULL) {
+		fprintf(stderr, "freelist-order: out of memory\n");
+		return 1;
+	}
+	memset(evict_buf, 1, evict_mb * 1024 * 1024 + 1);
+	for (i = 0; i < nthreads; i++) {
+		args[i].blocks = (void **)calloc(nblocks, sizeof(void *));
+		args[i].order = (long *)malloc(nblocks * sizeof(long));
+		if (args[i].blocks == NULL || args[i].order == NULL) {
+			fprintf(stderr, "freelist-order: out of memory\n");
+			return 1;
+		}
+	}
+
+	b.nthreads = nthreads;
+	for (order = 0; order < NORDERS; order++) {
+		snprintf(name, sizeof(name), "freelist-order/%s", order_names[order]);
+		if (bench_run(&b) != 0) {
+			return 1;
+		}
+
+		ns = 0;
+		failures = 0;
+		mask = -1;
+		memset(counts, 0, sizeof(counts));
+		for (i = 0; i < nthreads; i++) {
+			ns += timer_ns(args[i].ticks);
+			failures += args[i].failures;
+			mask &= args[i].mask;
+			for (e = 0; e < PERFCTR_NEVENTS; e++) {
+				counts[e] += args[i].counts[e];
+			}
+		}
+		ops = (double)nblocks * nthreads * bench_runs();
+
+		printf("Order %s: %.2f ns per allocation", order_names[order], ns / ops);
+		bench_metric("ns_per_malloc", ns / ops);
+		if (mask & (1 << PERFCTR_L1D_MISSES)) {
+			printf(", %.3f L1 misses", counts[PERFCTR_L1D_MISSES] / ops);
+			bench_metric("l1d_misses_per_malloc", counts[PERFCTR_L1D_MISSES] / ops);
+		}
+		if (mask & (1 << PERFCTR_LLC_MISSES)) {
+			printf(", %.3f LLC misses", counts[PERFCTR_LLC_MISSES] / ops);
+			bench_metric("llc_misses_per_malloc", counts[PERFCTR_LLC_MISSES] / ops);
+		}
+		printf("\n");
+		bench_metric("failures", failures);
+		bench_report(&b);
+	}
+	return 0;
+}
@@ -75,8 +75,9 @@ foreach $allocator (@alloclist) {
 
 	while (<F>) {
 	    chop;
-	    # Runtime results
-	    if (/([0-9]+\.[0-9]+) seconds/) {
+	    # Runtime results; benchmarks also print per-thread and
+	    # per-phase times, so only take the headline figure.
+	    if (/(?:Time elapsed|Average execution time) = ([0-9]+\.[0-9]+) seconds/) {
 		#	 print "$i\t$1\n";
 		my $current = $1;
 		$total += $1;
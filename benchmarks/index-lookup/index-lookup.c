@@ -0,0 +1,259 @@
+/*
+ * index-lookup
+ *
+ * Cost of finding the metadata of the superblock a pointer is in,
+ * the first thing every free does. Four ways are compared:
+ *
+ *   mask   clear the low bits of the address; needs superblocks
+ *          aligned to their size (a2alloc)
+ *   radix  two-level table indexed by superblock number within the
+ *          segment, like the page map of kheap
+ *   avl    the AVL address index of allocators/index (a2alloc-avl)
+ *   btree  the B+tree index of allocators/index, with SIMD compares
+ *          where the CPU has them
+ *
+ * nspans superblocks of SPAN bytes are taken from the segment with
+ * mem_sbrk(), each with a small header at its start, and added to
+ * the table and the indexes in random order. Every thread then looks
+ * up its own lookups random addresses inside random superblocks and
+ * reads the header found, as free would. The addresses are generated
+ * before the timed region, and the same ones are used for every
+ * method; the checksums of the headers read must agree.
+ *
+ * Each method is run and reported on its own, with the time per
+ * lookup and the height of the indexes. index-scale compares the two
+ * indexes at sizes beyond what the segment holds.
+ *
+ * Usage: index-lookup nthreads nspans lookups [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "memlib.h"
+#include "bench.h"
+#include "xorshift.h"
+#include "avl_index.h"
+#include "btree_index.h"
+
+#define SPAN 8192	/* a2alloc's default SUPERBLOCK_PAGE_SIZE */
+#define RADIX_LEAF 512
+#define MAX_THREADS 64
+
+enum { METHOD_MASK, METHOD_RADIX, METHOD_AVL, METHOD_BTREE, NMETHODS };
+static const char *method_names[NMETHODS] = { "mask", "radix", "avl", "btree" };
+
+/* Stands in for a pageref at the start of each superblock */
+struct header {
+	long id;
+	long pad[7];
+};
+
+struct workerArg {
+	uintptr_t *addrs;
+	long check;
+} __attribute__((aligned(64)));
+
+static int nthreads;
+static long nspans;
+static long lookups;
+static uint64_t seed = 1;
+static int method;
+static struct workerArg *args;
+
+static uintptr_t base;			/* first superblock */
+static struct header ***radix;		/* [n / RADIX_LEAF][n % RADIX_LEAF] */
+static struct avl_index avl;
+static struct btree_index btree;
+
+/* Node chunks for the index, from the segment like the superblocks */
+static void *index_chunk(size_t size)
+{
+	return mem_sbrk(size);
+}
+
+static void worker(struct bench_thread *t)
+{
+	struct workerArg *w = &args[t->id];
+	const uintptr_t *a = w->addrs;
+	struct header *h;
+	long i, check = 0;
+	uintptr_t n;
+
+	switch (method) {
+	case METHOD_MASK:
+		for (i = 0; i < lookups; i++) {
+			h = (struct header *)(a[i] & ~(uintptr_t)(SPAN - 1));
+			check += h->id;
+		}
+		break;
+	case METHOD_RADIX:
+		for (i = 0; i < lookups; i++) {
+			n = (a[i] - base) / SPAN;
+			h = radix[n / RADIX_LEAF][n % RADIX_LEAF];
+			check += h->id;
+		}
+		break;
+	case METHOD_AVL:
+		for (i = 0; i < lookups; i++) {
+			h = (struct header *)avl_index_lookup(&avl, a[i]);
+			check += h->id;
+		}
+		break;
+	case METHOD_BTREE:
+		for (i = 0; i < lookups; i++) {
+			h = (struct header *)btree_index_lookup(&btree, a[i]);
+			check += h->id;
+		}
+		break;
+	}
+	w->check = check;
+	t->ops = lookups;
+}
+
+/* Superblocks, table and index, filled in random order */
+static void build(void)
+{
+	long *order, i, j, tmp, n;
+	uint64_t rnd = seed;
+
+	/* Aligned to their size, as a2alloc does */
+	if ((uintptr_t)dseg_lo % SPAN != 0) {
+		mem_sbrk(SPAN - (uintptr_t)dseg_lo % SPAN);
+	}
+	base = (uintptr_t)mem_sbrk(nspans * SPAN);
+	if (base == 0) {
+		fprintf(stderr, "index-lookup: %ld superblocks do not fit in the segment\n", nspans);
+		exit(1);
+	}
+
+	radix = (struct header ***)calloc(nspans / RADIX_LEAF + 1, sizeof(struct header **));
+	order = (long *)malloc(nspans * sizeof(long));
+	for (i = 0; i < nspans; i++) {
+		order[i] = i;
+	}
+	for (i = nspans - 1; i > 0; i--) {
+		j = next_rand(&rnd) % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	avl_index_init(&avl, index_chunk, SPAN);
+	btree_index_init(&btree, index_chunk, SPAN);
+	for (i = 0; i < nspans; i++) {
+		n = order[i];
+		struct header *h = (struct header *)(base + n * SPAN);
+		h->id = n;
+		if (radix[n / RADIX_LEAF] == NULL) {
+			radix[n / RADIX_LEAF] = (struct header **)calloc(RADIX_LEAF, sizeof(struct header *));
+		}
+		radix[n / RADIX_LEAF][n % RADIX_LEAF] = h;
+		if (avl_index_insert(&avl, (uintptr_t)h, SPAN, h) != 0) {
+			fprintf(stderr, "index-lookup: cannot add superblock %ld to the index\n", n);
+			exit(1);
+		}
+		if (btree_index_insert(&btree, (uintptr_t)h, SPAN, h) != 0) {
+			fprintf(stderr, "index-lookup: cannot add superblock %ld to the B+tree\n", n);
+			exit(1);
+		}
+	}
+	free(order);
+
+	if (avl_index_check(&avl) != 0 || btree_index_check(&btree) != 0) {
+		fprintf(stderr, "index-lookup: index is inconsistent\n");
+		exit(1);
+	}
+
+	/* Addresses anywhere in a superblock, as blocks would be */
+	for (i = 0; i < nthreads; i++) {
+		args[i].addrs = (uintptr_t *)malloc(lookups * sizeof(uintptr_t));
+		for (j = 0; j < lookups; j++) {
+			n = next_rand(&rnd) % nspans;
+			args[i].addrs[j] = base + n * SPAN + sizeof(struct header) +
+				next_rand(&rnd) % (SPAN - sizeof(struct header));
+		}
+	}
+}
+
+/* Height of the index, from the root's node */
+static int index_height(void)
+{
+	return avl.root ? avl.root->height : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char name[32];
+	struct bench b = { .worker = worker, .units = "lookups", .name = name,
+			   .allocator = "" };
+	long check, first_check = 0;
+	int i;
+
+	bench_init(&argc, argv);
+
+	if (argc > 3) {
+		nthreads = atoi(argv[1]);
+		nspans = atol(argv[2]);
+		lookups = atol(argv[3]);
+		if (argc > 4) {
+			seed = strtoull(argv[4], NULL, 10);
+		}
+	} else {
+		bench_usage("nthreads nspans lookups [seed]");
+		exit(1);
+	}
+	if (nthreads < 1 || nthreads > MAX_THREADS || nspans < 1 || lookups < 1 || seed == 0) {
+		fprintf(stderr, "index-lookup: invalid arguments\n");
+		exit(1);
+	}
+
+	if (mem_init() != 0) {
+		fprintf(stderr, "index-lookup: cannot initialize the segment\n");
+		exit(1);
+	}
+	args = (struct workerArg *)aligned_alloc(64, nthreads * sizeof(struct workerArg));
+	build();
+
+	printf("Index: %ld superblocks of %d bytes, height %d, %ld node chunks\n",
+	       nspans, SPAN, index_height(), avl.nchunks);
+	printf("B+tree: height %d, %ld node chunks, %s compares\n",
+	       btree.height, btree.nchunks, btree.simd ? "AVX2" : "scalar");
+
+	b.nthreads = nthreads;
+	for (method = 0; method < NMETHODS; method++) {
+		snprintf(name, sizeof(name), "index-lookup/%s", method_names[method]);
+		if (bench_run(&b) != 0) {
+			exit(1);
+		}
+
+		check = 0;
+		for (i = 0; i < nthreads; i++) {
+			check += args[i].check;
+		}
+		if (method == 0) {
+			first_check = check;
+		} else if (check != first_check) {
+			fprintf(stderr, "index-lookup: %s found other headers than %s\n",
+				method_names[method], method_names[0]);
+			exit(1);
+		}
+
+		/* Every thread does the same number of lookups */
+		printf("Lookup %s: %.2f ns per lookup\n", method_names[method],
+		       1e9 * bench_elapsed() / bench_runs() / lookups);
+		bench_metric("ns_per_lookup", 1e9 * bench_elapsed() / bench_runs() / lookups);
+		if (method == METHOD_AVL) {
+			bench_metric("height", index_height());
+		} else if (method == METHOD_BTREE) {
+			bench_metric("height", btree.height);
+			bench_metric("simd", btree.simd);
+		}
+		bench_report(&b);
+	}
+	return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * index-scale
+ *
+ * The AVL and B+tree address indexes of allocators/index at sizes
+ * from thousands to millions of pages, more than the segment of
+ * index-lookup can hold.
+ *
+ * For every size in the pages axis ("10000-10000000" doubles from 10K
+ * up to 10M, see sharing_parse()), each index gets that many spans of
+ * PAGE bytes at made-up addresses, inserted in random order. Then
+ * `lookups` random addresses inside them are looked up, and finally
+ * the spans are removed in another random order. Nothing is stored at the
+ * addresses: the data of a span is its page number, and the sums of
+ * the data found must agree between the indexes. Nodes come from
+ * malloc() in chunks of CHUNK bytes, given back after each size.
+ *
+ * The lookups are timed by bench_run() and reported per index and
+ * size; insert and remove times are added as metrics. A table of all
+ * sizes follows at the end. The B+tree uses AVX2 compares where the
+ * CPU has them; run with MM_BTREE_SIMD=0 to time the scalar ones.
+ *
+ * Usage: index-scale pages lookups [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "timer.h"
+#include "bench.h"
+#include "sharing.h"
+#include "xorshift.h"
+#include "avl_index.h"
+#include "btree_index.h"
+
+#define PAGE 4096
+#define CHUNK 65536
+#define BASE ((uintptr_t)1 << 40)
+
+enum { INDEX_AVL, INDEX_BTREE, NINDEXES };
+static const char *index_names[NINDEXES] = { "avl", "btree" };
+
+struct result {
+	double insert_ns;
+	double lookup_ns;
+	double remove_ns;
+	int height;
+	double node_mb;
+};
+
+static long npages;
+static long lookups;
+static uint64_t seed = 1;
+static int which;
+static uintptr_t *addrs;
+static long check;
+
+static struct avl_index avl;
+static struct btree_index btree;
+
+static void **chunks;
+static long nchunks, max_chunks;
+
+/* Node chunks, remembered so they can be freed with the index */
+static void *index_chunk(size_t size)
+{
+	void *p;
+
+	if (nchunks == max_chunks) {
+		max_chunks = max_chunks ? 2 * max_chunks : 1024;
+		chunks = (void **)realloc(chunks, max_chunks * sizeof(void *));
+		if (chunks == NULL) {
+			return NULL;
+		}
+	}
+	p = malloc(size);
+	if (p != NULL) {
+		chunks[nchunks++] = p;
+	}
+	return p;
+}
+
+static void free_chunks(void)
+{
+	while (nchunks > 0) {
+		free(chunks[--nchunks]);
+	}
+}
+
+/* Page numbers 0 .. npages-1 in random order */
+static void shuffle(long *order, uint64_t *rnd)
+{
+	long i, j, tmp;
+
+	for (i = 0; i < npages; i++) {
+		order[i] = i;
+	}
+	for (i = npages - 1; i > 0; i--) {
+		j = next_rand(rnd) % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+static void worker(struct bench_thread *t)
+{
+	long i, sum = 0;
+
+	if (which == INDEX_AVL) {
+		for (i = 0; i < lookups; i++) {
+			sum += (long)avl_index_lookup(&avl, addrs[i]);
+		}
+	} else {
+		for (i = 0; i < lookups; i++) {
+			sum += (long)btree_index_lookup(&btree, addrs[i]);
+		}
+	}
+	check = sum;
+	t->ops = lookups;
+}
+
+static int insert(uintptr_t start, long page)
+{
+	if (which == INDEX_AVL) {
+		return avl_index_insert(&avl, start, PAGE, (void *)(page + 1));
+	}
+	return btree_index_insert(&btree, start, PAGE, (void *)(page + 1));
+}
+
+static int remove_page(uintptr_t start)
+{
+	if (which == INDEX_AVL) {
+		return avl_index_remove(&avl, start);
+	}
+	return btree_index_remove(&btree, start);
+}
+
+/* Build, look up in and empty one index of npages pages */
+static void run_index(struct bench *b, long *order, struct result *r, long *first_check)
+{
+	uint64_t rnd = seed, t0;
+	long i;
+
+	if (which == INDEX_AVL) {
+		avl_index_init(&avl, index_chunk, CHUNK);
+	} else {
+		btree_index_init(&btree, index_chunk, CHUNK);
+	}
+
+	shuffle(order, &rnd);
+	t0 = timer_clock_ns();
+	for (i = 0; i < npages; i++) {
+		if (insert(BASE + order[i] * PAGE, order[i]) != 0) {
+			fprintf(stderr, "index-scale: cannot add page %ld to the %s index\n",
+				order[i], index_names[which]);
+			exit(1);
+		}
+	}
+	r->insert_ns = (double)(timer_clock_ns() - t0) / npages;
+	if ((which == INDEX_AVL ? avl_index_check(&avl) : btree_index_check(&btree)) != 0) {
+		fprintf(stderr, "index-scale: %s index is inconsistent\n", index_names[which]);
+		exit(1);
+	}
+	r->height = which == INDEX_AVL ? (avl.root ? avl.root->height : 0) : btree.height;
+	r->node_mb = (double)nchunks * CHUNK / (1024 * 1024);
+
+	if (bench_run(b) != 0) {
+		exit(1);
+	}
+	r->lookup_ns = 1e9 * bench_elapsed() / bench_runs() / lookups;
+	if (which == 0) {
+		*first_check = check;
+	} else if (check != *first_check) {
+		fprintf(stderr, "index-scale: %s found other spans than %s\n",
+			index_names[which], index_names[0]);
+		exit(1);
+	}
+
+	shuffle(order, &rnd);
+	t0 = timer_clock_ns();
+	for (i = 0; i < npages; i++) {
+		if (remove_page(BASE + order[i] * PAGE) != 0) {
+			fprintf(stderr, "index-scale: page %ld missing from the %s index\n",
+				order[i], index_names[which]);
+			exit(1);
+		}
+	}
+	r->remove_ns = (double)(timer_clock_ns() - t0) / npages;
+	free_chunks();
+
+	printf("Index %s, %ld pages: insert %.1f ns, lookup %.2f ns, remove %.1f ns, height %d, %.1f MB of nodes\n",
+	       index_names[which], npages, r->insert_ns, r->lookup_ns, r->remove_ns,
+	       r->height, r->node_mb);
+	bench_metric("pages", npages);
+	bench_metric("ns_per_lookup", r->lookup_ns);
+	bench_metric("ns_per_insert", r->insert_ns);
+	bench_metric("ns_per_remove", r->remove_ns);
+	bench_metric("height", r->height);
+	bench_metric("node_mb", r->node_mb);
+	bench_report(b);
+}
+
+int main(int argc, char *argv[])
+{
+	char name[64];
+	struct bench b = { .worker = worker, .units = "lookups", .name = name,
+			   .allocator = "", .nthreads = 1 };
+	int pages[SHARING_MAX_POINTS];
+	struct result (*results)[NINDEXES];
+	long *order, first_check = 0, i;
+	uint64_t rnd;
+	int npoints, p;
+
+	bench_init(&argc, argv);
+
+	if (argc > 2) {
+		npoints = sharing_parse(argv[1], pages, SHARING_MAX_POINTS);
+		lookups = atol(argv[2]);
+		if (argc > 3) {
+			seed = strtoull(argv[3], NULL, 10);
+		}
+	} else {
+		bench_usage("pages lookups [seed]");
+		exit(1);
+	}
+	if (npoints < 1 || lookups < 1 || seed == 0) {
+		fprintf(stderr, "index-scale: invalid arguments\n");
+		exit(1);
+	}
+
+	results = calloc(npoints, sizeof(*results));
+	addrs = (uintptr_t *)malloc(lookups * sizeof(uintptr_t));
+	for (p = 0; p < npoints; p++) {
+		npages = pages[p];
+		order = (long *)malloc(npages * sizeof(long));
+		if (results == NULL || addrs == NULL || order == NULL) {
+			fprintf(stderr, "index-scale: out of memory\n");
+			exit(1);
+		}
+
+		/* The same addresses for both indexes */
+		rnd = seed + npages;
+		for (i = 0; i < lookups; i++) {
+			addrs[i] = BASE + (next_rand(&rnd) % npages) * PAGE + next_rand(&rnd) % PAGE;
+		}
+		for (which = 0; which < NINDEXES; which++) {
+			snprintf(name, sizeof(name), "index-scale/%s/%ld", index_names[which], npages);
+			run_index(&b, order, &results[p][which], &first_check);
+		}
+		free(order);
+	}
+
+	printf("\n%10s", "pages");
+	for (which = 0; which < NINDEXES; which++) {
+		snprintf(name, sizeof(name), "%s insert", index_names[which]);
+		printf("  %12s %12s %10s %3s", name, "lookup", "remove", "ht");
+	}
+	printf("\n");
+	for (p = 0; p < npoints; p++) {
+		printf("%10d", pages[p]);
+		for (which = 0; which < NINDEXES; which++) {
+			struct result *r = &results[p][which];
+
+			printf("  %12.1f %12.2f %10.1f %3d", r->insert_ns, r->lookup_ns,
+			       r->remove_ns, r->height);
+		}
+		printf("\n");
+	}
+	printf("(ns per operation; B+tree lookups with %s compares)\n",
+	       btree.simd ? "AVX2" : "scalar");
+	return 0;
+}
@@ -0,0 +1,4 @@
+# per-benchmark configuration values
+maxtime => '60', # kheap needs <10s with 8 threads
+args => '1000000 100000 16 1024 geometric 4096 1', #ops, keyspace, min_val, max_val, distribution, capacity_kb, seed
+graphtitle => "kvcache - runtimes"
@@ -0,0 +1,473 @@
+/*
+ * kvcache
+ *
+ * An application-like workload: a multi-threaded in-memory key-value
+ * cache in the style of memcached, with all of its data structures
+ * allocated through mm_malloc/mm_free.
+ *
+ * The cache is split into NSHARDS shards, each with its own lock, hash
+ * table, LRU list and share of the capacity. Every entry takes three
+ * allocations: the hash-table node, the key and the value. Keys are
+ * between MIN_KEY and MAX_KEY bytes long; value sizes come from the
+ * selected distribution.
+ *
+ * Each thread performs ops/nthreads operations on keys drawn from the
+ * keyspace, with 80% of the requests going to a hot 20% of the keys.
+ * An operation is a get (a miss inserts the key, cache-aside style)
+ * or, SET_PERCENT of the time, an overwrite that replaces the value.
+ * Entries get a time to live measured in shard operations; every
+ * EXPIRE_INTERVAL operations a thread sweeps one shard and drops all
+ * expired entries in bulk. Inserts evict from the LRU tail until the
+ * shard is back under its capacity.
+ *
+ * Reports ops/sec, p50/p99/p99.9 operation latency, and the segment
+ * size relative to the live payload (key and value bytes) at the end.
+ * The cache is kept between runs, so --warmup runs fill it before
+ * anything is measured.
+ *
+ * Usage: kvcache nthreads ops keyspace min_val max_val dist capacity_kb [seed]
+ *
+ *   dist is one of
+ *     uniform   - value size uniform in [min_val, max_val]
+ *     geometric - min_val plus a geometric tail with mean (max-min)/8,
+ *                 truncated at max_val
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "memlib.h"
+#include "bench.h"
+#include "xorshift.h"
+
+#define NSHARDS 64
+#define BUCKETS_PER_SHARD 4096	/* power of two */
+#define MIN_KEY 8
+#define MAX_KEY 64
+#define SET_PERCENT 10
+#define EXPIRE_INTERVAL 1000
+#define MAX_THREADS 64
+
+struct entry {
+	struct entry *hnext;
+	struct entry *lru_prev;
+	struct entry *lru_next;
+	char *key;
+	char *val;
+	uint32_t hash;
+	uint16_t keylen;
+	uint32_t vallen;
+	unsigned long expire;
+};
+
+struct shard {
+	pthread_mutex_t lock;
+	struct entry **buckets;
+	struct entry *lru_head;	/* most recently used */
+	struct entry *lru_tail;
+	unsigned long clock;	/* operations on this shard */
+	size_t payload;		/* key + value bytes of live entries */
+	unsigned long nentries;
+	unsigned long evictions;
+	unsigned long expirations;
+} __attribute__((aligned(64)));
+
+struct workerArg {
+	uint64_t seed;
+	unsigned long ops;
+	unsigned long hits;
+	unsigned long misses;
+	struct hist *lat;	/* operation latency in timer ticks */
+} __attribute__((aligned(64)));
+
+enum dist {
+	DIST_UNIFORM,
+	DIST_GEOMETRIC
+};
+
+static int nthreads;
+static long total_ops;
+static unsigned long keyspace;
+static size_t min_val, max_val;
+static enum dist distribution;
+static size_t shard_capacity;
+static unsigned long ttl;
+static uint64_t seed = 1;
+static struct workerArg *args;
+
+static struct shard shards[NSHARDS];
+
+static uint32_t hash_key(const char *key, int len)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Build the key for id; its length is a deterministic function of id. */
+static int make_key(char *buf, unsigned long id)
+{
+	int len = snprintf(buf, MAX_KEY + 1, "key:%lu:", id);
+	int target = MIN_KEY + (int)((id * 2654435761u) % (MAX_KEY - MIN_KEY + 1));
+
+	while (len < target) {
+		buf[len] = 'a' + (id + len) % 26;
+		len++;
+	}
+	return len;
+}
+
+static size_t pick_value_size(uint64_t *state)
+{
+	double u, mean;
+	size_t sz;
+
+	if (min_val == max_val) {
+		return min_val;
+	}
+	if (distribution == DIST_UNIFORM) {
+		return min_val + next_rand(state) % (max_val - min_val + 1);
+	}
+	mean = (max_val - min_val) / 8.0;
+	u = (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+	sz = min_val + (size_t)(-log(1.0 - u) * mean);
+	return sz > max_val ? max_val : sz;
+}
+
+/* Pick a key: 80% of requests go to the first 20% of the keyspace. */
+static unsigned long pick_key(uint64_t *state)
+{
+	unsigned long hot = keyspace / 5 ? keyspace / 5 : 1;
+
+	if (next_rand(state) % 100 < 80) {
+		return next_rand(state) % hot;
+	}
+	return next_rand(state) % keyspace;
+}
+
+/*
+ * LRU and hash helpers. All of them expect the shard lock to be held.
+ */
+static void lru_unlink(struct shard *s, struct entry *e)
+{
+	if (e->lru_prev) {
+		e->lru_prev->lru_next = e->lru_next;
+	} else {
+		s->lru_head = e->lru_next;
+	}
+	if (e->lru_next) {
+		e->lru_next->lru_prev = e->lru_prev;
+	} else {
+		s->lru_tail = e->lru_prev;
+	}
+}
+
+static void lru_push(struct shard *s, struct entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = s->lru_head;
+	if (s->lru_head) {
+		s->lru_head->lru_prev = e;
+	} else {
+		s->lru_tail = e;
+	}
+	s->lru_head = e;
+}
+
+static struct entry *lookup(struct shard *s, uint32_t h, const char *key, int len)
+{
+	struct entry *e;
+
+	for (e = s->buckets[h & (BUCKETS_PER_SHARD - 1)]; e; e = e->hnext) {
+		if (e->hash == h && e->keylen == len && memcmp(e->key, key, len) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void remove_entry(struct shard *s, struct entry *e)
+{
+	struct entry **pp = &s->buckets[e->hash & (BUCKETS_PER_SHARD - 1)];
+
+	while (*pp != e) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+	lru_unlink(s, e);
+
+	s->payload -= e->keylen + e->vallen;
+	s->nentries--;
+	mm_free(e->key);
+	mm_free(e->val);
+	mm_free(e);
+}
+
+static void evict(struct shard *s)
+{
+	while (s->payload > shard_capacity && s->lru_tail != NULL) {
+		remove_entry(s, s->lru_tail);
+		s->evictions++;
+	}
+}
+
+static void expire(struct shard *s)
+{
+	struct entry *e, *prev;
+
+	for (e = s->lru_tail; e != NULL; e = prev) {
+		prev = e->lru_prev;
+		if (e->expire < s->clock) {
+			remove_entry(s, e);
+			s->expirations++;
+		}
+	}
+}
+
+static void set_value(struct entry *e, size_t vallen, unsigned long id)
+{
+	e->val = (char *)mm_malloc(vallen);
+	if (e->val == NULL) {
+		fprintf(stderr, "kvcache: mm_malloc failed\n");
+		exit(1);
+	}
+	e->vallen = vallen;
+	e->val[0] = (char)id;
+	e->val[vallen - 1] = (char)id;
+}
+
+static void insert(struct shard *s, uint32_t h, const char *key, int len,
+		   unsigned long id, uint64_t *state)
+{
+	struct entry *e = (struct entry *)mm_malloc(sizeof(struct entry));
+
+	if (e == NULL || (e->key = (char *)mm_malloc(len)) == NULL) {
+		fprintf(stderr, "kvcache: mm_malloc failed\n");
+		exit(1);
+	}
+	memcpy(e->key, key, len);
+	e->keylen = len;
+	e->hash = h;
+	set_value(e, pick_value_size(state), id);
+	e->expire = s->clock + ttl / 2 + next_rand(state) % (ttl / 2 + 1);
+
+	e->hnext = s->buckets[h & (BUCKETS_PER_SHARD - 1)];
+	s->buckets[h & (BUCKETS_PER_SHARD - 1)] = e;
+	lru_push(s, e);
+	s->payload += len + e->vallen;
+	s->nentries++;
+
+	evict(s);
+}
+
+static void worker(struct bench_thread *t)
+{
+	struct workerArg *w = &args[t->id];
+	char key[MAX_KEY + 1];
+	unsigned long nops = total_ops / nthreads;
+	unsigned long i, id;
+	uint64_t t0, t1;
+	struct shard *s;
+	struct entry *e;
+	uint32_t h;
+	int len, next_expire = t->id;
+
+	for (i = 0; i < nops; i++) {
+		id = pick_key(&w->seed);
+		len = make_key(key, id);
+		h = hash_key(key, len);
+		s = &shards[(h >> 16) % NSHARDS];
+
+		t0 = timer_start();
+		pthread_mutex_lock(&s->lock);
+		s->clock++;
+		e = lookup(s, h, key, len);
+		if (e == NULL) {
+			w->misses++;
+			insert(s, h, key, len, id, &w->seed);
+		} else {
+			w->hits++;
+			if (next_rand(&w->seed) % 100 < SET_PERCENT) {
+				s->payload -= e->vallen;
+				mm_free(e->val);
+				set_value(e, pick_value_size(&w->seed), id);
+				s->payload += e->vallen;
+				evict(s);
+			} else {
+				volatile char c = e->val[0];
+				(void)c;
+				lru_unlink(s, e);
+				lru_push(s, e);
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+		t1 = timer_stop();
+
+		hist_record(w->lat, t1 - t0);
+		w->ops++;
+
+		if (i % EXPIRE_INTERVAL == EXPIRE_INTERVAL - 1) {
+			/* Bulk expiry, one shard at a time, spread over threads. */
+			s = &shards[next_expire % NSHARDS];
+			next_expire += nthreads;
+			pthread_mutex_lock(&s->lock);
+			expire(s);
+			pthread_mutex_unlock(&s->lock);
+		}
+	}
+	t->ops = nops;
+}
+
+/* Statistics cover all measured runs; the cache itself is kept. */
+static void setup(struct bench *b, int run)
+{
+	int i;
+
+	if (run > 0) {
+		return;
+	}
+	for (i = 0; i < nthreads; i++) {
+		args[i].ops = 0;
+		args[i].hits = 0;
+		args[i].misses = 0;
+		hist_init(args[i].lat);
+	}
+	for (i = 0; i < NSHARDS; i++) {
+		shards[i].evictions = 0;
+		shards[i].expirations = 0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b = { .name = "kvcache", .setup = setup, .worker = worker };
+	unsigned long ops = 0, hits = 0, misses = 0, evictions = 0, expirations = 0;
+	unsigned long nentries = 0;
+	size_t payload = 0;
+	struct hist lat;
+	int i;
+
+	bench_init(&argc, argv);
+
+	if (argc < 8) {
+		bench_usage("nthreads ops keyspace min_val max_val uniform|geometric capacity_kb [seed]");
+		return 1;
+	}
+
+	nthreads = atoi(argv[1]);
+	total_ops = atol(argv[2]);
+	keyspace = strtoul(argv[3], NULL, 0);
+	min_val = strtoul(argv[4], NULL, 0);
+	max_val = strtoul(argv[5], NULL, 0);
+	shard_capacity = strtoul(argv[7], NULL, 0) * 1024 / NSHARDS;
+	if (argc > 8) {
+		seed = strtoull(argv[8], NULL, 0);
+	}
+
+	if (strcmp(argv[6], "uniform") == 0) {
+		distribution = DIST_UNIFORM;
+	} else if (strcmp(argv[6], "geometric") == 0) {
+		distribution = DIST_GEOMETRIC;
+	} else {
+		fprintf(stderr, "Unknown distribution %s\n", argv[6]);
+		return 1;
+	}
+
+	if (nthreads < 1 || nthreads > MAX_THREADS || total_ops < nthreads ||
+	    keyspace < 1 || min_val < 1 || max_val < min_val || shard_capacity < 1) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	/* Entries live for about two full passes over the keyspace per shard. */
+	ttl = 2 * keyspace / NSHARDS + 1;
+
+	printf("Running kvcache for %d threads, %ld ops, %lu keys, values %lu-%lu (%s), %lu KB capacity\n",
+	       nthreads, total_ops, keyspace, (unsigned long)min_val, (unsigned long)max_val,
+	       argv[6], (unsigned long)(shard_capacity * NSHARDS / 1024));
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	for (i = 0; i < NSHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].buckets = (struct entry **)mm_malloc(BUCKETS_PER_SHARD * sizeof(struct entry *));
+		if (shards[i].buckets == NULL) {
+			fprintf(stderr, "kvcache: mm_malloc failed\n");
+			return 1;
+		}
+		memset(shards[i].buckets, 0, BUCKETS_PER_SHARD * sizeof(struct entry *));
+	}
+
+	/* Bookkeeping lives outside the allocator under test. */
+	args = (struct workerArg *)aligned_alloc(64, nthreads * sizeof(struct workerArg));
+	if (args == NULL) {
+		fprintf(stderr, "kvcache: out of memory\n");
+		return 1;
+	}
+	memset(args, 0, nthreads * sizeof(struct workerArg));
+	for (i = 0; i < nthreads; i++) {
+		args[i].seed = seed * 0x9e3779b97f4a7c15ULL + i + 1;
+		args[i].lat = (struct hist *)malloc(sizeof(struct hist));
+		if (args[i].lat == NULL) {
+			fprintf(stderr, "kvcache: out of memory\n");
+			return 1;
+		}
+	}
+
+	b.nthreads = nthreads;
+	if (bench_run(&b) != 0) {
+		return 1;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		ops += args[i].ops;
+		hits += args[i].hits;
+		misses += args[i].misses;
+	}
+	for (i = 0; i < NSHARDS; i++) {
+		payload += shards[i].payload;
+		nentries += shards[i].nentries;
+		evictions += shards[i].evictions;
+		expirations += shards[i].expirations;
+	}
+
+	hist_init(&lat);
+	for (i = 0; i < nthreads; i++) {
+		hist_merge(&lat, args[i].lat);
+	}
+
+	printf("Hit rate = %.1f%%, %lu evictions, %lu expired\n",
+	       ops ? 100.0 * hits / ops : 0.0, evictions, expirations);
+	if (lat.count > 0) {
+		printf("Latency p50 = %.0f ns, p99 = %.0f ns, p99.9 = %.0f ns, max = %.0f ns (%s)\n",
+		       timer_ns(hist_percentile(&lat, 0.5)), timer_ns(hist_percentile(&lat, 0.99)),
+		       timer_ns(hist_percentile(&lat, 0.999)), timer_ns(lat.max), timer_source());
+		bench_metric("p50_ns", timer_ns(hist_percentile(&lat, 0.5)));
+		bench_metric("p99_ns", timer_ns(hist_percentile(&lat, 0.99)));
+		bench_metric("p999_ns", timer_ns(hist_percentile(&lat, 0.999)));
+	}
+	printf("Live payload = %lu bytes in %lu entries, overhead ratio %f\n",
+	       (unsigned long)payload, nentries,
+	       payload ? (double)mem_usage() / payload : 0.0);
+	bench_metric("hit_rate", ops ? (double)hits / ops : 0.0);
+	bench_metric("payload", payload);
+	bench_report(&b);
+
+	for (i = 0; i < nthreads; i++) {
+		free(args[i].lat);
+	}
+	free(args);
+	return 0;
+}
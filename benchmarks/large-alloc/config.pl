@@ -0,0 +1,4 @@
+# per-benchmark configuration values
+maxtime => '120', # 16 MB buffers are slow to touch; a2alloc may run out of segment
+args => '400 4096 16777216 log 4 1', #iterations, min_size, max_size, distribution, nlive, seed
+graphtitle => "large-alloc - runtimes"
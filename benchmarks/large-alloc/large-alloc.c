@@ -0,0 +1,296 @@
+/*
+ * large-alloc
+ *
+ * Exercises the large-object path of an allocator (a2alloc's
+ * large_malloc/large_free, kheap's big_kmalloc/big_kfree).
+ *
+ * Each thread keeps a window of nlive buffers. On every iteration it
+ * frees a randomly chosen buffer, allocates a replacement whose size
+ * is drawn from the selected distribution, and writes to every page
+ * of the new buffer so that the memory is really backed.
+ *
+ * Besides the runtime and throughput, the benchmark reports:
+ *  - how much the data segment grew compared to the peak amount of
+ *    live memory requested by the threads, and
+ *  - how often a new buffer was placed inside a range that the same
+ *    thread had freed before, i.e. whether freed large memory is
+ *    actually reused.
+ *
+ * Usage: large-alloc nthreads iterations min_size max_size dist nlive [seed]
+ *
+ *   dist is one of
+ *     uniform - size uniformly distributed in [min_size, max_size]
+ *     log     - log2(size) uniformly distributed, favours small buffers
+ *     pow2    - a random power of two in [min_size, max_size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "memlib.h"
+#include "bench.h"
+#include "xorshift.h"
+
+#define TOUCH_STRIDE 4096	/* write one byte per page */
+#define RECENT_FREES 64		/* freed ranges remembered per thread */
+#define MAX_THREADS 64
+
+enum dist {
+	DIST_UNIFORM,
+	DIST_LOG,
+	DIST_POW2
+};
+
+struct range {
+	char *lo;
+	size_t len;
+};
+
+/* Per-thread arguments and results, one cache line apart. */
+struct workerArg {
+	uint64_t seed;
+
+	unsigned long ops;		/* successful allocations */
+	unsigned long failures;		/* mm_malloc returned NULL */
+	unsigned long reused;		/* allocations placed in a freed range */
+	unsigned long bytes;		/* total bytes allocated */
+	size_t peak_live;		/* peak bytes held by this thread */
+} __attribute__((aligned(64)));
+
+static int nthreads;
+static int iterations;
+static size_t min_size;
+static size_t max_size;
+static enum dist distribution;
+static int nlive;
+static uint64_t seed = 1;
+static struct workerArg *args;
+
+static const char *dist_names[] = { "uniform", "log", "pow2" };
+
+static size_t pick_size(uint64_t *state)
+{
+	size_t sz;
+	int lo_bits, hi_bits, bits;
+
+	if (min_size == max_size) {
+		return min_size;
+	}
+
+	switch (distribution) {
+	case DIST_UNIFORM:
+		return min_size + next_rand(state) % (max_size - min_size + 1);
+
+	case DIST_POW2:
+	case DIST_LOG:
+		lo_bits = 63 - __builtin_clzl(min_size);
+		hi_bits = 63 - __builtin_clzl(max_size);
+		bits = lo_bits + next_rand(state) % (hi_bits - lo_bits + 1);
+		sz = (size_t)1 << bits;
+		if (distribution == DIST_LOG) {
+			/* spread uniformly inside the chosen octave */
+			sz += next_rand(state) % sz;
+		}
+		if (sz < min_size) {
+			sz = min_size;
+		}
+		if (sz > max_size) {
+			sz = max_size;
+		}
+		return sz;
+	}
+	return min_size;
+}
+
+static void touch(char *buf, size_t sz)
+{
+	size_t off;
+
+	for (off = 0; off < sz; off += TOUCH_STRIDE) {
+		buf[off] = (char)off;
+	}
+	buf[sz - 1] = 1;
+}
+
+/*
+ * Check whether ptr lies in one of the ranges this thread freed
+ * recently. A hit is forgotten so it is only counted once.
+ */
+static int was_freed(struct range *recent, char *ptr)
+{
+	int i;
+
+	for (i = 0; i < RECENT_FREES; i++) {
+		if (recent[i].lo != NULL && ptr >= recent[i].lo &&
+		    ptr < recent[i].lo + recent[i].len) {
+			recent[i].lo = NULL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void worker(struct bench_thread *t)
+{
+	struct workerArg *w = &args[t->id];
+	struct range recent[RECENT_FREES];
+	unsigned long ops = w->ops;
+	char **bufs;
+	size_t *lens;
+	size_t live = 0;
+	int next_recent = 0;
+	int i, victim;
+
+	memset(recent, 0, sizeof(recent));
+	bufs = (char **)calloc(nlive, sizeof(char *));
+	lens = (size_t *)calloc(nlive, sizeof(size_t));
+	if (bufs == NULL || lens == NULL) {
+		fprintf(stderr, "thread %d: out of memory for bookkeeping\n", t->id);
+		exit(1);
+	}
+
+	for (i = 0; i < iterations; i++) {
+		victim = next_rand(&w->seed) % nlive;
+		if (bufs[victim] != NULL) {
+			recent[next_recent].lo = bufs[victim];
+			recent[next_recent].len = lens[victim];
+			next_recent = (next_recent + 1) % RECENT_FREES;
+			mm_free(bufs[victim]);
+			live -= lens[victim];
+			bufs[victim] = NULL;
+		}
+
+		lens[victim] = pick_size(&w->seed);
+		bufs[victim] = (char *)mm_malloc(lens[victim]);
+		if (bufs[victim] == NULL) {
+			w->failures++;
+			continue;
+		}
+		if (was_freed(recent, bufs[victim])) {
+			w->reused++;
+		}
+		touch(bufs[victim], lens[victim]);
+
+		w->ops++;
+		w->bytes += lens[victim];
+		live += lens[victim];
+		if (live > w->peak_live) {
+			w->peak_live = live;
+		}
+	}
+
+	for (i = 0; i < nlive; i++) {
+		mm_free(bufs[i]);
+	}
+
+	t->ops = w->ops - ops;
+	free(bufs);
+	free(lens);
+}
+
+/* Results cover all measured runs, so start over before the first one. */
+static void setup(struct bench *b, int run)
+{
+	int i;
+
+	if (run <= 0) {
+		memset(args, 0, nthreads * sizeof(struct workerArg));
+		for (i = 0; i < nthreads; i++) {
+			args[i].seed = seed * 0x9e3779b97f4a7c15ULL + i + 1;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b = { .name = "large-alloc", .setup = setup, .worker = worker };
+	unsigned long ops = 0, failures = 0, reused = 0, bytes = 0;
+	size_t peak_live = 0;
+	ptrdiff_t seg_before, seg_after;
+	int i;
+
+	bench_init(&argc, argv);
+
+	if (argc < 7) {
+		bench_usage("nthreads iterations min_size max_size uniform|log|pow2 nlive [seed]");
+		return 1;
+	}
+
+	nthreads = atoi(argv[1]);
+	iterations = atoi(argv[2]);
+	min_size = strtoul(argv[3], NULL, 0);
+	max_size = strtoul(argv[4], NULL, 0);
+	nlive = atoi(argv[6]);
+	if (argc > 7) {
+		seed = strtoull(argv[7], NULL, 0);
+	}
+
+	if (strcmp(argv[5], "uniform") == 0) {
+		distribution = DIST_UNIFORM;
+	} else if (strcmp(argv[5], "log") == 0) {
+		distribution = DIST_LOG;
+	} else if (strcmp(argv[5], "pow2") == 0) {
+		distribution = DIST_POW2;
+	} else {
+		fprintf(stderr, "Unknown distribution %s\n", argv[5]);
+		return 1;
+	}
+
+	if (nthreads < 1 || nthreads > MAX_THREADS || nlive < 1 ||
+	    min_size < 1 || max_size < min_size) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	printf("Running large-alloc for %d threads, %d iterations, sizes %lu-%lu (%s), %d live\n",
+	       nthreads, iterations, (unsigned long)min_size, (unsigned long)max_size,
+	       dist_names[distribution], nlive);
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	/* Keep the per-thread records out of the allocator under test. */
+	args = (struct workerArg *)aligned_alloc(64, nthreads * sizeof(struct workerArg));
+
+	seg_before = mem_usage();
+
+	b.nthreads = nthreads;
+	if (bench_run(&b) != 0) {
+		return 1;
+	}
+
+	double t = bench_elapsed();
+
+	seg_after = mem_usage();
+
+	for (i = 0; i < nthreads; i++) {
+		ops += args[i].ops;
+		failures += args[i].failures;
+		reused += args[i].reused;
+		bytes += args[i].bytes;
+		peak_live += args[i].peak_live;
+		printf("thread %d: %lu allocs, %lu failed, %lu reused\n",
+		       i, args[i].ops, args[i].failures, args[i].reused);
+	}
+
+	printf("Bandwidth = %.1f MB allocated per second\n", bytes / t / (1024 * 1024));
+	printf("Failed allocations = %lu\n", failures);
+	printf("Reused allocations = %lu of %lu (%.1f%%)\n", reused, ops,
+	       ops ? 100.0 * reused / ops : 0.0);
+	printf("Peak live = %lu bytes, segment growth = %ld bytes, ratio %f\n",
+	       (unsigned long)peak_live, (long)(seg_after - seg_before),
+	       peak_live ? (double)(seg_after - seg_before) / peak_live : 0.0);
+	bench_metric("failures", failures);
+	bench_metric("reused", reused);
+	bench_metric("peak_live", peak_live);
+	bench_metric("segment_growth", seg_after - seg_before);
+	bench_report(&b);
+
+	free(args);
+	return 0;
+}
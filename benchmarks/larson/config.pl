@@ -1,4 +1,4 @@
 # per-benchmark configuration values
 maxtime => '30', # larson should end after 15s fixed time. Allow twice that.
-args => '15 8 40 10000 10 1', #sleep_cnt, min_size, max_size, chperthread, num_rounds, seed
+args => '15 8 40 10000 10 1', #sleep_cnt, min_size, max_size, chperthread, num_rounds, seed[, fixed_ops]
 graphtitle => "larson - throughput"
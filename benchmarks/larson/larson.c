@@ -9,10 +9,13 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <math.h>
 
 #include "mm_thread.h"
 #include "malloc.h"
 #include "memlib.h"
+#include "perfctr.h"
+#include "bench.h"
 #include "timer.h"
 
 typedef void * LPVOID;
@@ -35,13 +38,6 @@ enum { TRUE = 1, FALSE = 0 };
 int numCPU;
 
 #define _inline inline
-void Sleep (long x) 
-{
-  //  printf ("sleeping for %ld seconds.\n", x/1000);
-  if (sleep(x/1000) != 0) {
-    printf("Sleep: woke up early!\n");
-  }
-}
 
 void QueryPerformanceCounter (long * x)
 {
@@ -60,20 +56,6 @@ void QueryPerformanceFrequency(long * x)
 
 #define _REENTRANT 1
 
-typedef void * VoidFunction (void *);
-void _beginthread (VoidFunction x, int unused, void * z)
-{
-  pthread_t pt;
-  pthread_attr_t pa;
-
-  initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
-			  PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &pa);
-
-  
-  //  printf ("creating a thread.\n");
-  int v = pthread_create(&pt, &pa, x, z);
-  //  printf ("v = %d\n", v);
-}
 
 
 
@@ -93,6 +75,7 @@ int     TotalAllocs=0 ;
 typedef struct thr_data {
 
   int    threadno ;
+  int    cpu ;
   int    NumBlocks ;
   int    seed ;
 
@@ -107,16 +90,18 @@ typedef struct thr_data {
   unsigned long    cFrees ;
   int    cThreads ;
   unsigned long    cBytesAlloced ;
+  unsigned long    target ;	/* fixed-work mode: allocations to do, 0 if timed */
+  double           elapsed ;
 
   volatile int finished ;
   struct lran2_st rgen ;
 
-} thread_data;
+} __attribute__((aligned(64))) thread_data;	/* no sharing between threads */
 
 void runthreads(long sleep_cnt, int min_threads, int max_threads, 
-		int chperthread, int num_rounds) ;
+		int chperthread, int num_rounds, unsigned long fixed_ops) ;
 void runloops(long sleep_cnt, int num_chunks ) ;
-static void warmup(char **blkp, int num_chunks );
+static void warmup(char **blkp, int *blksize, int num_chunks );
 static void * exercise_heap( void *pinput) ;
 static void lran2_init(struct lran2_st* d, long seed) ;
 static long lran2(struct lran2_st* d) ;
@@ -126,6 +111,7 @@ char *          blkp[MAX_BLOCKS] ;
 int             blksize[MAX_BLOCKS] ;
 long            seqlock=0 ;
 struct lran2_st rgen ;
+unsigned        rgen_seed ;
 int             min_size=10, max_size=500 ;
 int             num_threads ;
 ULONG           init_space ;
@@ -151,6 +137,9 @@ int main (int argc, char *argv[])
   unsigned     seed=12345 ;
   int          num_chunks=10000;
   long sleep_cnt;
+  unsigned long fixed_ops = 0 ;
+
+  bench_init(&argc, argv);
 
   if (argc > 7) {
     max_threads = atoi(argv[1]);
@@ -161,6 +150,9 @@ int main (int argc, char *argv[])
     chperthread = atoi(argv[5]);
     num_rounds = atoi(argv[6]);
     seed = atoi(argv[7]);
+    if (argc > 8) {
+      fixed_ops = strtoul(argv[8], NULL, 0);
+    }
     goto DoneWithInput;
   }
 
@@ -226,6 +218,7 @@ int main (int argc, char *argv[])
     return(1) ;
   }
 
+  rgen_seed = seed ;
   lran2_init(&rgen, seed) ;
   // init_space = CountReservedSpace() ;
 
@@ -236,7 +229,7 @@ int main (int argc, char *argv[])
 
 #if defined(_MT) || defined(_REENTRANT)
   //#ifdef _MT
-  runthreads(sleep_cnt, min_threads, max_threads, chperthread, num_rounds) ;
+  runthreads(sleep_cnt, min_threads, max_threads, chperthread, num_rounds, fixed_ops) ;
 #else
   runloops(sleep_cnt, num_chunks ) ;
 #endif
@@ -319,132 +312,222 @@ void runloops(long sleep_cnt, int num_chunks )
  * always use min==max, and we re-run with a different input for each
  * number of CPUs we want to create.
  *
- * After a warmup, it then creates initializes the data and creates 
- * the threads, each of which runs exercise_heap, until they are 
- * told to stop.  The main thread sleeps for some seconds (specified 
- * in the input) and then sets the stop flag which each worker thread
- * checks to see if it is done.
+ * After a warmup, it then creates initializes the data and hands the
+ * threads to the benchmark driver (bench.h).  Each driver thread runs
+ * a chain of short-lived threads, each of which runs exercise_heap
+ * for num_rounds rounds on the same data, until they are told to stop.
+ * The main thread sleeps for some seconds (specified in the input)
+ * and then sets the stop flag which each worker thread checks to see
+ * if it is done.
  *
  * When all threads are done, the work performed by each CPU is summed up
  * and a throughput is reported.
  *
+ * In fixed-work mode (an allocation count after the seed on the command
+ * line) there is no timer: each thread stops after that many
+ * allocations, so every run does the same work from the same seed and
+ * only the time varies. The spread of the per-thread allocation counts
+ * and rates is reported in both modes.
+ *
+ * Each thread's block array is allocated separately and cache line
+ * aligned, as is its thread_data, so threads only share the heap.
+ *
  * Throughput should increase linearly as CPUs are added, since each 
  * thread works independently, except for contention over the heap. 
  */
 
-void runthreads(long sleep_cnt, int min_threads, int max_threads, int chperthread, int num_rounds)
+static thread_data de_area[MAX_THREADS] ;
+static char **thr_array[MAX_THREADS] ;
+static int   *thr_blksize[MAX_THREADS] ;
+static unsigned long thr_ops[MAX_THREADS] ;	/* summed over measured runs */
+static double thr_time[MAX_THREADS] ;
+static long run_seconds ;
+static int  run_chperthread ;
+static int  run_rounds ;
+static unsigned long run_fixed_ops ;
+static int  prevthreads ;
+
+/* n bytes rounded up to whole cache lines, from libc */
+static void *line_alloc(size_t n)
 {
-  thread_data   de_area[MAX_THREADS] ;
-  thread_data  *pdea;
-  int           nperthread ;
-  int           sum_threads ;
-  unsigned long sum_allocs ;
-  unsigned long sum_frees ;
-  double        duration ;
-  unsigned long start_cnt, end_cnt ;
-  _int64        ticks ;
-  double        rate_1=0, rate_n ;
-  double        reqd_space ;
-  ULONG         used_space ;
-  int           prevthreads ;
-  int           i ;
-  struct timespec start_time;
-  struct timespec end_time;
+  void *p = aligned_alloc(64, (n + 63) & ~(size_t)63) ;
 
+  if (p == NULL) {
+    fprintf(stderr, "larson: out of memory\n") ;
+    exit(1) ;
+  }
+  return p ;
+}
 
-  pdea = &de_area[0] ;
-  memset(&de_area[0], 0, sizeof(thread_data)) ;
+static void larson_setup(struct bench *b, int run)
+{
+  int i ;
+
+  /*
+   * Only the first run populates the heap; later runs continue from it.
+   * The new threads' blocks are allocated and shuffled together in
+   * blkp, then each thread gets its share in a private array.
+   */
+  if (prevthreads < num_threads) {
+    int off = prevthreads*run_chperthread ;
+
+    warmup(&blkp[off], &blksize[off], (num_threads-prevthreads)*run_chperthread );
+    for (i = prevthreads; i < num_threads; i++) {
+      thr_array[i] = (char **)line_alloc(run_chperthread * sizeof(char *)) ;
+      thr_blksize[i] = (int *)line_alloc(run_chperthread * sizeof(int)) ;
+      memcpy(thr_array[i], &blkp[i*run_chperthread], run_chperthread * sizeof(char *)) ;
+      memcpy(thr_blksize[i], &blksize[i*run_chperthread], run_chperthread * sizeof(int)) ;
+    }
+    prevthreads = num_threads ;
+  }
 
-  prevthreads = 0 ;
-  for(num_threads=min_threads; num_threads <= max_threads; num_threads++ )
-    {
+  stopflag   = FALSE ;
 
-      warmup(&blkp[prevthreads*chperthread], (num_threads-prevthreads)*chperthread );
-
-      nperthread = chperthread ;
-      stopflag   = FALSE ;
-		
-      for(i=0; i< num_threads; i++){
-	de_area[i].threadno    = i+1 ;
-	de_area[i].NumBlocks   = num_rounds*nperthread;
-	de_area[i].array       = &blkp[i*nperthread] ;
-	de_area[i].blksize     = &blksize[i*nperthread] ;
-	de_area[i].asize       = nperthread ;
-	de_area[i].min_size    = min_size ;
-	de_area[i].max_size    = max_size ;
-	de_area[i].seed        = lran2(&rgen) ; ;
-	de_area[i].finished    = 0 ;
-	de_area[i].cAllocs     = 0 ;
-	de_area[i].cFrees      = 0 ;
-	de_area[i].cThreads    = 0 ;
-	de_area[i].finished    = FALSE ;
-	lran2_init(&de_area[i].rgen, de_area[i].seed) ;
-
-	_beginthread(exercise_heap, 0, &de_area[i]) ;  
+  /* Every run deals the threads the same seeds */
+  lran2_init(&rgen, rgen_seed) ;
+  for(i=0; i< num_threads; i++){
+    if (run <= 0) {
+      thr_ops[i] = 0 ;
+      thr_time[i] = 0 ;
+    }
+    de_area[i].threadno    = i+1 ;
+    de_area[i].NumBlocks   = run_rounds*run_chperthread;
+    de_area[i].array       = thr_array[i] ;
+    de_area[i].blksize     = thr_blksize[i] ;
+    de_area[i].asize       = run_chperthread ;
+    de_area[i].min_size    = min_size ;
+    de_area[i].max_size    = max_size ;
+    de_area[i].seed        = lran2(&rgen) ; ;
+    de_area[i].finished    = 0 ;
+    de_area[i].cAllocs     = 0 ;
+    de_area[i].cFrees      = 0 ;
+    de_area[i].cThreads    = 0 ;
+    de_area[i].target      = run_fixed_ops ;
+    de_area[i].elapsed     = 0 ;
+    de_area[i].finished    = FALSE ;
+    lran2_init(&de_area[i].rgen, de_area[i].seed) ;
+  }
+}
 
-      }
+/* Replace each thread by a new one until stopped or the work is done */
+static void larson_worker(struct bench_thread *t)
+{
+  thread_data *pdea = &de_area[t->id] ;
+  struct timespec start, end ;
+  pthread_attr_t attr ;
+  pthread_t pt ;
 
-      /* Get the starting time */
-      clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
+  pdea->cpu = t->cpu ;
+  initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
+			  PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
 
-      //printf ("Sleeping for %ld seconds.\n", sleep_cnt);
-      Sleep(sleep_cnt * 1000L) ;
-      stopflag = TRUE ;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start) ;
+  while( !stopflag && (pdea->target == 0 || pdea->cAllocs < pdea->target) ){
+    if (pthread_create(&pt, &attr, exercise_heap, pdea) != 0) {
+      perror("larson: pthread_create failed");
+      break ;
+    }
+    pthread_join(pt, NULL) ;
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end) ;
+  pdea->elapsed = timespec_diff(&start, &end) ;
+  pdea->finished = TRUE ;
+  t->ops = pdea->cAllocs ;
+  if (bench_measuring()) {
+    thr_ops[t->id] += pdea->cAllocs ;
+    thr_time[t->id] += pdea->elapsed ;
+  }
+}
 
-      for(i=0; i<num_threads; i++){
-	while( !de_area[i].finished ){
-		sched_yield();
-	}
-      }
+/* Mean, minimum, maximum and coefficient of variation of n values */
+static void spread(const double *v, int n, double *mean, double *min, double *max, double *cv)
+{
+  double sum = 0, var = 0 ;
+  int i ;
+
+  *min = *max = v[0] ;
+  for (i = 0; i < n; i++) {
+    sum += v[i] ;
+    if (v[i] < *min) *min = v[i] ;
+    if (v[i] > *max) *max = v[i] ;
+  }
+  *mean = sum / n ;
+  for (i = 0; i < n; i++) {
+    var += (v[i] - *mean) * (v[i] - *mean) ;
+  }
+  var = n > 1 ? var / (n - 1) : 0 ;
+  *cv = *mean > 0 ? sqrt(var) / *mean : 0 ;
+}
 
-      /* Get the ending time */
-      clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+/* How evenly the work and the speed were spread over the threads */
+static void report_distribution(int nthreads)
+{
+  double ops[MAX_THREADS], rate[MAX_THREADS] ;
+  double mean, min, max, cv ;
+  int i ;
 
-      sum_frees = sum_allocs =0  ;
-      sum_threads = 0 ;
-      for(i=0;i< num_threads; i++){
-	sum_allocs    += de_area[i].cAllocs ;
-	sum_frees     += de_area[i].cFrees ;
-	sum_threads   += de_area[i].cThreads ;
-	printf("area %d: %ld allocs, %d threads\n",i,de_area[i].cAllocs,de_area[i].cThreads);
-	de_area[i].cAllocs = de_area[i].cFrees = 0;
+  for (i = 0; i < nthreads; i++) {
+    ops[i] = (double)thr_ops[i] / bench_runs() ;
+    rate[i] = thr_time[i] > 0 ? thr_ops[i] / thr_time[i] : 0 ;
+  }
+  spread(ops, nthreads, &mean, &min, &max, &cv) ;
+  printf("Per-thread allocs: mean %.0f, min %.0f, max %.0f, cv %.4f\n", mean, min, max, cv) ;
+  bench_metric("ops_cv", cv) ;
+  spread(rate, nthreads, &mean, &min, &max, &cv) ;
+  printf("Per-thread rate: mean %.0f, min %.0f, max %.0f allocs/s, cv %.4f\n", mean, min, max, cv) ;
+  bench_metric("rate_min", min) ;
+  bench_metric("rate_max", max) ;
+  bench_metric("rate_cv", cv) ;
+}
+
+static void larson_control(struct bench *b)
+{
+  struct timespec ts = { run_seconds, 0 } ;
+
+  //printf ("Sleeping for %ld seconds.\n", run_seconds);
+  while (nanosleep(&ts, &ts) != 0)
+    ;
+  stopflag = TRUE ;
+}
+
+void runthreads(long sleep_cnt, int min_threads, int max_threads, int chperthread, int num_rounds,
+		unsigned long fixed_ops)
+{
+  struct bench  b = { .name = "larson", .units = "operations",
+		      .setup = larson_setup, .worker = larson_worker,
+		      .control = larson_control,
+		      .self_counted = 1 } ;
+  double        reqd_space ;
+  int           i ;
+
+  run_seconds = sleep_cnt ;
+  run_chperthread = chperthread ;
+  run_rounds = num_rounds ;
+  run_fixed_ops = fixed_ops ;
+  prevthreads = 0 ;
+  if (fixed_ops > 0) {
+    printf("Fixed work: %lu allocations per thread\n", fixed_ops) ;
+    b.control = NULL ;
+  }
+  for(num_threads=min_threads; num_threads <= max_threads; num_threads++ )
+    {
+      b.nthreads = num_threads ;
+      if (bench_run(&b) != 0) {
+	exit(1) ;
       }
- 
-      duration = timespec_diff(&start_time, &end_time) ;
 
-      for( i=0; i<num_threads; i++){
+      for(i=0;i< num_threads; i++){
+	printf("area %d: %ld allocs, %d threads\n",i,de_area[i].cAllocs,de_area[i].cThreads);
 	if( !de_area[i].finished )
 	  printf("Thread at %d not finished\n", i) ;
       }
 
-
-      rate_n = sum_allocs/duration ;
-      if( rate_1 == 0){
-	rate_1 = rate_n ;
-      }
-		
       reqd_space = (0.5*(min_size+max_size)*num_threads*chperthread) ;
       // used_space = CountReservedSpace() - init_space;
-      used_space = mem_usage();
-      
-      printf ("Throughput = %8.0f operations per second.\n", sum_allocs / duration);
-      printf ("Memory used = %ld bytes, required %.0lf, ratio %lf\n",used_space,reqd_space,used_space/reqd_space);
-
-#if 0
-      printf("%2d ", num_threads ) ;
-      printf("%6.3f", duration  ) ;
-      printf("%6.3f", rate_n/rate_1 ) ;
-      printf("%8.0f", sum_allocs/duration ) ;
-      printf(" %6.3f %.3f", (double)used_space/(1024*1024), used_space/reqd_space) ;
-      printf("\n") ;
-#endif
-
-      Sleep(5000L) ; // wait 5 sec for old threads to die
-
-      prevthreads = num_threads ;
-
-      printf ("Done sleeping...\n");
-
+      printf ("Required space = %.0lf bytes, ratio %lf\n",reqd_space,mem_usage()/reqd_space);
+      bench_metric("required_space", reqd_space) ;
+      report_distribution(num_threads) ;
+      bench_report(&b) ;
     }
 }
 
@@ -457,18 +540,17 @@ static void * exercise_heap( void *pinput)
   long          blk_size ;
   int           range ;
 
-  if( stopflag ) {
-    printf("thread %u stopping immediately\n",((thread_data *)pinput)->threadno);
-      return 0;
-  }
-
   pdea = (thread_data *)pinput ;
 
-  setCPU(pdea->threadno % numCPU);
+  if (pdea->cpu >= 0) {
+    setCPU(pdea->cpu);
+  }
+  if (bench_measuring()) {
+    perfctr_begin();
+  }
 
   /*printf("Thread %u starting exercise, nthreads=%d\n",pdea->threadno,pdea->cThreads) ;*/
 
-  pdea->finished = FALSE ;
   pdea->cThreads++ ;
   range = pdea->max_size - pdea->min_size ;
 
@@ -498,28 +580,22 @@ static void * exercise_heap( void *pinput)
     *chptr = 'b';
     
     
-    if( stopflag ) break ;
+    if( stopflag || pdea->cAllocs == pdea->target ) break ;
   }
 
   //printf("Thread %u terminating: %d allocs, %d frees\n",
   // pdea->threadno, pdea->cAllocs, pdea->cFrees) ;
-  pdea->finished = TRUE ;
-
-  if( !stopflag ){
-    _beginthread(exercise_heap, 0, pdea) ;
-  } else {
-    printf ("thread stopping.\n");
-  }
-  pthread_exit (NULL);
+  perfctr_end(pdea->threadno - 1);
   return 0;
 }
 
-static void warmup(char **blkp, int num_chunks )
+static void warmup(char **blkp, int *blksize, int num_chunks )
 {
   int     cblks ;
   int     victim ;
   int     blk_size ;
   LPVOID  tmp ;
+  int     tmp_size ;
 
 
   for( cblks=0; cblks<num_chunks; cblks++){
@@ -539,6 +615,9 @@ static void warmup(char **blkp, int num_chunks )
     tmp = blkp[victim] ;
     blkp[victim]  = blkp[cblks-1] ;
     blkp[cblks-1] = (char *) tmp ;
+    tmp_size = blksize[victim] ;
+    blksize[victim]  = blksize[cblks-1] ;
+    blksize[cblks-1] = tmp_size ;
   }
 
   for( cblks=0; cblks<4*num_chunks; cblks++){
@@ -30,29 +30,25 @@
 #include "timer.h"
 #include "malloc.h"
 #include "memlib.h"
+#include "bench.h"
 
-#define NSECSPERSEC 1000000000L
-#define pthread_attr_default NULL
 #define MAX_THREADS 50
 
 double * executionTimes;
-void * run_test (void *);
+static void run_test (struct bench_thread *);
 
 static unsigned long size = 512;
 static uint64_t iteration_count = 1000000;
 static unsigned int thread_count = 1;
-static int numCPU = 0;
-
-#include "ptbarrier.h"
-
-pthread_barrier_t barrier;
+static int failed = 0;
 
 int 
 main (int argc, char *argv[])
 {
+	struct bench b = { .name = "linux-scalability", .worker = run_test };
 	unsigned int i;
-	pthread_t thread[MAX_THREADS];
-	int *result;
+
+	bench_init(&argc, argv);
 
 	/*           Parse our arguments          */
 	switch (argc)
@@ -75,49 +71,30 @@ main (int argc, char *argv[])
 	printf ("Object size: %ld, Iterations: %lu, Threads: %d\n",
 		size, iteration_count, thread_count);
 	
-	numCPU = getNumProcessors();
-	printf("Running on system with %d processors.\n",numCPU);
+	printf("Running on system with %d processors.\n",getNumProcessors());
 	
 	/* Call allocator-specific initialization function */
 	mm_init();
 	
-	executionTimes = (double *) mm_malloc (sizeof(double) * thread_count);
+	/* Summed over all measured runs */
+	executionTimes = (double *) calloc (thread_count, sizeof(double));
 	if (executionTimes == NULL) {
 		printf("Failed to allocate %ld bytes for executionTimes. Exiting.\n",
 		       sizeof(double)*thread_count);
 		exit(1);
 	}
 	
-	pthread_barrier_init (&barrier, NULL, thread_count);
-	
 	/*          * Invoke the tests          */
 
-	pthread_attr_t attr;
-	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10, 
-				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
-
 	printf ("Starting test...\n");
 	
-	for (i = 0; i < thread_count; i++) {
-		int * tid = (int *) mm_malloc(sizeof(int));
-		if (tid == NULL) {
-			printf("Failed to allocate %ld bytes for tid. Exiting.\n",
-			       sizeof(int));
-		}
-		
-		*tid = i;
-		if (pthread_create (&(thread[i]), &attr, &run_test, tid))
-			printf ("failed.\n");
+	b.nthreads = thread_count;
+	if (bench_run(&b) != 0) {
+		exit(1);
 	}
-	
-	/*          * Wait for tests to finish          */
-	
-	for (i = 0; i < thread_count; i++) {
-		pthread_join (thread[i], (void **)&result);
-		if (result != NULL) {
-			printf("Thread %d exited with error. Exiting.\n",i);
-			exit(1);
-		}
+	if (failed) {
+		printf("A thread exited with error. Exiting.\n");
+		exit(1);
 	}
 	
 	/* EDB: moved to outer loop. */
@@ -140,24 +117,20 @@ main (int argc, char *argv[])
 		printf ("Average execution time = %f seconds.\n", average);
 	}
 	
-	printf ("Memory used = %ld bytes\n",mem_usage());
-	mm_free(executionTimes);
+	bench_report(&b);
+	free(executionTimes);
 	
 	exit (0);
 }
 
-void * 
-run_test (void * arg) {
+static void
+run_test (struct bench_thread *t) {
 	register unsigned int i;
 	register unsigned long request_size = size;
 	register uint64_t total_iterations = iteration_count;
-	int tid = *((int *) arg);
+	int tid = t->id;
 	struct timespec start, end;
 	
-	setCPU((tid+1)%numCPU);
-
-	pthread_barrier_wait (&barrier);
-
   	/* Get the starting time */
 	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
 
@@ -166,7 +139,8 @@ run_test (void * arg) {
 		if (buf == NULL) {
 			printf("Failed to allocate %ld bytes for buf in thread %d. Exiting\n",
 			       sizeof(void *)*total_iterations, tid);
-			return (void *)0xdeadbeef;
+			failed = 1;
+			return;
 		}
 
 		for (i = 0; i < total_iterations; i++)
@@ -175,7 +149,8 @@ run_test (void * arg) {
 				if (buf[i] == NULL) {
 					printf("Failed to allocate %ld bytes for buf[%d] in thread %d. Exiting.\n",
 					       request_size, i, tid);
-					return (void *)0xdeadbeef;
+					failed = 1;
+					return;
 				}
 			}
     
@@ -189,10 +164,8 @@ run_test (void * arg) {
 	/* Get the ending time */
 	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
 
-	pthread_barrier_wait (&barrier);
-	unsigned int pt = tid;
-	executionTimes[pt % thread_count] = timespec_diff(&start, &end);
-
-	return NULL;
+	t->ops = 2 * total_iterations;
+	if (t->run >= 0) {
+		executionTimes[tid] += timespec_diff(&start, &end) / bench_runs();
+	}
 }
-
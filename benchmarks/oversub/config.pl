@@ -0,0 +1,6 @@
+# per-benchmark configuration values
+# The thread count passed by runbench.pl is the oversubscription factor:
+# the benchmark runs factor * (number of CPUs) unpinned threads.
+maxtime => '120', # spinlock holders get preempted, allow plenty of time
+args => '200000 256 1000 1', #iterations, max_size, migrate_us (0 = no forced migration), seed
+graphtitle => "oversub - runtimes"
@@ -0,0 +1,310 @@
+/*
+ * oversub
+ *
+ * Oversubscription and migration stress test.
+ *
+ * The other benchmarks pin each thread to one CPU and never run more
+ * threads than CPUs, so a thread always finds the same sched_getcpu()
+ * heap and lock holders are never preempted. This benchmark runs
+ * factor * (number of CPUs) threads without pinning them. Optionally
+ * the main thread forces migrations: every migrate_us microseconds it
+ * pins a random worker to a random CPU with sched_setaffinity, and
+ * releases the worker it pinned the previous time.
+ *
+ * Each thread keeps a window of WINDOW objects and repeatedly frees a
+ * random one and allocates a replacement of random size. Every call
+ * into the allocator is timed. Calls that take longer than
+ * STALL_NSEC are counted as stalls and their total time is reported
+ * as spin time. A stall is either a thread spinning on a lock whose
+ * holder was descheduled, or the caller itself being preempted inside
+ * the allocator; libc, which blocks instead of spinning, gives the
+ * baseline for the latter.
+ *
+ * Reports throughput, per-thread fairness (Jain's index over the
+ * per-thread operation rates, and the spread of completion times),
+ * time spent inside the allocator, spin time, and how often threads
+ * observed a CPU change between operations.
+ *
+ * Usage: oversub factor iterations max_size migrate_us [seed]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "memlib.h"
+#include "bench.h"
+#include "xorshift.h"
+
+#define WINDOW 256
+#define MIN_SIZE 8
+#define STALL_NSEC 10000	/* 10 us */
+#define MAX_THREADS 1024
+
+struct workerArg {
+	volatile int tid;	/* kernel thread id, for sched_setaffinity */
+	volatile int finished;
+	uint64_t seed;
+
+	unsigned long ops;
+	unsigned long stalls;
+	unsigned long cpu_changes;
+	uint64_t alloc_nsec;	/* time inside mm_malloc/mm_free */
+	uint64_t stall_nsec;	/* part of alloc_nsec spent in stalls */
+	uint64_t max_nsec;	/* slowest single call */
+	double elapsed;
+} __attribute__((aligned(64)));
+
+static int iterations;
+static size_t max_size;
+static int nthreads;
+static long migrate_us;
+static uint64_t seed = 1;
+static unsigned long forced;
+static struct workerArg *args;
+
+static inline void account(struct workerArg *w, uint64_t ticks)
+{
+	uint64_t nsec = (uint64_t)timer_ns(ticks);
+
+
+	w->alloc_nsec += nsec;
+	if (nsec > STALL_NSEC) {
+		w->stalls++;
+		w->stall_nsec += nsec;
+	}
+	if (nsec > w->max_nsec) {
+		w->max_nsec = nsec;
+	}
+}
+
+static void worker(struct bench_thread *t)
+{
+	struct workerArg *w = &args[t->id];
+	unsigned long ops = w->ops;
+	char *objs[WINDOW];
+	struct timespec start, end;
+	uint64_t t0, t1;
+	int cpu, last_cpu;
+	int i, victim;
+
+	w->tid = getTID();
+	memset(objs, 0, sizeof(objs));
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+
+	last_cpu = sched_getcpu();
+	for (i = 0; i < iterations; i++) {
+		victim = next_rand(&w->seed) % WINDOW;
+		size_t sz = MIN_SIZE + next_rand(&w->seed) % (max_size - MIN_SIZE + 1);
+
+		t0 = timer_start();
+		mm_free(objs[victim]);
+		t1 = timer_stop();
+		account(w, t1 - t0);
+
+		t0 = timer_start();
+		objs[victim] = (char *)mm_malloc(sz);
+		t1 = timer_stop();
+		account(w, t1 - t0);
+		if (objs[victim] == NULL) {
+			fprintf(stderr, "oversub: mm_malloc failed\n");
+			exit(1);
+		}
+		objs[victim][0] = (char)i;
+		w->ops += 2;
+
+		cpu = sched_getcpu();
+		if (cpu != last_cpu) {
+			w->cpu_changes++;
+			last_cpu = cpu;
+		}
+	}
+
+	for (i = 0; i < WINDOW; i++) {
+		mm_free(objs[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+	w->elapsed += timespec_diff(&start, &end);
+	w->finished = 1;
+	t->ops = w->ops - ops;
+}
+
+/* Results cover all measured runs; every run starts unpinned. */
+static void setup(struct bench *b, int run)
+{
+	int i;
+
+	if (run <= 0) {
+		memset(args, 0, nthreads * sizeof(struct workerArg));
+		for (i = 0; i < nthreads; i++) {
+			args[i].seed = seed * 0x9e3779b97f4a7c15ULL + i + 1;
+		}
+		forced = 0;
+	}
+	for (i = 0; i < nthreads; i++) {
+		args[i].tid = 0;
+		args[i].finished = 0;
+	}
+}
+
+/*
+ * Pin a random worker to a random CPU and release the previous one.
+ * Runs in the main thread until all workers are done.
+ */
+static void force_migrations(struct bench *b)
+{
+	struct timespec interval;
+	cpu_set_t all, one;
+	uint64_t state = seed;
+	int pinned = -1;
+	int done, i, victim, cpu, ncpus;
+
+	if (sched_getaffinity(0, sizeof(all), &all) != 0) {
+		perror("sched_getaffinity failed");
+		return;
+	}
+	ncpus = CPU_COUNT(&all);
+
+	interval.tv_sec = migrate_us / 1000000;
+	interval.tv_nsec = (migrate_us % 1000000) * 1000;
+
+	for (;;) {
+		nanosleep(&interval, NULL);
+
+		done = 1;
+		for (i = 0; i < nthreads; i++) {
+			if (!args[i].finished) {
+				done = 0;
+				break;
+			}
+		}
+		if (done) {
+			break;
+		}
+
+		if (pinned >= 0 && !args[pinned].finished) {
+			sched_setaffinity(args[pinned].tid, sizeof(all), &all);
+		}
+
+		victim = next_rand(&state) % nthreads;
+		/* tid is 0 until the worker has started */
+		if (args[victim].finished || args[victim].tid == 0) {
+			pinned = -1;
+			continue;
+		}
+
+		/* Pick the n-th CPU of the allowed set. */
+		cpu = next_rand(&state) % ncpus;
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (CPU_ISSET(i, &all) && cpu-- == 0) {
+				break;
+			}
+		}
+		CPU_ZERO(&one);
+		CPU_SET(i, &one);
+		if (sched_setaffinity(args[victim].tid, sizeof(one), &one) == 0) {
+			forced++;
+		}
+		pinned = victim;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b = { .name = "oversub", .unpinned = 1, .setup = setup, .worker = worker };
+	unsigned long ops = 0, stalls = 0, cpu_changes = 0;
+	uint64_t alloc_nsec = 0, stall_nsec = 0, max_nsec = 0;
+	double sum_rate = 0, sum_rate2 = 0, min_t = 1e30, max_t = 0;
+	int factor, numCPU;
+	int i;
+
+	bench_init(&argc, argv);
+
+	if (argc < 5) {
+		bench_usage("factor iterations max_size migrate_us [seed]");
+		return 1;
+	}
+
+	factor = atoi(argv[1]);
+	iterations = atoi(argv[2]);
+	max_size = strtoul(argv[3], NULL, 0);
+	migrate_us = atol(argv[4]);
+	if (argc > 5) {
+		seed = strtoull(argv[5], NULL, 0);
+	}
+
+	numCPU = getNumProcessors();
+	nthreads = factor * numCPU;
+	if (factor < 1 || nthreads > MAX_THREADS || iterations < 1 ||
+	    max_size < MIN_SIZE || migrate_us < 0) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	printf("Running oversub with %d threads on %d CPUs (%dx), %d iterations, max size %lu, ",
+	       nthreads, numCPU, factor, iterations, (unsigned long)max_size);
+	if (migrate_us > 0) {
+		printf("forced migration every %ld us\n", migrate_us);
+		b.control = force_migrations;
+	} else {
+		printf("no forced migration\n");
+	}
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	args = (struct workerArg *)aligned_alloc(64, nthreads * sizeof(struct workerArg));
+
+	b.nthreads = nthreads;
+	if (bench_run(&b) != 0) {
+		return 1;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		double rate = args[i].elapsed > 0 ? args[i].ops / args[i].elapsed : 0;
+
+		ops += args[i].ops;
+		stalls += args[i].stalls;
+		cpu_changes += args[i].cpu_changes;
+		alloc_nsec += args[i].alloc_nsec;
+		stall_nsec += args[i].stall_nsec;
+		if (args[i].max_nsec > max_nsec) {
+			max_nsec = args[i].max_nsec;
+		}
+		sum_rate += rate;
+		sum_rate2 += rate * rate;
+		if (args[i].elapsed < min_t) {
+			min_t = args[i].elapsed;
+		}
+		if (args[i].elapsed > max_t) {
+			max_t = args[i].elapsed;
+		}
+	}
+
+	double fairness = sum_rate2 > 0 ? (sum_rate * sum_rate) / (nthreads * sum_rate2) : 0.0;
+
+	/* Jain's fairness index: 1 when all threads progress at the same rate. */
+	printf("Fairness = %f (Jain's index), thread times %f - %f seconds\n",
+	       fairness, min_t, max_t);
+	printf("Allocator time = %f seconds (summed over threads)\n", alloc_nsec / 1e9);
+	printf("Spin time = %f seconds in %lu stalled calls (> %d ns), slowest call %f ms\n",
+	       stall_nsec / 1e9, stalls, STALL_NSEC, max_nsec / 1e6);
+	printf("CPU changes observed = %lu, forced migrations = %lu\n", cpu_changes, forced);
+	bench_metric("fairness", fairness);
+	bench_metric("spin_time", stall_nsec / 1e9);
+	bench_metric("stalls", stalls);
+	bench_metric("cpu_changes", cpu_changes);
+	bench_report(&b);
+
+	free(args);
+	return 0;
+}
@@ -2,6 +2,19 @@
  * This is a modified version of the phong memory allocator benchmark
  * included with the Hoard distribution.
  *
+ * Options, after the thread count:
+ *   -aN      total number of malloc calls, split over the threads
+ *   -zN -ZN  smallest and largest size for the built-in distributions
+ *   -Dname   size distribution: phong (default, the original formula
+ *            favouring small sizes), uniform, or geometric (each
+ *            power-of-two size class half as likely as the one below)
+ *   -dFILE   size distribution from a histogram file, e.g. captured
+ *            from production. Each line is "size weight" or
+ *            "lo hi weight" (sizes lo..hi equally likely); '#' starts
+ *            a comment.
+ *   -r[N]    realloc N% (default 25) of the blocks that survive a
+ *            free pass; allocators without mm_realloc get
+ *            mm_malloc + copy + mm_free instead
  */
 #include	<errno.h>
 #include	<stdlib.h>
@@ -14,15 +27,42 @@
 #include "timer.h"
 #include "malloc.h"
 #include "memlib.h"
+#include "bench.h"
 
 
 #define	N_THREAD	256
 #define N_ALLOC		1000000
+#define MAX_BINS	4096
 static int		Nthread = N_THREAD;
 static int		Nalloc = N_ALLOC;
 static size_t		Minsize = 10;
 static size_t		Maxsize = 1024;
-static int              numCPU = 0;
+static int		Realloc_pct = 0;
+
+/* Resizing, if the allocator has it */
+extern void *mm_realloc (void *ptr, size_t size) __attribute__((weak));
+
+/*
+ * Size distribution other than the original one: bins of equally
+ * likely sizes lo..hi, picked with probability weight/total.
+ */
+static const char	*Dist_name = "phong";
+static struct bin {
+	size_t		lo, hi;
+	unsigned long long cum;	/* weights of this and all earlier bins */
+} Bins[MAX_BINS];
+static int		Nbins;
+
+/* Per-thread statistics, summed (peak: maximum) over the measured runs */
+struct workerArg {
+	unsigned long	nmalloc;
+	unsigned long	nrealloc;
+	double		requested;	/* bytes asked for by mm_malloc */
+	size_t		live;		/* bytes currently allocated */
+	size_t		live_peak;
+} __attribute__((aligned(64)));
+
+static struct workerArg	args[N_THREAD];
 
 int error(char* mesg)
 {
@@ -31,20 +71,103 @@ int error(char* mesg)
 	exit(1);
 }
 
-void* allocate(void* arg)
+static void add_bin(size_t lo, size_t hi, unsigned long long weight)
 {
-	int		k, p, q, c;
+	if (Nbins == MAX_BINS)
+		error("too many size bins\n");
+	if (lo == 0 || hi < lo)
+		error("invalid size bin\n");
+	Bins[Nbins].lo = lo;
+	Bins[Nbins].hi = hi;
+	Bins[Nbins].cum = weight + (Nbins ? Bins[Nbins-1].cum : 0);
+	Nbins++;
+}
+
+static void load_histogram(const char *path)
+{
+	char		line[256];
+	unsigned long long a, b, w;
+	FILE		*f;
+	int		n;
+
+	if (!(f = fopen(path, "r")) ) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+		n = sscanf(line, "%llu %llu %llu", &a, &b, &w);
+		if (n == 3)
+			add_bin(a, b, w);
+		else if (n == 2)
+			add_bin(a, a, b);
+		else if (n > 0)
+			error("bad line in histogram file\n");
+	}
+	fclose(f);
+	if (Nbins == 0 || Bins[Nbins-1].cum == 0)
+		error("empty histogram\n");
+	Dist_name = path;
+}
+
+/* Set up the -D distribution over Minsize..Maxsize */
+static void builtin_distribution(const char *name)
+{
+	size_t		lo;
+	unsigned long long weight = 1ULL << 40;
+
+	if (strcmp(name, "phong") == 0) {
+		return;
+	} else if (strcmp(name, "uniform") == 0) {
+		add_bin(Minsize, Maxsize, 1);
+	} else if (strcmp(name, "geometric") == 0) {
+		for (lo = Minsize; lo <= Maxsize && weight > 0; lo *= 2, weight /= 2)
+			add_bin(lo, (2*lo - 1 < Maxsize) ? 2*lo - 1 : Maxsize, weight);
+	} else {
+		error("unknown distribution, use phong, uniform or geometric\n");
+	}
+	Dist_name = name;
+}
+
+/* Grow or shrink a block, by hand if the allocator cannot */
+static char *resize(char *old, size_t oldsz, size_t sz)
+{
+	char		*p;
+
+	if (mm_realloc)
+		return mm_realloc(old, sz);
+	if (!(p = mm_malloc(sz)) )
+		return NULL;
+	memcpy(p, old, oldsz < sz ? oldsz : sz);
+	mm_free(old);
+	return p;
+}
+
+static void setup(struct bench *b, int run)
+{
+	if (run <= 0)
+		memset(args, 0, sizeof(args));
+}
+
+static void allocate(struct bench_thread *t)
+{
+	struct workerArg *w = &args[t->id];
+	int		k, p, q, c, lo, hi, mid;
 	size_t		sz, nalloc, len;
 	char		**list;
 	size_t		*size;
-	int		thread = (int)((long)arg);
+	unsigned long	nops = 0;
+	unsigned long long x;
+	unsigned int	hi32, lo32;
 
 	unsigned int	rand = 0; /* use a local RNG so that threads work uniformly */
 #define FNV_PRIME	((1<<24) + (1<<8) + 0x93)
 #define FNV_OFFSET	2166136261
 #define RANDOM()	(rand = rand*FNV_PRIME + FNV_OFFSET)
 
-	setCPU((thread+1)%numCPU);
+	w->live = 0;
 
 	nalloc = Nalloc/Nthread; /* do the same amount of work regardless of #threads */
 
@@ -57,20 +180,42 @@ void* allocate(void* arg)
 
 	for(k = 0; k < nalloc; ++k)
 	{
-		/* get a random size favoring smaller over larger */
-		len = Maxsize-Minsize+1;
-		for(;;)
-		{	sz = RANDOM() % len; /* pick a random size in [0,len-1] */
-			if((RANDOM()%100) >= (100*sz)/len) /* this favors a smaller size */
-				break;
-			len = sz; /* the gods want a smaller length, try again */
+		if(Nbins == 0)
+		{	/* get a random size favoring smaller over larger */
+			len = Maxsize-Minsize+1;
+			for(;;)
+			{	sz = RANDOM() % len; /* pick a random size in [0,len-1] */
+				if((RANDOM()%100) >= (100*sz)/len) /* this favors a smaller size */
+					break;
+				len = sz; /* the gods want a smaller length, try again */
+			}
+			sz += Minsize;
+		}
+		else
+		{	/* binary search for the bin, then a size within it */
+			hi32 = RANDOM(); /* two draws, in this order */
+			lo32 = RANDOM();
+			x = (((unsigned long long)hi32 << 32) | lo32) % Bins[Nbins-1].cum;
+			for(lo = 0, hi = Nbins-1; lo < hi; )
+			{	mid = (lo+hi)/2;
+				if(Bins[mid].cum > x)
+					hi = mid;
+				else
+					lo = mid+1;
+			}
+			sz = Bins[lo].lo + RANDOM() % (Bins[lo].hi - Bins[lo].lo + 1);
 		}
-		sz += Minsize;
 
 		if(!(list[k] = mm_malloc(sz)) )
 			error("malloc failed\n");
 		else
-		{	size[k] = sz;
+		{	nops++;
+			w->nmalloc++;
+			w->requested += sz;
+			w->live += sz;
+			if(w->live > w->live_peak)
+				w->live_peak = w->live;
+			size[k] = sz;
 			for(c = 0; c < 10; ++c)
 				list[k][c*sz/10] = 'm';
 		}
@@ -87,23 +232,32 @@ void* allocate(void* arg)
 
 		for(; p <= q; ++p)
 		{	if(list[p])
-			{	if(RANDOM()%2 == 0 ) /* 50% chance of being freed */
+			{	/* one draw per block: the low bit of RANDOM() alternates */
+				x = RANDOM();
+				if(x%2 == 0 ) /* 50% chance of being freed */
 				{	mm_free(list[p]);
+					nops++;
+					w->live -= size[p];
 					list[p] = 0;
 					size[p] = 0;
 				}
-#if 0 /* We are not implementing realloc for the assignment */
-				else if(RANDOM()%4 == 0 ) /* survived free, check realloc */
+				else if(Realloc_pct && (x/2)%100 < Realloc_pct) /* survived free, check realloc */
 				{	sz = size[p] > Maxsize ? size[p]/4 : 2*size[p];
-					if(!(list[p] = realloc(list[p], sz)) )
+					if(sz == 0)
+						sz = 1;
+					if(!(list[p] = resize(list[p], size[p], sz)) )
 						error("realloc failed\n");
 					else
-					{	size[p] = sz;
+					{	nops++;
+						w->nrealloc++;
+						w->live += sz - size[p];
+						if(w->live > w->live_peak)
+							w->live_peak = w->live;
+						size[p] = sz;
 						for(c = 0; c < 10; ++c)
 							list[p][c*sz/10] = 'r';
 					}
 				}
-#endif /* not implementing realloc */
 			}
 		}
 	}
@@ -113,23 +267,26 @@ void* allocate(void* arg)
 	{
 		if (list[k] != 0) {
 			mm_free(list[k]);
+			nops++;
+			w->live -= size[k];
 		}
 	}
 
 	mm_free(list);
 	mm_free(size);
 
-	return (void*)0;
+	t->ops = nops;
 }
 
 int main(int argc, char* argv[])
 {
-	int		i, rv;
-	void		*status;
-	pthread_t	th[N_THREAD];
-	pthread_attr_t attr;
-	struct timespec start_time, end_time;
-	double elapsed;
+	struct bench	b = { .name = "phong", .setup = setup, .worker = allocate };
+	const char	*dist = "phong", *histogram = NULL;
+	unsigned long	nmalloc = 0, nrealloc = 0;
+	double		requested = 0, live_peak = 0;
+	int		i;
+
+	bench_init(&argc, argv);
 
 	/* Modified argument parsing to match benchmark script. i
 	 * Thread count comes first. 
@@ -153,6 +310,12 @@ int main(int argc, char* argv[])
 			Minsize = atoi(argv[1]+2);
 		else if(argv[1][1] == 'Z') /* max block size */
 			Maxsize = atoi(argv[1]+2);
+		else if(argv[1][1] == 'D') /* built-in size distribution */
+			dist = argv[1]+2;
+		else if(argv[1][1] == 'd') /* size histogram file */
+			histogram = argv[1]+2;
+		else if(argv[1][1] == 'r') /* realloc percentage */
+			Realloc_pct = argv[1][2] ? atoi(argv[1]+2) : 25;
 	}
 		
 	if(Nalloc <= 0 || Nalloc > N_ALLOC)
@@ -163,38 +326,52 @@ int main(int argc, char* argv[])
 		Minsize = 1;
 	if(Maxsize < Minsize)
 		Maxsize = Minsize;
+	if(Realloc_pct < 0 || Realloc_pct > 100)
+		Realloc_pct = 25;
+
+	if(histogram) {
+		load_histogram(histogram);
+		/* realloc shrinks blocks grown past the largest size */
+		Maxsize = Bins[0].hi;
+		for(i = 1; i < Nbins; i++)
+			if(Bins[i].hi > Maxsize)
+				Maxsize = Bins[i].hi;
+	} else {
+		builtin_distribution(dist);
+	}
 
 	printf ("Running with %d allocations, %d threads, min size = %ld, max size = %ld\n",
 		Nalloc, Nthread, Minsize, Maxsize);
+	printf ("Size distribution %s", Dist_name);
+	if(Realloc_pct)
+		printf (", realloc %d%% of survivors (%s)", Realloc_pct,
+			mm_realloc ? "mm_realloc" : "malloc+copy+free");
+	printf ("\n");
 
 	/* Call allocator-specific initialization function */
 	mm_init();
 
-	numCPU = getNumProcessors();
-
-	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
-				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
-
-	/* Get the starting time */
-	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
-	
-	for(i = 0; i < Nthread; ++i)
-	{	if((rv = pthread_create(&th[i], &attr, allocate, (void*)((long)i))) != 0 )
-			error("Failed to create thread\n");
-	}
+	b.nthreads = Nthread;
+	if (bench_run(&b) != 0)
+		error("Failed to create thread\n");
 
-	for(i = 0; i < Nthread; ++i)
-	{	if((rv = pthread_join(th[i], &status)) != 0 )
-			error("Failed waiting for thread\n");
+	for(i = 0; i < Nthread; i++) {
+		nmalloc += args[i].nmalloc;
+		nrealloc += args[i].nrealloc;
+		requested += args[i].requested;
+		live_peak += args[i].live_peak;
 	}
+	/* The threads peak at about the same time, they do the same work */
+	printf ("Distribution %s: mean request %.1f bytes, %lu mallocs, %lu reallocs per run\n",
+		Dist_name, nmalloc ? requested / nmalloc : 0.0,
+		nmalloc / bench_runs(), nrealloc / bench_runs());
+	printf ("Live peak = %.0f bytes (sum of per-thread peaks), overhead %f\n",
+		live_peak, live_peak > 0 ? mem_usage() / live_peak : 0.0);
+	bench_metric("mean_size", nmalloc ? requested / nmalloc : 0.0);
+	bench_metric("reallocs", nrealloc / bench_runs());
+	bench_metric("live_peak", live_peak);
+	bench_metric("overhead", live_peak > 0 ? mem_usage() / live_peak : 0.0);
+	bench_report(&b);
 
-	/* Get the finish time */
-	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
-	elapsed = timespec_diff(&start_time, &end_time);
-
-	printf ("Time elapsed = %f seconds\n", elapsed);
-	printf ("Memory used = %ld bytes\n",mem_usage());
-
-	
 	return 0;
 }
@@ -13,7 +13,7 @@ my $dir=$ARGV[0];
 my $name;
 my $iters = 5;
 
-my @namelist = ("cache-scratch", "cache-thrash", "threadtest", "larson", "linux-scalability", "phong");
+my @namelist = ("cache-scratch", "cache-thrash", "threadtest", "larson", "linux-scalability", "phong", "large-alloc", "thread-churn", "oversub", "kvcache", "trees");
  
 foreach $name ( @namelist ) {
   print "benchmark name = $name\n";
@@ -0,0 +1,504 @@
+#!/usr/bin/perl
+
+# Structured benchmark driver.
+#
+# Runs one benchmark for every allocator and thread count, repeating
+# each configuration until the 95% confidence interval of its primary
+# metric is within --ci of the mean (or --max-runs is reached), and
+# writes every run plus a per-configuration summary as CSV or JSON.
+#
+# The primary metric is throughput when the benchmark reports one and
+# runtime otherwise. For every thread count, each allocator is compared
+# with the reference allocator using Welch's t-test, and with the same
+# allocator in a baseline results file from an earlier build if one is
+# given. Significant differences from the reference are reported as
+# slower or faster; significant slowdowns against the baseline are
+# flagged as regressions.
+#
+# The "Total counters:" line printed by the benchmarks (see perfctr.h)
+# is recorded with every run, and its mean is kept in the summary, so
+# a change in throughput can be related to cycles, misses or faults.
+
+use strict;
+use warnings;
+use Getopt::Long;
+use POSIX qw(floor);
+use List::Util qw(sum);
+use JSON::PP;
+
+sub usage {
+    print "usage: sweep.pl [options] <dir> <name>\n";
+    print "    where <dir> is the directory containing the test executables and config.pl,\n";
+    print "    and <name> is the base name of the test executable.\n";
+    print "options:\n";
+    print "    --alloc a,b,...     allocators to run (default libc,kheap,kheap-fine,a2alloc);\n";
+    print "                        names without a <name>-<alloc> executable run\n";
+    print "                        <name>-dl --alloc=<alloc>\n";
+    print "    --reference a       allocator the others are compared with (default: first)\n";
+    print "    --threads 1,2,...   thread counts to run (default 1..number of cores)\n";
+    print "    --max-threads n     run 1..n threads instead of 1..number of cores\n";
+    print "    --min-runs n        runs per configuration before checking convergence (default 3)\n";
+    print "    --max-runs n        give up converging after n runs (default 15)\n";
+    print "    --ci f              target CI half-width relative to the mean (default 0.02)\n";
+    print "    --alpha f           significance level for comparisons (default 0.05)\n";
+    print "    --format csv|json   output format (default csv)\n";
+    print "    --out prefix        output file prefix (default <dir>/Results/sweep-<name>)\n";
+    print "    --baseline file     runs file from an earlier sweep to compare against\n";
+    print "    --args \"...\"        benchmark arguments after the thread count (default from config.pl)\n";
+    die;
+}
+
+my $alloc_opt = "libc,kheap,kheap-fine,a2alloc";
+my ($reference, $threads_opt, $max_threads, $out, $baseline, $args_opt);
+my $min_runs = 3;
+my $max_runs = 15;
+my $ci_target = 0.02;
+my $alpha = 0.05;
+my $format = "csv";
+
+GetOptions("alloc=s" => \$alloc_opt,
+	   "reference=s" => \$reference,
+	   "threads=s" => \$threads_opt,
+	   "max-threads=i" => \$max_threads,
+	   "min-runs=i" => \$min_runs,
+	   "max-runs=i" => \$max_runs,
+	   "ci=f" => \$ci_target,
+	   "alpha=f" => \$alpha,
+	   "format=s" => \$format,
+	   "out=s" => \$out,
+	   "baseline=s" => \$baseline,
+	   "args=s" => \$args_opt) or usage();
+
+usage() if (@ARGV != 2);
+usage() if ($format ne "csv" && $format ne "json");
+$min_runs = 2 if ($min_runs < 2);
+$max_runs = $min_runs if ($max_runs < $min_runs);
+
+my $dir = $ARGV[0];
+my $benchname = $ARGV[1];
+
+#If dir is not an absolute path, and doesn't start with "." already, add the "./"
+if (!($dir =~ /^\// || $dir =~ /^\./)) {
+    $dir = "./" . $dir;
+}
+
+#Ensure existence of $dir/Results
+if (!-e "$dir/Results") {
+    mkdir "$dir/Results", 0755
+	or die "Cannot make $dir/Results: $!";
+}
+$out = "$dir/Results/sweep-$benchname" unless defined $out;
+
+#Initialize from config file
+my %config;
+
+unless (%config = do "$dir/config.pl") {
+            warn "couldn't parse $dir/config.pl: $@" if $@;
+            warn "couldn't do $dir/config.pl: $!"    unless %config;
+            warn "couldn't run $dir/config.pl"       unless %config;
+}
+my $bench_args = defined $args_opt ? $args_opt : $config{args};
+my $maxtime = $config{maxtime} || 60;
+
+my @alloclist = split /,/, $alloc_opt;
+$reference = $alloclist[0] unless defined $reference;
+
+my $ncores = `getconf _NPROCESSORS_ONLN`;
+chomp $ncores;
+$ncores = 1 unless $ncores;
+my @threadlist;
+if (defined $threads_opt) {
+    @threadlist = split /,/, $threads_opt;
+} else {
+    @threadlist = (1 .. (defined $max_threads ? $max_threads : $ncores));
+}
+
+print "=== dir = $dir, benchmark = $benchname\n";
+print "=== allocators = @alloclist, threads = @threadlist\n";
+
+########################################################################
+# Statistics
+########################################################################
+
+sub mean { return sum(@_) / @_; }
+
+sub stddev {
+    my @x = @_;
+    return 0 if (@x < 2);
+    my $m = mean(@x);
+    return sqrt(sum(map { ($_ - $m) ** 2 } @x) / (@x - 1));
+}
+
+# Continued fraction for the regularized incomplete beta function
+# (Numerical Recipes, betacf).
+sub betacf {
+    my ($a, $b, $x) = @_;
+    my ($qab, $qap, $qam) = ($a + $b, $a + 1, $a - 1);
+    my $c = 1;
+    my $d = 1 - $qab * $x / $qap;
+    $d = 1e-30 if (abs($d) < 1e-30);
+    $d = 1 / $d;
+    my $h = $d;
+    for (my $m = 1; $m <= 200; $m++) {
+	my $m2 = 2 * $m;
+	my $aa = $m * ($b - $m) * $x / (($qam + $m2) * ($a + $m2));
+	$d = 1 + $aa * $d;
+	$d = 1e-30 if (abs($d) < 1e-30);
+	$c = 1 + $aa / $c;
+	$c = 1e-30 if (abs($c) < 1e-30);
+	$d = 1 / $d;
+	$h *= $d * $c;
+	$aa = -($a + $m) * ($qab + $m) * $x / (($a + $m2) * ($qap + $m2));
+	$d = 1 + $aa * $d;
+	$d = 1e-30 if (abs($d) < 1e-30);
+	$c = 1 + $aa / $c;
+	$c = 1e-30 if (abs($c) < 1e-30);
+	$d = 1 / $d;
+	my $del = $d * $c;
+	$h *= $del;
+	last if (abs($del - 1) < 3e-12);
+    }
+    return $h;
+}
+
+sub lgamma {
+    my ($x) = @_;
+    my @cof = (76.18009172947146, -86.50532032941677, 24.01409824083091,
+	       -1.231739572450155, 0.1208650973866179e-2, -0.5395239384953e-5);
+    my $y = $x;
+    my $tmp = $x + 5.5;
+    $tmp -= ($x + 0.5) * log($tmp);
+    my $ser = 1.000000000190015;
+    foreach my $c (@cof) {
+	$y++;
+	$ser += $c / $y;
+    }
+    return -$tmp + log(2.5066282746310005 * $ser / $x);
+}
+
+sub betai {
+    my ($a, $b, $x) = @_;
+    return 0 if ($x <= 0);
+    return 1 if ($x >= 1);
+    my $bt = exp(lgamma($a + $b) - lgamma($a) - lgamma($b)
+		 + $a * log($x) + $b * log(1 - $x));
+    if ($x < ($a + 1) / ($a + $b + 2)) {
+	return $bt * betacf($a, $b, $x) / $a;
+    }
+    return 1 - $bt * betacf($b, $a, 1 - $x) / $b;
+}
+
+# Two-sided p-value of Student's t with df degrees of freedom.
+sub t_pvalue {
+    my ($t, $df) = @_;
+    return betai($df / 2, 0.5, $df / ($df + $t * $t));
+}
+
+# Two-sided critical value for confidence 1-alpha, by bisection.
+sub t_critical {
+    my ($df, $a) = @_;
+    my ($lo, $hi) = (0, 1000);
+    for (1 .. 100) {
+	my $mid = ($lo + $hi) / 2;
+	if (t_pvalue($mid, $df) > $a) {
+	    $lo = $mid;
+	} else {
+	    $hi = $mid;
+	}
+    }
+    return ($lo + $hi) / 2;
+}
+
+# Relative half-width of the 95% confidence interval of the mean.
+sub rel_ci {
+    my @x = @_;
+    my $m = mean(@x);
+    return 1e30 if (@x < 2 || $m == 0);
+    return t_critical(@x - 1, 0.05) * stddev(@x) / sqrt(@x) / abs($m);
+}
+
+# Welch's t-test. Returns (t, df, p).
+sub welch {
+    my ($xa, $xb) = @_;
+    my ($na, $nb) = (scalar @$xa, scalar @$xb);
+    return (0, 1, 1) if ($na < 2 || $nb < 2);
+    my ($va, $vb) = (stddev(@$xa) ** 2 / $na, stddev(@$xb) ** 2 / $nb);
+    my $diff = mean(@$xa) - mean(@$xb);
+    if ($va + $vb == 0) {
+	return ($diff == 0 ? (0, 1, 1) : ($diff > 0 ? 1e30 : -1e30, 1, 0));
+    }
+    my $t = $diff / sqrt($va + $vb);
+    my $df = ($va + $vb) ** 2 /
+	(($na > 1 ? $va ** 2 / ($na - 1) : 0) + ($nb > 1 ? $vb ** 2 / ($nb - 1) : 0));
+    return ($t, $df, t_pvalue(abs($t), $df));
+}
+
+########################################################################
+# Running
+########################################################################
+
+# Run the benchmark once and parse its output. Returns a hash of
+# metrics; status is "ok", "killed" or "failed".
+sub run_once {
+    my ($allocator, $nthreads) = @_;
+    my @cmd = ("$dir/$benchname-$allocator", $nthreads, split(' ', $bench_args));
+    if (! -x $cmd[0]) {
+	# Allocator variant, loaded by the -dl build
+	$cmd[0] = "$dir/$benchname-dl";
+	push @cmd, "--alloc=$allocator";
+    }
+    my %r = (status => "ok");
+    my $output = "";
+    my $pid = open(my $fh, "-|");
+    if (!defined $pid) {
+	$r{status} = "failed";
+	return \%r;
+    }
+    if ($pid == 0) {
+	#child
+	open(STDERR, ">&STDOUT");
+	exec(@cmd) or die "Cannot run @cmd: $!";
+    }
+    eval {
+	local $SIG{ALRM} = sub { die "timeout\n"; };
+	alarm $maxtime;
+	while (<$fh>) {
+	    $output .= $_;
+	}
+	alarm 0;
+    };
+    if ($@ eq "timeout\n") {
+	kill("KILL", $pid);
+	$r{status} = "killed";
+    }
+    close $fh;
+    $r{status} = "failed" if ($r{status} eq "ok" && $? != 0);
+
+    # Runtime results
+    if ($output =~ /Time elapsed = ([0-9.]+) seconds/) {
+	$r{runtime} = $1;
+    } elsif ($output =~ /Average execution time = ([0-9.]+) seconds/) {
+	$r{runtime} = $1;
+    }
+    # Throughput results
+    if ($output =~ /Throughput =\s+([0-9.]+)\s+/) {
+	$r{throughput} = $1;
+    }
+    if ($output =~ /Memory used = ([0-9]+) bytes/) {
+	$r{mem_usage} = $1;
+    }
+    if ($output =~ /Max RSS = ([0-9]+) bytes/) {
+	$r{rss} = $1;
+    }
+    # Event counters; unavailable events are printed as "-"
+    if ($output =~ /^Total counters:(.*)$/m) {
+	foreach my $kv (split ' ', $1) {
+	    my ($k, $v) = split /=/, $kv, 2;
+	    next unless defined $v;
+	    $k =~ s/-/_/g;
+	    if ($k eq "source") {
+		$r{counter_source} = $v;
+	    } elsif ($v ne "-") {
+		$r{$k} = $v;
+	    }
+	}
+    }
+    return \%r;
+}
+
+my @counters = ("cycles", "instructions", "l1d_misses", "llc_misses",
+		"dtlb_misses", "context_switches", "page_faults");
+my @fields = ("benchmark", "allocator", "threads", "run", "status",
+	      "runtime", "throughput", "mem_usage", "rss", @counters,
+	      "counter_source");
+
+my @runs;	# every individual run
+my %samples;	# "$allocator/$threads" -> [primary metric values]
+my %summary;	# "$allocator/$threads" -> summary hash
+my $metric;	# "throughput" or "runtime", fixed by the first good run
+
+foreach my $allocator (@alloclist) {
+    foreach my $nthreads (@threadlist) {
+	my $key = "$allocator/$nthreads";
+	my @values;
+	my %counts;	# counter -> values from the good runs
+	my $n = 0;
+	my $failed = 0;
+	print "$benchname-$allocator, $nthreads threads: ";
+	while ($n < $max_runs) {
+	    my $r = run_once($allocator, $nthreads);
+	    $n++;
+	    $r->{benchmark} = $benchname;
+	    $r->{allocator} = $allocator;
+	    $r->{threads} = $nthreads;
+	    $r->{run} = $n;
+	    push @runs, $r;
+
+	    if ($r->{status} ne "ok") {
+		print "x";
+		$failed++;
+		last if ($failed >= 2);
+		next;
+	    }
+	    if (!defined $metric) {
+		$metric = defined $r->{throughput} ? "throughput" : "runtime";
+	    }
+	    if (defined $r->{$metric}) {
+		push @values, $r->{$metric};
+	    }
+	    foreach my $c (@counters) {
+		push @{$counts{$c}}, $r->{$c} if (defined $r->{$c});
+	    }
+	    print ".";
+	    last if (@values >= $min_runs && rel_ci(@values) <= $ci_target);
+	}
+
+	my %s = (benchmark => $benchname, allocator => $allocator,
+		 threads => $nthreads, metric => $metric || "none",
+		 n => scalar @values, failed => $failed);
+	if (@values) {
+	    $s{mean} = mean(@values);
+	    $s{stddev} = stddev(@values);
+	    $s{rel_ci} = @values >= 2 ? rel_ci(@values) : undef;
+	    $s{converged} = (@values >= 2 && $s{rel_ci} <= $ci_target) ? 1 : 0;
+	    # Noisy: never converged, or a run more than 3 MADs from the median.
+	    my @sorted = sort { $a <=> $b } @values;
+	    my $median = $sorted[floor(@sorted / 2)];
+	    my @dev = sort { $a <=> $b } map { abs($_ - $median) } @values;
+	    my $mad = $dev[floor(@dev / 2)];
+	    my $outliers = grep { $mad > 0 && abs($_ - $median) > 3 * $mad } @values;
+	    $s{outliers} = $outliers;
+	    $s{noisy} = (!$s{converged} || $outliers > 0) ? 1 : 0;
+	}
+	foreach my $c (@counters) {
+	    $s{$c} = mean(@{$counts{$c}}) if ($counts{$c});
+	}
+	$samples{$key} = \@values;
+	$summary{$key} = \%s;
+	printf " n=%d mean=%s ci=%s%s\n", scalar @values,
+	    defined $s{mean} ? sprintf("%.6g", $s{mean}) : "-",
+	    defined $s{rel_ci} ? sprintf("%.2f%%", 100 * $s{rel_ci}) : "-",
+	    $s{noisy} ? " NOISY" : "";
+    }
+}
+
+########################################################################
+# Comparisons
+########################################################################
+
+# A difference is worse when it goes in the wrong direction for the
+# metric. Only a significant worse difference from the baseline is a
+# regression; an allocator that is slower than the reference is not.
+sub compare {
+    my ($kind, $what, $against, $nthreads, $xa, $xb) = @_;
+    my ($t, $df, $p) = welch($xa, $xb);
+    my $ratio = (@$xb && mean(@$xb) != 0) ? mean(@$xa) / mean(@$xb) : undef;
+    my $worse = defined $metric && (($metric eq "throughput") ? $t < 0 : $t > 0);
+    my %c = (kind => $kind, benchmark => $benchname, allocator => $what,
+	     against => $against, threads => $nthreads, metric => $metric,
+	     ratio => $ratio, t => $t, df => $df, p => $p,
+	     significant => ($p < $alpha ? 1 : 0), worse => ($worse ? 1 : 0),
+	     regression => ($kind eq "baseline" && $p < $alpha && $worse ? 1 : 0));
+    return \%c;
+}
+
+my @comparisons;
+foreach my $nthreads (@threadlist) {
+    my $ref = $samples{"$reference/$nthreads"};
+    next unless $ref;
+    foreach my $allocator (@alloclist) {
+	next if ($allocator eq $reference);
+	push @comparisons, compare("allocator", $allocator, $reference, $nthreads,
+				   $samples{"$allocator/$nthreads"}, $ref);
+    }
+}
+
+# Compare with the runs of an earlier sweep (e.g. a previous build).
+sub load_runs {
+    my ($file) = @_;
+    my @rows;
+    open(my $fh, "<", $file) or die "Cannot open $file: $!";
+    if ($file =~ /\.json$/) {
+	local $/;
+	my $doc = decode_json(<$fh>);
+	@rows = @{$doc->{runs}};
+    } else {
+	my $hdr = <$fh>;
+	chomp $hdr;
+	my @cols = split /,/, $hdr;
+	while (<$fh>) {
+	    chomp;
+	    my %row;
+	    @row{@cols} = split /,/, $_, -1;
+	    push @rows, \%row;
+	}
+    }
+    close $fh;
+    return @rows;
+}
+
+if (defined $baseline) {
+    my %base;
+    foreach my $row (load_runs($baseline)) {
+	next unless ($row->{status} eq "ok" && $row->{benchmark} eq $benchname);
+	next unless (defined $metric && defined $row->{$metric} && $row->{$metric} ne "");
+	push @{$base{"$row->{allocator}/$row->{threads}"}}, $row->{$metric};
+    }
+    foreach my $key (sort keys %samples) {
+	next unless $base{$key};
+	my ($allocator, $nthreads) = split /\//, $key;
+	push @comparisons, compare("baseline", $allocator, "baseline", $nthreads,
+				   $samples{$key}, $base{$key});
+    }
+}
+
+foreach my $c (@comparisons) {
+    next unless ($c->{significant} && defined $c->{ratio});
+    printf "%s: %s vs %s, %d threads: %s%.1f%% %s (p=%.4f)\n",
+	$c->{kind} eq "baseline" ? ($c->{worse} ? "REGRESSION" : "improvement")
+				 : ($c->{worse} ? "slower" : "faster"),
+	$c->{allocator}, $c->{against}, $c->{threads},
+	$c->{ratio} >= 1 ? "+" : "", 100 * ($c->{ratio} - 1), $metric, $c->{p};
+}
+
+########################################################################
+# Output
+########################################################################
+
+sub write_csv {
+    my ($file, $cols, $rows) = @_;
+    open(my $fh, ">", $file) or die "Cannot write $file: $!";
+    print $fh join(",", @$cols), "\n";
+    foreach my $r (@$rows) {
+	print $fh join(",", map { defined $r->{$_} ? $r->{$_} : "" } @$cols), "\n";
+    }
+    close $fh;
+    print "wrote $file\n";
+}
+
+my @summary_rows = map { $summary{$_} } sort keys %summary;
+
+if ($format eq "json") {
+    my $file = "$out.json";
+    open(my $fh, ">", $file) or die "Cannot write $file: $!";
+    print $fh JSON::PP->new->canonical->pretty->encode({
+	benchmark => $benchname, args => $bench_args, cores => $ncores,
+	ci_target => $ci_target, alpha => $alpha,
+	runs => \@runs, summary => \@summary_rows,
+	comparisons => \@comparisons });
+    close $fh;
+    print "wrote $file\n";
+} else {
+    write_csv("$out.csv", \@fields, \@runs);
+    write_csv("$out-summary.csv",
+	      ["benchmark", "allocator", "threads", "metric", "n", "failed", "mean",
+	       "stddev", "rel_ci", "converged", "outliers", "noisy", @counters], \@summary_rows);
+    write_csv("$out-compare.csv",
+	      ["kind", "benchmark", "allocator", "against", "threads", "metric",
+	       "ratio", "t", "df", "p", "significant", "regression"], \@comparisons)
+	if (@comparisons);
+}
+
+# Exit status 2 signals a regression against the baseline to scripts
+# that call us.
+exit((grep { $_->{regression} } @comparisons) ? 2 : 0);
@@ -0,0 +1,4 @@
+# per-benchmark configuration values
+maxtime => '60', # kheap needs <5s with 8 threads
+args => '200 4000 512 20 1', #generations, allocs per thread, max_size, leftover percent, seed
+graphtitle => "thread-churn - runtimes"
@@ -0,0 +1,286 @@
+/*
+ * thread-churn
+ *
+ * Models a thread pool that keeps creating and retiring threads.
+ *
+ * The benchmark runs a number of generations. In every generation
+ * nthreads short-lived threads are created. Each thread
+ *   1. frees the objects that thread (i-1) of the previous generation
+ *      left behind, so the free happens on a different thread (and
+ *      usually a different CPU) than the allocation,
+ *   2. allocates allocs objects of random size in [8, max_size],
+ *   3. frees all but leftover percent of them, and hands the rest to
+ *      the next generation before exiting.
+ * Threads are pinned round-robin with an offset that changes every
+ * generation, so objects are allocated from a different per-CPU heap
+ * each time.
+ *
+ * Each benchmark driver thread (bench.h) owns one slot and creates
+ * and joins that slot's thread in every generation; the driver
+ * threads wait for each other between generations. Thread creation
+ * is part of the timed region, since it is part of the cost of
+ * churn.
+ *
+ * After the last generation the main thread frees everything that is
+ * still live. It reports the segment size at that point (memory held
+ * with no live objects, i.e. stranded in the allocator's heaps). It
+ * then allocates one generation's worth of objects from a single CPU
+ * and reports how much the segment had to grow, which shows how much
+ * of the stranded memory is reusable from another heap.
+ *
+ * Usage: thread-churn nthreads generations allocs max_size leftover_pct [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "memlib.h"
+#include "perfctr.h"
+#include "bench.h"
+#include "xorshift.h"
+
+#define MIN_SIZE 8
+#define MAX_THREADS 64
+
+/*
+ * Objects handed from one generation to the next. There are two sets
+ * of slots: generation g writes handoff[g%2] and frees the leftovers
+ * in handoff[(g+1)%2], so readers and writers never share a slot.
+ */
+struct handoff {
+	char **objs;
+	size_t *sizes;
+	int count;
+} __attribute__((aligned(64)));
+
+struct workerArg {
+	int gen;
+	int slot;
+	int cpu;
+	uint64_t seed;
+	unsigned long ops;	/* mallocs + frees done by this thread */
+	long live_delta;	/* bytes allocated minus bytes freed */
+} __attribute__((aligned(64)));
+
+static int nthreads;
+static int generations;
+static int allocs;
+static size_t max_size;
+static int leftover_pct;
+static uint64_t seed = 1;
+
+static struct handoff handoff[2][MAX_THREADS];
+static struct workerArg *args;
+static pthread_barrier_t generation_barrier;
+
+/* Live bytes and segment size after each generation */
+static long live, peak_live;
+static ptrdiff_t seg_peak;
+
+static void *churn(void *arg)
+{
+	struct workerArg *w = (struct workerArg *)arg;
+	struct handoff *prev = &handoff[(w->gen + 1) % 2][(w->slot + nthreads - 1) % nthreads];
+	struct handoff *mine = &handoff[w->gen % 2][w->slot];
+	char **objs = mine->objs;
+	size_t *sizes = mine->sizes;
+	int keep = (allocs * leftover_pct) / 100;
+	int i, j;
+
+	if (w->cpu >= 0) {
+		setCPU(w->cpu);
+	}
+	if (bench_measuring()) {
+		perfctr_begin();
+	}
+
+	/* Free what the previous generation left behind. */
+	for (i = 0; i < prev->count; i++) {
+		mm_free(prev->objs[i]);
+		w->live_delta -= prev->sizes[i];
+		w->ops++;
+	}
+	prev->count = 0;
+
+	for (i = 0; i < allocs; i++) {
+		sizes[i] = MIN_SIZE + next_rand(&w->seed) % (max_size - MIN_SIZE + 1);
+		objs[i] = (char *)mm_malloc(sizes[i]);
+		if (objs[i] == NULL) {
+			fprintf(stderr, "thread-churn: mm_malloc failed\n");
+			exit(1);
+		}
+		objs[i][0] = (char)i;
+		w->live_delta += sizes[i];
+		w->ops++;
+	}
+
+	/* Free a random selection, keeping the first 'keep' slots. */
+	for (i = allocs - 1; i >= keep; i--) {
+		j = next_rand(&w->seed) % (i + 1);
+		mm_free(objs[j]);
+		w->live_delta -= sizes[j];
+		objs[j] = objs[i];
+		sizes[j] = sizes[i];
+		w->ops++;
+	}
+	mine->count = keep;
+
+	perfctr_end(w->slot);
+	return NULL;
+}
+
+/* Run one slot through all generations */
+static void worker(struct bench_thread *t)
+{
+	struct workerArg *w = &args[t->id];
+	pthread_attr_t attr;
+	pthread_t tid;
+	int g, i;
+
+	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
+				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
+
+	for (g = 0; g < generations; g++) {
+		w->gen = g;
+		w->slot = t->id;
+		w->cpu = (t->cpu < 0) ? -1 : getPlacementCPU(t->id + g);
+		w->seed = seed * 0x9e3779b97f4a7c15ULL + (uint64_t)g * MAX_THREADS + t->id + 1;
+		w->ops = 0;
+		w->live_delta = 0;
+		if (pthread_create(&tid, &attr, &churn, w) != 0) {
+			perror("thread-churn: pthread_create failed");
+			exit(1);
+		}
+		pthread_join(tid, NULL);
+		t->ops += w->ops;
+
+		/* The next generation frees what this one left behind. */
+		if (pthread_barrier_wait(&generation_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+			for (i = 0; i < nthreads; i++) {
+				live += args[i].live_delta;
+			}
+			if (live > peak_live) {
+				peak_live = live;
+			}
+			if (mem_usage() > seg_peak) {
+				seg_peak = mem_usage();
+			}
+		}
+		pthread_barrier_wait(&generation_barrier);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/* Retire the last generation's leftovers from the main thread. */
+static void teardown(struct bench *b, int run)
+{
+	int g, i, k;
+
+	for (g = 0; g < 2; g++) {
+		for (i = 0; i < nthreads; i++) {
+			for (k = 0; k < handoff[g][i].count; k++) {
+				mm_free(handoff[g][i].objs[k]);
+				live -= handoff[g][i].sizes[k];
+			}
+			handoff[g][i].count = 0;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b = { .name = "thread-churn", .worker = worker, .teardown = teardown,
+			   .self_counted = 1 };
+	ptrdiff_t seg_start, seg_stranded, seg_probe;
+	int g, i, k;
+
+	bench_init(&argc, argv);
+
+	if (argc < 6) {
+		bench_usage("nthreads generations allocs max_size leftover_pct [seed]");
+		return 1;
+	}
+
+	nthreads = atoi(argv[1]);
+	generations = atoi(argv[2]);
+	allocs = atoi(argv[3]);
+	max_size = strtoul(argv[4], NULL, 0);
+	leftover_pct = atoi(argv[5]);
+	if (argc > 6) {
+		seed = strtoull(argv[6], NULL, 0);
+	}
+
+	if (nthreads < 1 || nthreads > MAX_THREADS || generations < 1 || allocs < 1 ||
+	    max_size < MIN_SIZE || leftover_pct < 0 || leftover_pct > 100) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	printf("Running thread-churn for %d threads, %d generations, %d allocs, max size %lu, %d%% left over\n",
+	       nthreads, generations, allocs, (unsigned long)max_size, leftover_pct);
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	/* Bookkeeping lives outside the allocator under test. */
+	args = (struct workerArg *)aligned_alloc(64, nthreads * sizeof(struct workerArg));
+	for (g = 0; g < 2; g++) {
+		for (i = 0; i < nthreads; i++) {
+			handoff[g][i].objs = (char **)malloc(allocs * sizeof(char *));
+			handoff[g][i].sizes = (size_t *)malloc(allocs * sizeof(size_t));
+			handoff[g][i].count = 0;
+		}
+	}
+	pthread_barrier_init(&generation_barrier, NULL, nthreads);
+
+	seg_start = mem_usage();
+
+	b.nthreads = nthreads;
+	if (bench_run(&b) != 0) {
+		return 1;
+	}
+	seg_stranded = mem_usage();
+
+	/*
+	 * Probe: allocate one generation's worth of objects on one CPU
+	 * and see how much of the stranded memory it can reuse.
+	 */
+	setCPU(0);
+	for (i = 0; i < nthreads; i++) {
+		for (k = 0; k < allocs; k++) {
+			size_t sz = MIN_SIZE + next_rand(&seed) % (max_size - MIN_SIZE + 1);
+			handoff[0][i].objs[k] = (char *)mm_malloc(sz);
+		}
+	}
+	seg_probe = mem_usage();
+	for (i = 0; i < nthreads; i++) {
+		for (k = 0; k < allocs; k++) {
+			mm_free(handoff[0][i].objs[k]);
+		}
+	}
+
+	printf("Threads created per run = %d\n", nthreads * generations);
+	printf("Peak live between generations = %ld bytes, peak segment = %ld bytes\n",
+	       peak_live, (long)seg_peak);
+	printf("Stranded after %d generations = %ld bytes (segment growth with no live objects)\n",
+	       generations, (long)(seg_stranded - seg_start));
+	printf("Probe growth from one CPU = %ld bytes\n", (long)(seg_probe - seg_stranded));
+	bench_metric("stranded", seg_stranded - seg_start);
+	bench_metric("probe_growth", seg_probe - seg_stranded);
+	bench_report(&b);
+
+	pthread_barrier_destroy(&generation_barrier);
+	for (g = 0; g < 2; g++) {
+		for (i = 0; i < nthreads; i++) {
+			free(handoff[g][i].objs);
+			free(handoff[g][i].sizes);
+		}
+	}
+	free(args);
+	return 0;
+}
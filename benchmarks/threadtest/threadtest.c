@@ -39,6 +39,7 @@
 #include "timer.h"
 #include "malloc.h"
 #include "memlib.h"
+#include "bench.h"
 
 int niterations = 50;	// Default number of iterations.
 int nobjects = 30000;   // Default number of objects.
@@ -52,16 +53,11 @@ struct Foo {
 };
 
 
-extern void * worker (void *arg)
+static void worker (struct bench_thread *t)
 {
   int i, j;
   volatile int d;
   struct Foo ** a;
-#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
-  int cpu = (int)arg; // cpu number will fit in an int, ignore warning
-#pragma GCC diagnostic pop
-
-  setCPU(cpu);
 
   a = (struct Foo **)mm_malloc( (nobjects / nthreads) * sizeof(struct Foo *));
 
@@ -95,16 +91,16 @@ extern void * worker (void *arg)
 
   mm_free(a);
 
-  return NULL;
+  t->ops = 2UL * niterations * (nobjects / nthreads);
 }
 
 
 int main (int argc, char * argv[])
 {
-	struct timespec start_time;
-	struct timespec end_time;
-	int i;
-	
+	struct bench b = { .name = "threadtest", .worker = worker };
+
+	bench_init(&argc, argv);
+
 	if (argc >= 2) {
 		nthreads = atoi(argv[1]);
 	}
@@ -128,36 +124,14 @@ int main (int argc, char * argv[])
 
 	/* Call allocator-specific initialization function */
 	mm_init();
-	
-	pthread_t *threads = (pthread_t *)mm_malloc(nthreads*sizeof(pthread_t));
-	int numCPU = getNumProcessors();
-
-	pthread_attr_t attr;
-	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10, 
-				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
 
 	printf ("Running threadtest for %d threads, %d iterations, %d objects, %d work and %d size...\n", nthreads, niterations, nobjects, work, size);
 
-	/* Get the starting time */
-	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
-
-	for (i = 0; i < nthreads; i++) {
-		pthread_create(&threads[i], &attr, &worker, (void *)((u_int64_t)(i+1)%numCPU));
+	b.nthreads = nthreads;
+	if (bench_run(&b) != 0) {
+		return 1;
 	}
-
-	for (i = 0; i < nthreads; i++) {
-		pthread_join(threads[i], NULL);
-	}
-
-	/* Get the finish time */
-	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
-
-	double t = timespec_diff(&start_time, &end_time);
-
-	printf ("Time elapsed = %f seconds\n", t);
-	printf ("Memory used = %ld bytes\n",mem_usage());
-	
-	mm_free(threads);
+	bench_report(&b);
 
 	return 0;
 }
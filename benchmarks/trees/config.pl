@@ -0,0 +1,4 @@
+# per-benchmark configuration values
+maxtime => '60', # kheap needs <15s with 8 threads
+args => '16 2 20000 1', #max_depth, iterations, graph_nodes, seed
+graphtitle => "trees - runtimes"
@@ -0,0 +1,290 @@
+/*
+ * trees
+ *
+ * Tree build/teardown workload, modelled on the binary-trees GC
+ * benchmark.
+ *
+ * Before the threads start, the main thread builds a long-lived
+ * binary tree of depth max_depth that stays alive for the whole run.
+ * Each thread then, for every depth d = MIN_DEPTH, MIN_DEPTH+2, ...,
+ * max_depth, builds its share of the 2^(max_depth - d + MIN_DEPTH)
+ * trees of depth d, walks each one, and frees it in post-order. After
+ * each depth it walks the long-lived tree, and it also builds a random
+ * graph of graph_nodes nodes (each pointing to DEGREE other nodes),
+ * traverses it breadth first and frees the nodes in random order.
+ *
+ * The nodes are small (16 and 48 bytes), so the time spent walking
+ * the structures depends on where the allocator placed them: this is
+ * where superblock layout and freelist order show up in application
+ * time, not just allocator time. The build, walk and free phases are
+ * timed separately and reported as per-thread sums.
+ *
+ * Usage: trees nthreads max_depth iterations graph_nodes [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "memlib.h"
+#include "bench.h"
+#include "xorshift.h"
+
+#define MIN_DEPTH 4
+#define DEGREE 4
+#define MAX_THREADS 64
+
+struct tree {
+	struct tree *left;
+	struct tree *right;
+};
+
+struct gnode {
+	struct gnode *edges[DEGREE];
+	long id;
+	long mark;
+};
+
+struct workerArg {
+	uint64_t seed;
+	unsigned long nodes;	/* nodes allocated */
+	long check;		/* checksum of all walks */
+	double build;		/* seconds spent in each phase */
+	double walk;
+	double teardown;
+} __attribute__((aligned(64)));
+
+static int nthreads;
+static int max_depth;
+static int iterations;
+static int graph_nodes;
+static struct tree *long_lived;
+static uint64_t seed = 1;
+static struct workerArg *args;
+
+static double elapsed_since(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	double t = timespec_diff(start, &now);
+	*start = now;
+	return t;
+}
+
+static struct tree *build_tree(int depth, unsigned long *nodes)
+{
+	struct tree *t = (struct tree *)mm_malloc(sizeof(struct tree));
+
+	if (t == NULL) {
+		fprintf(stderr, "trees: mm_malloc failed\n");
+		exit(1);
+	}
+	(*nodes)++;
+	if (depth > 0) {
+		t->left = build_tree(depth - 1, nodes);
+		t->right = build_tree(depth - 1, nodes);
+	} else {
+		t->left = t->right = NULL;
+	}
+	return t;
+}
+
+static long walk_tree(struct tree *t)
+{
+	if (t->left == NULL) {
+		return 1;
+	}
+	return 1 + walk_tree(t->left) + walk_tree(t->right);
+}
+
+static void free_tree(struct tree *t)
+{
+	if (t->left != NULL) {
+		free_tree(t->left);
+		free_tree(t->right);
+	}
+	mm_free(t);
+}
+
+/*
+ * Build a graph where node i points to DEGREE random nodes, walk it
+ * breadth first from node 0 and free the nodes in random order.
+ */
+static void graph_round(struct workerArg *w, struct timespec *clock)
+{
+	struct gnode **nodes, **queue;
+	long head = 0, tail = 0;
+	int i, j;
+
+	nodes = (struct gnode **)mm_malloc(graph_nodes * sizeof(struct gnode *));
+	queue = (struct gnode **)mm_malloc(graph_nodes * sizeof(struct gnode *));
+	if (nodes == NULL || queue == NULL) {
+		fprintf(stderr, "trees: mm_malloc failed\n");
+		exit(1);
+	}
+
+	for (i = 0; i < graph_nodes; i++) {
+		nodes[i] = (struct gnode *)mm_malloc(sizeof(struct gnode));
+		if (nodes[i] == NULL) {
+			fprintf(stderr, "trees: mm_malloc failed\n");
+			exit(1);
+		}
+		nodes[i]->id = i;
+		nodes[i]->mark = 0;
+	}
+	for (i = 0; i < graph_nodes; i++) {
+		for (j = 0; j < DEGREE; j++) {
+			nodes[i]->edges[j] = nodes[next_rand(&w->seed) % graph_nodes];
+		}
+	}
+	w->nodes += graph_nodes;
+	w->build += elapsed_since(clock);
+
+	queue[tail++] = nodes[0];
+	nodes[0]->mark = 1;
+	while (head < tail) {
+		struct gnode *n = queue[head++];
+		w->check += n->id;
+		for (j = 0; j < DEGREE; j++) {
+			if (!n->edges[j]->mark) {
+				n->edges[j]->mark = 1;
+				queue[tail++] = n->edges[j];
+			}
+		}
+	}
+	w->walk += elapsed_since(clock);
+
+	/* Shuffle, then free: teardown order unrelated to allocation order. */
+	for (i = graph_nodes - 1; i > 0; i--) {
+		j = next_rand(&w->seed) % (i + 1);
+		struct gnode *tmp = nodes[i];
+		nodes[i] = nodes[j];
+		nodes[j] = tmp;
+	}
+	for (i = 0; i < graph_nodes; i++) {
+		mm_free(nodes[i]);
+	}
+	mm_free(nodes);
+	mm_free(queue);
+	w->teardown += elapsed_since(clock);
+}
+
+static void worker(struct bench_thread *bt)
+{
+	struct workerArg *w = &args[bt->id];
+	unsigned long nodes = w->nodes;
+	struct timespec clock;
+	struct tree *t;
+	int it, d, i, total, count;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &clock);
+	for (it = 0; it < iterations; it++) {
+		for (d = MIN_DEPTH; d <= max_depth; d += 2) {
+			/* The first total % nthreads threads build one more */
+			total = 1 << (max_depth - d + MIN_DEPTH);
+			count = total / nthreads + (bt->id < total % nthreads);
+			for (i = 0; i < count; i++) {
+				t = build_tree(d, &w->nodes);
+				w->build += elapsed_since(&clock);
+				w->check += walk_tree(t);
+				w->walk += elapsed_since(&clock);
+				free_tree(t);
+				w->teardown += elapsed_since(&clock);
+			}
+			w->check += walk_tree(long_lived);
+			w->walk += elapsed_since(&clock);
+		}
+		if (graph_nodes > 0) {
+			graph_round(w, &clock);
+		}
+	}
+	bt->ops = w->nodes - nodes;
+}
+
+/* Results cover all measured runs, so start over before the first one. */
+static void setup(struct bench *b, int run)
+{
+	int i;
+
+	if (run <= 0) {
+		memset(args, 0, nthreads * sizeof(struct workerArg));
+		for (i = 0; i < nthreads; i++) {
+			args[i].seed = seed * 0x9e3779b97f4a7c15ULL + i + 1;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b = { .name = "trees", .units = "nodes", .setup = setup, .worker = worker };
+	unsigned long nodes = 0, long_lived_nodes = 0;
+	double build = 0, walk = 0, teardown = 0;
+	long check = 0;
+	int i;
+
+	bench_init(&argc, argv);
+
+	if (argc < 5) {
+		bench_usage("nthreads max_depth iterations graph_nodes [seed]");
+		return 1;
+	}
+
+	nthreads = atoi(argv[1]);
+	max_depth = atoi(argv[2]);
+	iterations = atoi(argv[3]);
+	graph_nodes = atoi(argv[4]);
+	if (argc > 5) {
+		seed = strtoull(argv[5], NULL, 0);
+	}
+
+	if (nthreads < 1 || nthreads > MAX_THREADS || max_depth < MIN_DEPTH ||
+	    max_depth > 24 || iterations < 1 || graph_nodes < 0) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	printf("Running trees for %d threads, max depth %d, %d iterations, %d graph nodes\n",
+	       nthreads, max_depth, iterations, graph_nodes);
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	long_lived = build_tree(max_depth, &long_lived_nodes);
+
+	args = (struct workerArg *)aligned_alloc(64, nthreads * sizeof(struct workerArg));
+
+	b.nthreads = nthreads;
+	if (bench_run(&b) != 0) {
+		return 1;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		nodes += args[i].nodes;
+		check += args[i].check;
+		build += args[i].build;
+		walk += args[i].walk;
+		teardown += args[i].teardown;
+	}
+
+	if (walk_tree(long_lived) != (long)long_lived_nodes) {
+		fprintf(stderr, "trees: long-lived tree was corrupted\n");
+		return 1;
+	}
+	free_tree(long_lived);
+
+	printf("Phase times (summed over threads): build %f, walk %f, teardown %f seconds\n",
+	       build, walk, teardown);
+	printf("Nodes allocated = %lu, long-lived = %lu, check = %ld\n",
+	       nodes, long_lived_nodes, check);
+	bench_metric("build", build);
+	bench_metric("walk", walk);
+	bench_metric("teardown", teardown);
+	bench_report(&b);
+
+	free(args);
+	return 0;
+}
@@ -0,0 +1,79 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <time.h>
+
+/*
+ * Common benchmark driver.
+ *
+ * A benchmark describes its work with a struct bench and hands it to
+ * bench_run(), which runs it --warmup times without recording and
+ * then --runs times measured. Each run creates nthreads threads,
+ * pins them, and releases them together from a barrier, so thread
+ * creation is never part of the timed region. Every thread records
+ * its own time, and the run time spans from the first thread to start
+ * until the last one to finish. While a
+ * measured run is in progress the memory sampler records the segment
+ * size, RSS and allocator statistics every --sample-ms milliseconds.
+ *
+ * bench_report() prints the results in the same format for every
+ * benchmark: the "Time elapsed", "Throughput", "Memory used" and
+ * "Max RSS" lines the scripts look for, the event counters from
+ * perfctr, and a single "Result JSON = {...}" line.
+ *
+ * Framework options start with "--" and are removed from argv by
+ * bench_init(), so the benchmark parses its positional arguments as
+ * before:
+ *   --warmup=N      unrecorded runs before measuring (default 0)
+ *   --runs=N        measured runs (default 1)
+ *   --sample-ms=N   memory sampling interval, 0 disables (default 10)
+ *   --pin=POLICY    thread placement, see setPlacementPolicy() in
+ *                   mm_thread.h (default legacy)
+ *   --no-pin        do not pin the worker threads, same as --pin=none
+ *   --mem-trace=FILE  write the memory timeline (see memsampler.h) of
+ *                   the measured runs to FILE as CSV
+ *   --alloc=NAME    allocator backend of a -dl build, see mm_dl.h
+ */
+
+struct bench;
+
+/* Per-thread state, one cache line apart */
+struct bench_thread {
+	int id;			/* 0 .. nthreads-1 */
+	int cpu;		/* CPU the thread is pinned to, -1 if not pinned */
+	int run;		/* run number, negative during warm-up */
+	struct bench *bench;
+	unsigned long ops;	/* operations done, set by the worker */
+	double elapsed;		/* seconds from the start signal until return */
+	struct timespec start, end;
+} __attribute__((aligned(64)));
+
+struct bench {
+	const char *name;
+	int nthreads;
+	int unpinned;		/* set by a benchmark that places threads itself */
+	int self_counted;	/* set if the threads a worker creates count themselves */
+	const char *units;	/* what ops counts, "operations" if NULL */
+	const char *allocator;	/* reported allocator, "" for none; from the program name if NULL */
+	void *arg;		/* for the benchmark's callbacks */
+
+	/* Called before and after every run, not timed. Optional. */
+	void (*setup)(struct bench *b, int run);
+	void (*teardown)(struct bench *b, int run);
+	/* Body of every worker thread */
+	void (*worker)(struct bench_thread *t);
+	/* Run by the main thread while the workers run. Optional. */
+	void (*control)(struct bench *b);
+};
+
+extern void bench_init (int *argc, char *argv[]);
+extern void bench_usage (const char *args);
+extern int bench_run (struct bench *b);
+extern int bench_measuring (void);
+extern int bench_runs (void);
+extern double bench_elapsed (void);
+extern unsigned long bench_ops (void);
+extern void bench_metric (const char *key, double value);
+extern void bench_report (struct bench *b);
+
+#endif /* _BENCH_H_ */
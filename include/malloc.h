@@ -9,6 +9,33 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 
+/*
+ * Allocator statistics, optional. An allocator that can report them
+ * defines mm_stats(); the memory sampler checks for it at run time.
+ * Sizes are in bytes; in_use counts live blocks rounded up to the
+ * size the allocator gave them, free counts memory the allocator
+ * holds for reuse (free blocks and free pages), and meta counts pages
+ * the allocator keeps apart for its own metadata, which are in neither.
+ * meta_in_use is the part of meta that holds metadata in use, the rest
+ * being carved but unused. An allocator that does not keep metadata
+ * apart leaves both at 0.
+ */
+struct mm_stats {
+	size_t in_use;
+	size_t free;
+	size_t meta;
+	size_t meta_in_use;
+};
+
+extern void mm_stats (struct mm_stats *st);
+
+/*
+ * Optional too: an allocator that supports resizing defines
+ * mm_realloc(), with the semantics of realloc(3). Callers fall back to
+ * mm_malloc, copy and mm_free when it is not linked in.
+ */
+extern void *mm_realloc (void *ptr, size_t size);
+
 /* Team information */
 typedef struct {
     char *name;
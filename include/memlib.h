@@ -21,6 +21,7 @@ extern int mem_init (void);
 extern void *mem_sbrk (ptrdiff_t increment);
 extern int mem_pagesize (void);
 extern ptrdiff_t mem_usage (void);
+extern long mem_maxrss (void);
 
 #endif /* __MEMLIB_H_ */
 
@@ -0,0 +1,58 @@
+#ifndef _MEMSAMPLER_H_
+#define _MEMSAMPLER_H_
+
+#include <stdio.h>
+
+/*
+ * Memory usage timeline.
+ *
+ * memsampler_start() starts a thread that every interval_ms records
+ * the segment size (mem_usage()), the RSS, and, if the allocator
+ * defines mm_stats(), its in-use, free and metadata bytes. Samples go into an
+ * in-memory ring of MEMSAMPLER_RING entries, so a long run keeps the
+ * most recent ones; the summary (peaks and means) covers every sample
+ * taken. Starting again after memsampler_stop() continues the same
+ * timeline until memsampler_reset(). memsampler_dump() writes the
+ * ring as CSV rows, oldest first.
+ *
+ * Sampling reads /proc/self/statm with open/read, and the ring is
+ * allocated with the C library, so the allocator under test only sees
+ * the mm_stats() calls.
+ */
+
+#define MEMSAMPLER_RING 16384
+
+struct memsample {
+	double time;		/* seconds since the timeline started */
+	int tag;		/* set by memsampler_start, e.g. the run number */
+	long segment;
+	long rss;
+	long in_use;		/* -1 if the allocator has no mm_stats() */
+	long free;
+	long meta;		/* 0 if the allocator does not report it */
+	long meta_in_use;	/* 0 if the allocator does not report it */
+};
+
+struct memsampler_summary {
+	long samples;		/* all samples taken, including overwritten ones */
+	long segment_peak;
+	double segment_mean;
+	long rss_peak;
+	double rss_mean;
+	long in_use_peak;	/* -1 without mm_stats() */
+	long meta_peak;
+	long meta_in_use_peak;
+};
+
+extern int memsampler_start (int interval_ms, int tag);
+extern void memsampler_stop (void);
+extern void memsampler_reset (void);
+extern void memsampler_summary (struct memsampler_summary *s);
+extern void memsampler_dump (FILE *f, const char *prefix);
+extern const char *memsampler_header (void);
+
+/* Use fn for allocator statistics instead of mm_stats(); NULL for none */
+struct mm_stats;
+extern void memsampler_set_stats (void (*fn)(struct mm_stats *st));
+
+#endif /* _MEMSAMPLER_H_ */
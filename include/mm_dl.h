@@ -0,0 +1,24 @@
+#ifndef _MM_DL_H_
+#define _MM_DL_H_
+
+/*
+ * Allocator backends loaded at run time.
+ *
+ * Every allocator is also built as a shared object
+ * allocators/alloclibs/mm-<name>.so exporting mm_init, mm_malloc,
+ * mm_free and optionally mm_stats. A benchmark built as $(TARGET)-dl
+ * is linked with mm_dl.o instead of an allocator library; mm_dl.o
+ * defines the mm_* functions as calls through pointers to the backend
+ * chosen with --alloc=NAME (or the MM_ALLOC environment variable).
+ * NAME is either an allocator name, looked up in MM_ALLOCLIBS (the
+ * alloclibs directory by default), or a path to a shared object.
+ *
+ * The backend's calls to mem_sbrk, getNumProcessors etc. are resolved
+ * against the benchmark, which is linked with -rdynamic, so the
+ * backend and the benchmark share one memlib segment.
+ */
+
+/* Load the backend; returns its name, or NULL after printing why not. */
+extern const char *mm_dl_load (const char *spec);
+
+#endif /* _MM_DL_H_ */
@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include <pthread.h>
 #include <sys/syscall.h>
@@ -29,4 +30,22 @@ extern int getTID(void);
 
 extern void setCPU (int n); 
 
+/*
+ * Thread placement. getPlacementCPU(i) returns the CPU logical thread
+ * i should be pinned to under the current policy, or -1 if it should
+ * not be pinned. Only CPUs in the process affinity mask are used, and
+ * the topology is read from /sys/devices/system/cpu. Policies:
+ *   legacy           (i+1) % number of CPUs, the old behaviour (default)
+ *   compact          fill all SMT siblings of a core, then the next core
+ *   scatter-cores    one thread per core first, then the second siblings
+ *   scatter-sockets  round-robin over sockets, one core at a time
+ *   nosmt            one CPU per core only, wrapping if there are more threads
+ *   none             do not pin
+ * setPlacementPolicy returns -1 for an unknown name.
+ */
+extern int setPlacementPolicy (const char *name);
+extern const char *getPlacementPolicy (void);
+extern int getPlacementCPU (int i);
+extern void getTopology (int *ncpus, int *ncores, int *nsockets);
+
 #endif /* _MM_THREAD_H_ */
@@ -0,0 +1,44 @@
+#ifndef _PERFCTR_H_
+#define _PERFCTR_H_
+
+/*
+ * Per-thread hardware and software event counters for the benchmarks.
+ *
+ * A worker calls perfctr_begin() when it enters its timed region and
+ * perfctr_end(id) when it leaves it. The counts are added to slot id,
+ * so a logical thread that is re-created several times (larson) is
+ * reported once. After the threads have been joined, perfctr_report()
+ * prints one line per slot and a "Total counters:" line.
+ *
+ * The counters come from perf_event_open(2), counting user space
+ * only. Events the kernel or the hardware cannot provide are reported
+ * as "-". If perf events are not available at all, context switches
+ * and page faults are taken from getrusage(RUSAGE_THREAD) instead.
+ * Setting MM_PERFCTR=0 in the environment disables perf events.
+ *
+ * perfctr_read() gives the perf counts of the calling thread so far,
+ * for a worker that wants the events of one phase of its work.
+ */
+
+#define PERFCTR_MAX_SLOTS 1024
+
+enum perfctr_event {
+	PERFCTR_CYCLES,
+	PERFCTR_INSTRUCTIONS,
+	PERFCTR_L1D_MISSES,
+	PERFCTR_LLC_MISSES,
+	PERFCTR_DTLB_MISSES,
+	PERFCTR_CTX_SWITCHES,
+	PERFCTR_PAGE_FAULTS,
+	PERFCTR_NEVENTS
+};
+
+extern void perfctr_begin (void);
+extern void perfctr_end (int id);
+extern void perfctr_report (void);
+extern void perfctr_reset (void);
+extern int perfctr_totals (unsigned long long *v);
+extern int perfctr_read (unsigned long long *v);
+extern const char *perfctr_name (int e);
+
+#endif /* _PERFCTR_H_ */
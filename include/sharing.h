@@ -0,0 +1,39 @@
+#ifndef _SHARING_H_
+#define _SHARING_H_
+
+#include <stddef.h>
+
+/*
+ * Cache line sharing counter and sweep helpers for cache-scratch and
+ * cache-thrash.
+ *
+ * Between sharing_reset() and sharing_count(), every worker calls
+ * sharing_touch(id, p, size) for the objects it writes. The counter
+ * remembers which SHARING_LINE-byte lines each thread touched, up to
+ * SHARING_MAX_LINES distinct lines per thread, and sharing_count()
+ * returns the number of lines touched by more than one thread, i.e.
+ * where the allocator placed objects of different threads in the same
+ * cache line. Recording is per thread and needs no locks, but it
+ * costs far more than the writes it replaces, so it belongs in a run
+ * of its own, not in a timed one. The tables are allocated with the C
+ * library.
+ *
+ * sharing_parse() reads a sweep axis: "8" (one value), "1-64"
+ * (doubling from 1 up to 64; the upper end is always included) or
+ * "1,3,24" (a list). sharing_heatmap() prints a sizes x threads table
+ * with a shade character next to each cell, darker for larger values.
+ */
+
+#define SHARING_LINE 64
+#define SHARING_MAX_LINES 4096
+#define SHARING_MAX_POINTS 32
+
+extern int sharing_parse (const char *spec, int *vals, int max);
+extern int sharing_reset (int nthreads);
+extern void sharing_touch (int thread, const void *p, size_t size);
+extern long sharing_count (long *touched);
+extern void sharing_heatmap (const char *title, const int *sizes, int nsizes,
+			     const int *threads, int nthreads, const double *cells,
+			     const char *fmt);
+
+#endif /* _SHARING_H_ */
@@ -1,6 +1,122 @@
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
+#include <stdint.h>
+#include <time.h>
 
 extern double timespec_diff(struct timespec *start, struct timespec *end); 
+
+/*
+ * Cycle timer for timing individual calls.
+ *
+ * timer_start() and timer_stop() read the time stamp counter, fenced
+ * so that the code being timed cannot be reordered around them:
+ * lfence;rdtsc at the start and rdtscp;lfence at the end. The counter
+ * is only used if the CPU reports an invariant TSC (constant rate,
+ * running in all C-states); otherwise, on other architectures, or
+ * with MM_TIMER=clock in the environment, both return nanoseconds of
+ * CLOCK_MONOTONIC instead. Either way timer_ns() converts a
+ * difference of two readings to nanoseconds.
+ *
+ * timer_init() calibrates the TSC against CLOCK_MONOTONIC and must be
+ * called once before timing; until then the clock fallback is used.
+ * bench_init() calls it.
+ */
+
+extern int timer_use_tsc;
+extern double timer_ns_per_tick;
+
+extern void timer_init (void);
+extern int timer_invariant_tsc (void);
+extern const char *timer_source (void);
+
+static inline uint64_t timer_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t timer_start(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (timer_use_tsc) {
+		uint32_t lo, hi;
+		__asm__ __volatile__("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+		return ((uint64_t)hi << 32) | lo;
+	}
+#endif
+	return timer_clock_ns();
+}
+
+static inline uint64_t timer_stop(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (timer_use_tsc) {
+		uint32_t lo, hi, aux;
+		__asm__ __volatile__("rdtscp\n\tlfence" : "=a"(lo), "=d"(hi), "=c"(aux) : : "memory");
+		return ((uint64_t)hi << 32) | lo;
+	}
+#endif
+	return timer_clock_ns();
+}
+
+/* Ticks to nanoseconds */
+static inline double timer_ns(uint64_t ticks)
+{
+	return ticks * timer_ns_per_tick;
+}
+
+/*
+ * Log-linear latency histogram, one per thread, so recording is a
+ * couple of instructions and no sharing. Values below 16 have a bucket
+ * each; above that every power of two is split into 16 buckets, so a
+ * value is known to within 1/16. Values are in whatever unit the
+ * caller records (usually timer ticks); merge the per-thread
+ * histograms with hist_merge() before asking for percentiles.
+ */
+
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline int hist_bucket(uint64_t v)
+{
+	int k;
+
+	if (v < HIST_SUB) {
+		return (int)v;
+	}
+	k = 63 - __builtin_clzll(v);
+	return (k - HIST_SUB_BITS + 1) * HIST_SUB +
+		(int)((v >> (k - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+	h->buckets[hist_bucket(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v < h->min) {
+		h->min = v;
+	}
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+extern void hist_init (struct hist *h);
+extern void hist_merge (struct hist *dst, const struct hist *src);
+extern uint64_t hist_percentile (const struct hist *h, double p);
+extern double hist_mean (const struct hist *h);
+
 #endif /* _TIMER_H */
@@ -0,0 +1,21 @@
+#ifndef _XORSHIFT_H_
+#define _XORSHIFT_H_
+
+#include <stdint.h>
+
+/*
+ * xorshift64*, the benchmarks' generator for sizes, victims, keys and
+ * shuffles: cheap, good enough for all of them, and the same sequence
+ * from the same seed everywhere. The state must not be zero.
+ */
+static inline uint64_t next_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 2685821657736338717ULL;
+}
+
+#endif /* _XORSHIFT_H_ */
@@ -0,0 +1,485 @@
+/*
+ * Common benchmark driver, see bench.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "memlib.h"
+#include "perfctr.h"
+#include "memsampler.h"
+#include "mm_dl.h"
+#include "bench.h"
+
+#define MAX_METRICS 32
+
+static struct {
+	int warmup;
+	int runs;
+	int sample_ms;
+	int no_pin;
+	const char *mem_trace;
+} opts = { 0, 1, 10, 0, NULL };
+
+static const char *program = "";
+static const char *allocator = "";
+
+/* Only linked into the -dl builds */
+extern const char *mm_dl_load (const char *spec) __attribute__((weak));
+
+/* State of the current run */
+static pthread_barrier_t start_barrier;
+static volatile int measuring;
+
+/* Results of the measured runs */
+static double *run_times;
+static double *thread_times;		/* per thread, summed over runs */
+static unsigned long *thread_ops;
+static unsigned long total_ops;
+static int nthreads;
+
+static struct {
+	const char *key;
+	double value;
+} metrics[MAX_METRICS];
+static int nmetrics;
+
+void bench_usage(const char *args)
+{
+	fprintf(stderr, "Usage: %s %s\n", program, args);
+	fprintf(stderr, "       [--warmup=N] [--runs=N] [--sample-ms=N] [--no-pin]\n");
+	fprintf(stderr, "       [--pin=legacy|compact|scatter-cores|scatter-sockets|nosmt|none]\n");
+	fprintf(stderr, "       [--mem-trace=FILE]%s\n", mm_dl_load ? " [--alloc=NAME|PATH]" : "");
+}
+
+/* Accept "--name=value" and "--name value" */
+static int option_string(int *argc, char *argv[], int *i, const char *name, const char **val)
+{
+	size_t len = strlen(name);
+	char *arg = argv[*i] + 2;
+
+	if (strncmp(arg, name, len) != 0) {
+		return 0;
+	}
+	if (arg[len] == '=') {
+		*val = arg + len + 1;
+		return 1;
+	}
+	if (arg[len] == '\0' && *i + 1 < *argc) {
+		*val = argv[++(*i)];
+		return 1;
+	}
+	return 0;
+}
+
+static int option_value(int *argc, char *argv[], int *i, const char *name, int *val)
+{
+	const char *str;
+
+	if (!option_string(argc, argv, i, name, &str)) {
+		return 0;
+	}
+	*val = atoi(str);
+	return 1;
+}
+
+/*
+ * Remove the framework options from argv. Everything else, including
+ * the benchmark's own '-x' options, is left in order.
+ */
+void bench_init(int *argc, char *argv[])
+{
+	const char *policy, *alloc;
+	int i, j = 1;
+	const char *slash = strrchr(argv[0], '/');
+
+	program = slash ? slash + 1 : argv[0];
+	/* The allocator is the last part of the program name, x-kheap */
+	allocator = strrchr(program, '-') ? strrchr(program, '-') + 1 : "";
+	timer_init();
+
+	for (i = 1; i < *argc; i++) {
+		if (strncmp(argv[i], "--", 2) != 0) {
+			argv[j++] = argv[i];
+		} else if (option_value(argc, argv, &i, "warmup", &opts.warmup) ||
+			   option_value(argc, argv, &i, "runs", &opts.runs) ||
+			   option_value(argc, argv, &i, "sample-ms", &opts.sample_ms) ||
+			   option_string(argc, argv, &i, "mem-trace", &opts.mem_trace)) {
+			continue;
+		} else if (strcmp(argv[i], "--no-pin") == 0) {
+			opts.no_pin = 1;
+		} else if (option_string(argc, argv, &i, "alloc", &alloc)) {
+			if (mm_dl_load == NULL) {
+				fprintf(stderr, "%s: --alloc needs the -dl build of the benchmark\n", program);
+				exit(1);
+			}
+			allocator = mm_dl_load(alloc);
+			if (allocator == NULL) {
+				exit(1);
+			}
+		} else if (option_string(argc, argv, &i, "pin", &policy)) {
+			if (setPlacementPolicy(policy) != 0) {
+				fprintf(stderr, "%s: unknown placement policy %s\n", program, policy);
+				bench_usage("...");
+				exit(1);
+			}
+		} else {
+			fprintf(stderr, "%s: unknown option %s\n", program, argv[i]);
+			bench_usage("...");
+			exit(1);
+		}
+	}
+	argv[j] = NULL;
+	*argc = j;
+
+	/* A -dl build without --alloc takes the backend from MM_ALLOC */
+	if (mm_dl_load && strcmp(allocator, "dl") == 0 && getenv("MM_ALLOC")) {
+		allocator = mm_dl_load(getenv("MM_ALLOC"));
+		if (allocator == NULL) {
+			exit(1);
+		}
+	}
+
+	if (opts.warmup < 0 || opts.runs < 1 || opts.sample_ms < 0) {
+		fprintf(stderr, "%s: invalid framework options\n", program);
+		exit(1);
+	}
+}
+
+static void *thread_main(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *)arg;
+
+	if (t->cpu >= 0) {
+		setCPU(t->cpu);
+	}
+	/*
+	 * Open the counters before the start signal, so it is not timed,
+	 * unless the threads the worker creates count themselves.
+	 */
+	if (measuring && !t->bench->self_counted) {
+		perfctr_begin();
+	}
+	pthread_barrier_wait(&start_barrier);
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t->start);
+	t->bench->worker(t);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t->end);
+
+	if (measuring && !t->bench->self_counted) {
+		perfctr_end(t->id);
+	}
+	t->elapsed = timespec_diff(&t->start, &t->end);
+	return NULL;
+}
+
+/*
+ * Run the benchmark: opts.warmup unrecorded runs, then opts.runs
+ * measured ones. Returns 0, or -1 if the threads could not be created.
+ * Calling it again (e.g. for another thread count) starts over.
+ */
+int bench_run(struct bench *b)
+{
+	struct bench_thread *threads;
+	struct timespec *first, *last;
+	pthread_t *tids;
+	pthread_attr_t attr;
+	int run, i;
+
+	/* Results of an earlier call are discarded */
+	free(run_times);
+	free(thread_times);
+	free(thread_ops);
+	total_ops = 0;
+	nmetrics = 0;
+	memsampler_reset();
+	perfctr_reset();
+
+	nthreads = b->nthreads;
+	threads = (struct bench_thread *)aligned_alloc(64, nthreads * sizeof(struct bench_thread));
+	tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+	run_times = (double *)calloc(opts.runs, sizeof(double));
+	thread_times = (double *)calloc(nthreads, sizeof(double));
+	thread_ops = (unsigned long *)calloc(nthreads, sizeof(unsigned long));
+	if (threads == NULL || tids == NULL || run_times == NULL ||
+	    thread_times == NULL || thread_ops == NULL) {
+		fprintf(stderr, "bench: out of memory\n");
+		return -1;
+	}
+
+	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
+				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
+
+	for (run = -opts.warmup; run < opts.runs; run++) {
+		if (b->setup) {
+			b->setup(b, run);
+		}
+		measuring = (run >= 0);
+
+		memset(threads, 0, nthreads * sizeof(struct bench_thread));
+		pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+		for (i = 0; i < nthreads; i++) {
+			threads[i].id = i;
+			threads[i].cpu = (opts.no_pin || b->unpinned) ? -1 : getPlacementCPU(i);
+			threads[i].run = run;
+			threads[i].bench = b;
+			if (pthread_create(&tids[i], &attr, thread_main, &threads[i]) != 0) {
+				perror("bench: pthread_create failed");
+				return -1;
+			}
+		}
+		if (measuring && opts.sample_ms > 0) {
+			memsampler_start(opts.sample_ms, run);
+		}
+
+		pthread_barrier_wait(&start_barrier);
+		if (b->control) {
+			b->control(b);
+		}
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(tids[i], NULL);
+		}
+
+		memsampler_stop();
+		pthread_barrier_destroy(&start_barrier);
+
+		if (measuring) {
+			first = &threads[0].start;
+			last = &threads[0].end;
+			for (i = 1; i < nthreads; i++) {
+				if (timespec_diff(&threads[i].start, first) > 0) {
+					first = &threads[i].start;
+				}
+				if (timespec_diff(last, &threads[i].end) > 0) {
+					last = &threads[i].end;
+				}
+			}
+			run_times[run] = timespec_diff(first, last);
+			for (i = 0; i < nthreads; i++) {
+				thread_times[i] += threads[i].elapsed;
+				thread_ops[i] += threads[i].ops;
+				total_ops += threads[i].ops;
+			}
+		}
+		measuring = 0;
+
+		if (b->teardown) {
+			b->teardown(b, run);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	free(tids);
+	free(threads);
+	return 0;
+}
+
+/* True while a measured (not warm-up) run is in progress */
+int bench_measuring(void)
+{
+	return measuring;
+}
+
+/* Number of measured runs */
+int bench_runs(void)
+{
+	return opts.runs;
+}
+
+/* Total time of the measured runs */
+double bench_elapsed(void)
+{
+	double t = 0;
+	int r;
+
+	for (r = 0; r < opts.runs; r++) {
+		t += run_times[r];
+	}
+	return t;
+}
+
+/* Total operations reported by the workers in the measured runs */
+unsigned long bench_ops(void)
+{
+	return total_ops;
+}
+
+/* Add a benchmark-specific value to the JSON result */
+void bench_metric(const char *key, double value)
+{
+	if (nmetrics < MAX_METRICS) {
+		metrics[nmetrics].key = key;
+		metrics[nmetrics].value = value;
+		nmetrics++;
+	}
+}
+
+static void json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			putchar('\\');
+		}
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+static void json_doubles(const char *key, const double *v, int n, double scale)
+{
+	int i;
+
+	printf(",\"%s\":[", key);
+	for (i = 0; i < n; i++) {
+		printf("%s%.6f", i ? "," : "", v[i] * scale);
+	}
+	printf("]");
+}
+
+/*
+ * Append the memory timeline of the measured runs to the --mem-trace
+ * file. The file is truncated by the first report of the process, so
+ * a benchmark that reports several times (larson, one report per
+ * thread count) leaves one table with a row per sample.
+ */
+static void write_mem_trace(void)
+{
+	static int written;
+	char prefix[64];
+	FILE *f;
+
+	if (opts.mem_trace == NULL) {
+		return;
+	}
+	f = fopen(opts.mem_trace, written ? "a" : "w");
+	if (f == NULL) {
+		perror(opts.mem_trace);
+		return;
+	}
+	if (!written) {
+		fprintf(f, "threads,%s\n", memsampler_header());
+		written = 1;
+	}
+	snprintf(prefix, sizeof(prefix), "%d,", nthreads);
+	memsampler_dump(f, prefix);
+	fclose(f);
+}
+
+void bench_report(struct bench *b)
+{
+	const char *units = b->units ? b->units : "operations";
+	unsigned long long counters[PERFCTR_NEVENTS];
+	double total = bench_elapsed();
+	double mean = total / opts.runs;
+	double tmin = run_times[0], tmax = run_times[0], var = 0;
+	double thr_min = 0, thr_max = 0, thr_mean = 0;
+	const char *pin = (opts.no_pin || b->unpinned) ? "none" : getPlacementPolicy();
+	struct memsampler_summary mem;
+	int ncpus, ncores, nsockets;
+	int mask, r, i, e;
+
+	for (r = 0; r < opts.runs; r++) {
+		if (run_times[r] < tmin) {
+			tmin = run_times[r];
+		}
+		if (run_times[r] > tmax) {
+			tmax = run_times[r];
+		}
+		var += (run_times[r] - mean) * (run_times[r] - mean);
+	}
+	var = opts.runs > 1 ? var / (opts.runs - 1) : 0;
+
+	for (i = 0; i < nthreads; i++) {
+		double t = thread_times[i] / opts.runs;
+		thr_mean += t / nthreads;
+		if (i == 0 || t < thr_min) {
+			thr_min = t;
+		}
+		if (i == 0 || t > thr_max) {
+			thr_max = t;
+		}
+	}
+
+	printf("Time elapsed = %f seconds\n", mean);
+	if (total_ops > 0) {
+		printf("Throughput = %8.0f %s per second.\n", total_ops / total, units);
+	}
+	printf("Runs: %d measured, %d warm-up, min %f, max %f, stddev %f\n",
+	       opts.runs, opts.warmup, tmin, tmax, sqrt(var));
+	printf("Thread times: mean %f, min %f, max %f\n", thr_mean, thr_min, thr_max);
+	getTopology(&ncpus, &ncores, &nsockets);
+	printf("Placement: %s, %d CPUs, %d cores, %d sockets\n", pin, ncpus, ncores, nsockets);
+	printf("Memory used = %ld bytes\n", mem_usage());
+	memsampler_summary(&mem);
+	if (mem.samples > 0) {
+		printf("Memory sampled: peak %ld bytes, mean %.0f bytes, peak RSS %ld bytes (%ld samples)\n",
+		       mem.segment_peak, mem.segment_mean, mem.rss_peak, mem.samples);
+		if (mem.in_use_peak >= 0) {
+			printf("Allocator peak in use = %ld bytes, segment/in-use %f\n",
+			       mem.in_use_peak,
+			       mem.in_use_peak ? (double)mem.segment_peak / mem.in_use_peak : 0.0);
+		}
+		if (mem.meta_peak > 0) {
+			printf("Allocator peak metadata = %ld bytes, %ld in use\n",
+			       mem.meta_peak, mem.meta_in_use_peak);
+		}
+		write_mem_trace();
+	}
+	printf("Max RSS = %ld bytes\n", mem_maxrss());
+	perfctr_report();
+
+	printf("Result JSON = {\"benchmark\":");
+	json_string(b->name);
+	printf(",\"program\":");
+	json_string(program);
+	printf(",\"allocator\":");
+	json_string(b->allocator ? b->allocator : allocator);
+	printf(",\"threads\":%d,\"warmup\":%d,\"runs\":%d", nthreads, opts.warmup, opts.runs);
+	printf(",\"pin\":");
+	json_string(pin);
+	printf(",\"timer\":");
+	json_string(timer_source());
+	printf(",\"time\":%.6f,\"time_min\":%.6f,\"time_max\":%.6f,\"time_stddev\":%.6f",
+	       mean, tmin, tmax, sqrt(var));
+	json_doubles("run_times", run_times, opts.runs, 1.0);
+	json_doubles("thread_times", thread_times, nthreads, 1.0 / opts.runs);
+	printf(",\"ops\":%lu", total_ops);
+	if (total_ops > 0) {
+		printf(",\"throughput\":%.1f", total_ops / total);
+	}
+	printf(",\"mem_usage\":%ld,\"max_rss\":%ld", (long)mem_usage(), mem_maxrss());
+	if (mem.samples > 0) {
+		printf(",\"mem_peak\":%ld,\"mem_mean\":%.0f,\"rss_peak\":%ld,\"samples\":%ld",
+		       mem.segment_peak, mem.segment_mean, mem.rss_peak, mem.samples);
+		if (mem.in_use_peak >= 0) {
+			printf(",\"in_use_peak\":%ld", mem.in_use_peak);
+		}
+		if (mem.meta_peak > 0) {
+			printf(",\"meta_peak\":%ld,\"meta_in_use_peak\":%ld",
+			       mem.meta_peak, mem.meta_in_use_peak);
+		}
+	}
+	mask = perfctr_totals(counters);
+	printf(",\"counters\":{");
+	for (e = 0, i = 0; e < PERFCTR_NEVENTS; e++) {
+		if (mask & (1 << e)) {
+			printf("%s\"%s\":%llu", i++ ? "," : "", perfctr_name(e), counters[e]);
+		}
+	}
+	printf("}");
+	printf(",\"metrics\":{");
+	for (i = 0; i < nmetrics; i++) {
+		printf("%s\"%s\":%.6g", i ? "," : "", metrics[i].key, metrics[i].value);
+	}
+	printf("}}\n");
+}
@@ -12,6 +12,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 
 #include "memlib.h"
 
@@ -80,3 +81,14 @@ ptrdiff_t mem_usage (void)
   return dseg_hi - dseg_lo;
 }
  
+
+/* Peak resident set size of the process in bytes */
+long mem_maxrss (void)
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) != 0) {
+    return -1;
+  }
+  return ru.ru_maxrss * 1024L;
+}
@@ -0,0 +1,241 @@
+/*
+ * Memory usage timeline, see memsampler.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "memlib.h"
+#include "malloc.h"
+#include "memsampler.h"
+
+/* Not every allocator provides it */
+extern void mm_stats (struct mm_stats *st) __attribute__((weak));
+
+static void (*stats_fn)(struct mm_stats *st) = mm_stats;
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int stop;
+	int interval_ms;
+	int tag;
+	struct timespec origin;
+	int started;		/* origin is set */
+
+	struct memsample *ring;
+	long head;		/* samples written to the ring */
+
+	long samples;
+	long segment_peak;
+	long rss_peak;
+	long in_use_peak;
+	long meta_peak;
+	long meta_in_use_peak;
+	double segment_sum;
+	double rss_sum;
+} ms = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+	 .in_use_peak = -1 };
+
+/* Current resident set size, from /proc/self/statm */
+static long current_rss(void)
+{
+	char buf[128];
+	long size, resident;
+	ssize_t n;
+	int fd;
+
+	fd = open("/proc/self/statm", O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return 0;
+	}
+	buf[n] = '\0';
+	if (sscanf(buf, "%ld %ld", &size, &resident) != 2) {
+		return 0;
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Called with ms.lock held */
+static void sample(void)
+{
+	struct memsample *s = &ms.ring[ms.head % MEMSAMPLER_RING];
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	s->time = (now.tv_sec - ms.origin.tv_sec) + (now.tv_nsec - ms.origin.tv_nsec) / 1e9;
+	s->tag = ms.tag;
+	s->segment = mem_usage();
+	s->rss = current_rss();
+	s->in_use = -1;
+	s->free = -1;
+	s->meta = 0;
+	s->meta_in_use = 0;
+	if (stats_fn) {
+		struct mm_stats st = { 0 };
+
+		stats_fn(&st);
+		s->in_use = st.in_use;
+		s->free = st.free;
+		s->meta = st.meta;
+		s->meta_in_use = st.meta_in_use;
+	}
+	ms.head++;
+
+	ms.samples++;
+	ms.segment_sum += s->segment;
+	ms.rss_sum += s->rss;
+	if (s->segment > ms.segment_peak) {
+		ms.segment_peak = s->segment;
+	}
+	if (s->rss > ms.rss_peak) {
+		ms.rss_peak = s->rss;
+	}
+	if (s->in_use > ms.in_use_peak) {
+		ms.in_use_peak = s->in_use;
+	}
+	if (s->meta > ms.meta_peak) {
+		ms.meta_peak = s->meta;
+	}
+	if (s->meta_in_use > ms.meta_in_use_peak) {
+		ms.meta_in_use_peak = s->meta_in_use;
+	}
+}
+
+static void *sampler_main(void *arg)
+{
+	struct timespec next;
+
+	pthread_mutex_lock(&ms.lock);
+	clock_gettime(CLOCK_REALTIME, &next);
+	while (!ms.stop) {
+		sample();
+		next.tv_nsec += ms.interval_ms * 1000000L;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		while (!ms.stop &&
+		       pthread_cond_timedwait(&ms.cond, &ms.lock, &next) != ETIMEDOUT) {
+			;
+		}
+	}
+	/* One last sample at the end */
+	sample();
+	pthread_mutex_unlock(&ms.lock);
+	return NULL;
+}
+
+/*
+ * Start sampling every interval_ms milliseconds, labelling the samples
+ * with tag. Returns 0, or -1 if the sampler could not be started.
+ */
+int memsampler_start(int interval_ms, int tag)
+{
+	if (ms.running || interval_ms <= 0) {
+		return -1;
+	}
+	if (ms.ring == NULL) {
+		ms.ring = (struct memsample *)malloc(MEMSAMPLER_RING * sizeof(struct memsample));
+		if (ms.ring == NULL) {
+			return -1;
+		}
+	}
+	if (!ms.started) {
+		clock_gettime(CLOCK_MONOTONIC, &ms.origin);
+		ms.started = 1;
+	}
+	ms.interval_ms = interval_ms;
+	ms.tag = tag;
+	ms.stop = 0;
+	if (pthread_create(&ms.thread, NULL, sampler_main, NULL) != 0) {
+		perror("memsampler: pthread_create failed");
+		return -1;
+	}
+	ms.running = 1;
+	return 0;
+}
+
+void memsampler_stop(void)
+{
+	if (!ms.running) {
+		return;
+	}
+	pthread_mutex_lock(&ms.lock);
+	ms.stop = 1;
+	pthread_cond_signal(&ms.cond);
+	pthread_mutex_unlock(&ms.lock);
+	pthread_join(ms.thread, NULL);
+	ms.running = 0;
+}
+
+/* Forget all samples and start a new timeline */
+void memsampler_reset(void)
+{
+	memsampler_stop();
+	ms.started = 0;
+	ms.head = 0;
+	ms.samples = 0;
+	ms.segment_peak = 0;
+	ms.rss_peak = 0;
+	ms.in_use_peak = -1;
+	ms.meta_peak = 0;
+	ms.meta_in_use_peak = 0;
+	ms.segment_sum = 0;
+	ms.rss_sum = 0;
+}
+
+void memsampler_summary(struct memsampler_summary *s)
+{
+	pthread_mutex_lock(&ms.lock);
+	s->samples = ms.samples;
+	s->segment_peak = ms.segment_peak;
+	s->segment_mean = ms.samples ? ms.segment_sum / ms.samples : 0;
+	s->rss_peak = ms.rss_peak;
+	s->rss_mean = ms.samples ? ms.rss_sum / ms.samples : 0;
+	s->in_use_peak = ms.in_use_peak;
+	s->meta_peak = ms.meta_peak;
+	s->meta_in_use_peak = ms.meta_in_use_peak;
+	pthread_mutex_unlock(&ms.lock);
+}
+
+/* Column names of the rows written by memsampler_dump */
+const char *memsampler_header(void)
+{
+	return "time,tag,segment,rss,in_use,free,meta,meta_in_use";
+}
+
+/* Write the samples in the ring, oldest first, each row after prefix */
+void memsampler_dump(FILE *f, const char *prefix)
+{
+	long i, first;
+
+	pthread_mutex_lock(&ms.lock);
+	first = ms.head > MEMSAMPLER_RING ? ms.head - MEMSAMPLER_RING : 0;
+	for (i = first; i < ms.head; i++) {
+		struct memsample *s = &ms.ring[i % MEMSAMPLER_RING];
+
+		fprintf(f, "%s%.6f,%d,%ld,%ld,%ld,%ld,%ld,%ld\n", prefix, s->time, s->tag,
+			s->segment, s->rss, s->in_use, s->free, s->meta, s->meta_in_use);
+	}
+	pthread_mutex_unlock(&ms.lock);
+}
+
+void memsampler_set_stats(void (*fn)(struct mm_stats *st))
+{
+	stats_fn = fn;
+}
@@ -0,0 +1,109 @@
+/*
+ * Allocator backends loaded at run time, see mm_dl.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "malloc.h"
+#include "memsampler.h"
+#include "mm_dl.h"
+
+#ifndef MM_ALLOCLIBS
+#define MM_ALLOCLIBS "."
+#endif
+
+static int (*dl_init)(void);
+static void *(*dl_malloc)(size_t size);
+static void (*dl_free)(void *ptr);
+
+static char dl_name[256];
+
+/* "a2alloc" from ".../mm-a2alloc.so", the spec itself otherwise */
+static void backend_name(const char *spec)
+{
+	const char *base = strrchr(spec, '/');
+	size_t len;
+
+	base = base ? base + 1 : spec;
+	if (strncmp(base, "mm-", 3) == 0) {
+		base += 3;
+	}
+	len = strlen(base);
+	if (len > 3 && strcmp(base + len - 3, ".so") == 0) {
+		len -= 3;
+	}
+	if (len >= sizeof(dl_name)) {
+		len = sizeof(dl_name) - 1;
+	}
+	memcpy(dl_name, base, len);
+	dl_name[len] = '\0';
+}
+
+const char *mm_dl_load(const char *spec)
+{
+	const char *dir = getenv("MM_ALLOCLIBS");
+	char path[4096];
+	void *handle;
+
+	if (dl_malloc != NULL) {
+		fprintf(stderr, "mm_dl: allocator %s is already loaded\n", dl_name);
+		return NULL;
+	}
+	if (strchr(spec, '/') != NULL) {
+		snprintf(path, sizeof(path), "%s", spec);
+	} else {
+		snprintf(path, sizeof(path), "%s/mm-%s.so", dir ? dir : MM_ALLOCLIBS, spec);
+	}
+
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		fprintf(stderr, "mm_dl: %s\n", dlerror());
+		return NULL;
+	}
+	dl_init = (int (*)(void))dlsym(handle, "mm_init");
+	dl_malloc = (void *(*)(size_t))dlsym(handle, "mm_malloc");
+	dl_free = (void (*)(void *))dlsym(handle, "mm_free");
+	if (dl_init == NULL || dl_malloc == NULL || dl_free == NULL) {
+		fprintf(stderr, "mm_dl: %s does not export mm_init, mm_malloc and mm_free\n", path);
+		dlclose(handle);
+		dl_init = NULL;
+		dl_malloc = NULL;
+		dl_free = NULL;
+		return NULL;
+	}
+	memsampler_set_stats((void (*)(struct mm_stats *))dlsym(handle, "mm_stats"));
+
+	backend_name(spec);
+	return dl_name;
+}
+
+int mm_init(void)
+{
+	const char *env = getenv("MM_ALLOC");
+
+	if (dl_init == NULL) {
+		if (env == NULL) {
+			fprintf(stderr, "mm_dl: no allocator, use --alloc=NAME or set MM_ALLOC\n");
+			exit(1);
+		}
+		if (mm_dl_load(env) == NULL) {
+			exit(1);
+		}
+	}
+	return dl_init();
+}
+
+void *mm_malloc(size_t size)
+{
+	return dl_malloc(size);
+}
+
+void mm_free(void *ptr)
+{
+	dl_free(ptr);
+}
@@ -48,3 +48,199 @@ void setCPU (int n) {
 	} 
 }
 
+
+/* Thread placement */
+
+struct cpu_topo {
+	int cpu;
+	int package;
+	int core;	/* rank of the core within its package */
+	int smt;	/* rank of the CPU among its core's siblings */
+	long key;
+};
+
+static const char *placement_names[] = {
+	"legacy", "compact", "scatter-cores", "scatter-sockets", "nosmt", "none"
+};
+enum { PLACE_LEGACY, PLACE_COMPACT, PLACE_SCATTER_CORES, PLACE_SCATTER_SOCKETS,
+       PLACE_NOSMT, PLACE_NONE, PLACE_NPOLICIES };
+
+static int placement = PLACE_LEGACY;
+static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+static struct cpu_topo *topo;
+static int topo_ncpus, topo_ncores, topo_nsockets;
+static int *order;		/* CPUs in placement order */
+static int norder;
+
+static int read_topology_value(int cpu, const char *name, int dflt)
+{
+	char path[128], buf[32];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return dflt;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return dflt;
+	}
+	buf[n] = '\0';
+	return atoi(buf);
+}
+
+/*
+ * Read the package and core of every CPU we may run on, and rank the
+ * cores within each package and the CPUs within each core. core_id is
+ * only unique within a package and need not be dense, hence the ranks.
+ * Called once, before any thread has been pinned, so the affinity mask
+ * is still the one the process was started with.
+ */
+static void read_topology(void)
+{
+	cpu_set_t mask;
+	int *core_ids;
+	int n = 0, cpu, i, j;
+
+	if (sched_getaffinity(0, sizeof(mask), &mask) != 0) {
+		CPU_ZERO(&mask);
+		for (cpu = 0; cpu < getNumProcessors() && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, &mask);
+		}
+	}
+	topo = (struct cpu_topo *)calloc(CPU_COUNT(&mask), sizeof(struct cpu_topo));
+	core_ids = (int *)calloc(CPU_COUNT(&mask), sizeof(int));
+	order = (int *)calloc(CPU_COUNT(&mask), sizeof(int));
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &mask)) {
+			continue;
+		}
+		topo[n].cpu = cpu;
+		topo[n].package = read_topology_value(cpu, "physical_package_id", 0);
+		core_ids[n] = read_topology_value(cpu, "core_id", cpu);
+		n++;
+	}
+	topo_ncpus = n;
+
+	/* CPUs are in increasing order, so ranks follow the CPU numbering. */
+	for (i = 0; i < n; i++) {
+		int seen_package = 0, sibling = -1;
+
+		for (j = 0; j < i; j++) {
+			if (topo[j].package != topo[i].package) {
+				continue;
+			}
+			seen_package = 1;
+			if (core_ids[j] == core_ids[i]) {
+				sibling = j;
+				topo[i].smt++;
+			} else if (topo[j].smt == 0) {
+				topo[i].core++;
+			}
+		}
+		if (sibling >= 0) {
+			topo[i].core = topo[sibling].core;
+		} else {
+			topo_ncores++;
+		}
+		if (!seen_package) {
+			topo_nsockets++;
+		}
+	}
+	free(core_ids);
+}
+
+static int compare_key(const void *a, const void *b)
+{
+	const struct cpu_topo *x = (const struct cpu_topo *)a;
+	const struct cpu_topo *y = (const struct cpu_topo *)b;
+
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+/* Order the CPUs for the current policy */
+static void build_order(void)
+{
+	long n = topo_ncpus + 1;	/* bound on every rank */
+	int i;
+
+	for (i = 0; i < topo_ncpus; i++) {
+		struct cpu_topo *c = &topo[i];
+		switch (placement) {
+		case PLACE_COMPACT:
+			c->key = (c->package * n + c->core) * n + c->smt;
+			break;
+		case PLACE_SCATTER_CORES:
+		case PLACE_NOSMT:
+			c->key = (c->smt * n + c->package) * n + c->core;
+			break;
+		case PLACE_SCATTER_SOCKETS:
+			c->key = (c->smt * n + c->core) * n + c->package;
+			break;
+		default:
+			c->key = c->cpu;
+			break;
+		}
+	}
+	qsort(topo, topo_ncpus, sizeof(struct cpu_topo), compare_key);
+
+	norder = 0;
+	for (i = 0; i < topo_ncpus; i++) {
+		if (placement != PLACE_NOSMT || topo[i].smt == 0) {
+			order[norder++] = topo[i].cpu;
+		}
+	}
+}
+
+static void init_placement(void)
+{
+	read_topology();
+	build_order();
+}
+
+int setPlacementPolicy (const char *name)
+{
+	int p;
+
+	for (p = 0; p < PLACE_NPOLICIES; p++) {
+		if (strcmp(name, placement_names[p]) == 0) {
+			pthread_once(&topo_once, init_placement);
+			placement = p;
+			build_order();
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *getPlacementPolicy (void)
+{
+	return placement_names[placement];
+}
+
+int getPlacementCPU (int i)
+{
+	pthread_once(&topo_once, init_placement);
+
+	switch (placement) {
+	case PLACE_NONE:
+		return -1;
+	case PLACE_LEGACY:
+		return (i + 1) % getNumProcessors();
+	default:
+		return norder > 0 ? order[i % norder] : -1;
+	}
+}
+
+void getTopology (int *ncpus, int *ncores, int *nsockets)
+{
+	pthread_once(&topo_once, init_placement);
+
+	*ncpus = topo_ncpus;
+	*ncores = topo_ncores;
+	*nsockets = topo_nsockets;
+}
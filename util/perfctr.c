@@ -0,0 +1,290 @@
+/*
+ * Per-thread event counters, see perfctr.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+
+#include "perfctr.h"
+
+static const char *event_names[PERFCTR_NEVENTS] = {
+	"cycles", "instructions", "l1d-misses", "llc-misses",
+	"dtlb-misses", "context-switches", "page-faults"
+};
+
+#define CACHE_READ_MISS(c) \
+	((c) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+	unsigned int type;
+	unsigned long long config;
+} event_config[PERFCTR_NEVENTS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+	{ PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL) },
+	{ PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+/* Sources a value can come from, reported next to the totals */
+#define SRC_PERF	1
+#define SRC_RUSAGE	2
+
+struct slot {
+	unsigned long long v[PERFCTR_NEVENTS];
+	int src[PERFCTR_NEVENTS];	/* 0 if the event was never counted */
+	int used;
+};
+
+static struct slot slots[PERFCTR_MAX_SLOTS];
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int perf_enabled;
+
+/* State of the calling thread between perfctr_begin and perfctr_end */
+static __thread int fds[PERFCTR_NEVENTS];
+static __thread struct rusage ru_start;
+static __thread int active;
+
+static void perfctr_init(void)
+{
+	const char *env = getenv("MM_PERFCTR");
+
+	perf_enabled = (env == NULL || strcmp(env, "0") != 0);
+}
+
+static int open_event(int e)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = event_config[e].type;
+	attr.config = event_config[e].config;
+	attr.disabled = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	/*
+	 * Software events are raised in kernel context, so try to count
+	 * them there first. Hardware events are counted in user space,
+	 * which perf_event_paranoid allows for unprivileged users.
+	 */
+	attr.exclude_kernel = (attr.type != PERF_TYPE_SOFTWARE);
+
+	/* Calling thread, any CPU, no group */
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd < 0 && !attr.exclude_kernel) {
+		attr.exclude_kernel = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	return fd;
+}
+
+/* Start counting for the calling thread. */
+void perfctr_begin(void)
+{
+	int e;
+
+	pthread_once(&once, perfctr_init);
+
+	for (e = 0; e < PERFCTR_NEVENTS; e++) {
+		fds[e] = perf_enabled ? open_event(e) : -1;
+	}
+	getrusage(RUSAGE_THREAD, &ru_start);
+	active = 1;
+
+	for (e = 0; e < PERFCTR_NEVENTS; e++) {
+		if (fds[e] >= 0) {
+			ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+			ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+/*
+ * Read a counter, scaled up if the kernel had to multiplex it with
+ * other events. Returns 0 if the event never ran.
+ */
+static int read_event(int fd, unsigned long long *val)
+{
+	unsigned long long buf[3];	/* value, time enabled, time running */
+
+	if (read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0) {
+		return 0;
+	}
+	if (buf[2] < buf[1]) {
+		buf[0] = (unsigned long long)((double)buf[0] * buf[1] / buf[2]);
+	}
+	*val = buf[0];
+	return 1;
+}
+
+/* Stop counting for the calling thread and add the counts to slot id. */
+void perfctr_end(int id)
+{
+	unsigned long long v[PERFCTR_NEVENTS];
+	int src[PERFCTR_NEVENTS];
+	struct rusage ru_end;
+	struct slot *s;
+	int e;
+
+	if (!active) {
+		return;
+	}
+	for (e = 0; e < PERFCTR_NEVENTS; e++) {
+		if (fds[e] >= 0) {
+			ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+	getrusage(RUSAGE_THREAD, &ru_end);
+	active = 0;
+
+	for (e = 0; e < PERFCTR_NEVENTS; e++) {
+		src[e] = 0;
+		v[e] = 0;
+		if (fds[e] >= 0) {
+			if (read_event(fds[e], &v[e])) {
+				src[e] = SRC_PERF;
+			}
+			close(fds[e]);
+		}
+	}
+	if (!src[PERFCTR_CTX_SWITCHES]) {
+		v[PERFCTR_CTX_SWITCHES] = (ru_end.ru_nvcsw - ru_start.ru_nvcsw) +
+			(ru_end.ru_nivcsw - ru_start.ru_nivcsw);
+		src[PERFCTR_CTX_SWITCHES] = SRC_RUSAGE;
+	}
+	if (!src[PERFCTR_PAGE_FAULTS]) {
+		v[PERFCTR_PAGE_FAULTS] = (ru_end.ru_minflt - ru_start.ru_minflt) +
+			(ru_end.ru_majflt - ru_start.ru_majflt);
+		src[PERFCTR_PAGE_FAULTS] = SRC_RUSAGE;
+	}
+
+	s = &slots[(unsigned int)id % PERFCTR_MAX_SLOTS];
+	pthread_mutex_lock(&slot_lock);
+	for (e = 0; e < PERFCTR_NEVENTS; e++) {
+		if (src[e]) {
+			s->v[e] += v[e];
+			s->src[e] |= src[e];
+		}
+	}
+	s->used = 1;
+	pthread_mutex_unlock(&slot_lock);
+}
+
+static void print_counters(const unsigned long long *v, const int *src)
+{
+	int e;
+
+	for (e = 0; e < PERFCTR_NEVENTS; e++) {
+		if (src[e]) {
+			printf(" %s=%llu", event_names[e], v[e]);
+		} else {
+			printf(" %s=-", event_names[e]);
+		}
+	}
+}
+
+/* Forget the counts of all slots */
+void perfctr_reset(void)
+{
+	pthread_mutex_lock(&slot_lock);
+	memset(slots, 0, sizeof(slots));
+	pthread_mutex_unlock(&slot_lock);
+}
+
+const char *perfctr_name(int e)
+{
+	return event_names[e];
+}
+
+/*
+ * Sum the counters of all slots into v, which has PERFCTR_NEVENTS
+ * entries. Returns a mask with bit e set if event e was counted.
+ */
+int perfctr_totals(unsigned long long *v)
+{
+	int i, e, mask = 0;
+
+	memset(v, 0, PERFCTR_NEVENTS * sizeof(*v));
+	pthread_mutex_lock(&slot_lock);
+	for (i = 0; i < PERFCTR_MAX_SLOTS; i++) {
+		for (e = 0; e < PERFCTR_NEVENTS; e++) {
+			if (slots[i].used && slots[i].src[e]) {
+				v[e] += slots[i].v[e];
+				mask |= 1 << e;
+			}
+		}
+	}
+	pthread_mutex_unlock(&slot_lock);
+	return mask;
+}
+
+/*
+ * Read the perf counters of the calling thread since perfctr_begin()
+ * into v, which has PERFCTR_NEVENTS entries, without stopping them.
+ * Returns a mask with bit e set if event e was read; 0 outside
+ * perfctr_begin() .. perfctr_end() or without perf events.
+ */
+int perfctr_read(unsigned long long *v)
+{
+	int e, mask = 0;
+
+	memset(v, 0, PERFCTR_NEVENTS * sizeof(*v));
+	if (!active) {
+		return 0;
+	}
+	for (e = 0; e < PERFCTR_NEVENTS; e++) {
+		if (fds[e] >= 0 && read_event(fds[e], &v[e])) {
+			mask |= 1 << e;
+		}
+	}
+	return mask;
+}
+
+/* Print the counters of every slot that was used, and their sum. */
+void perfctr_report(void)
+{
+	unsigned long long total[PERFCTR_NEVENTS];
+	int src[PERFCTR_NEVENTS];
+	int i, e, any = 0;
+	static const char *src_names[] = { "none", "perf", "rusage", "perf+rusage" };
+
+	memset(total, 0, sizeof(total));
+	memset(src, 0, sizeof(src));
+
+	pthread_mutex_lock(&slot_lock);
+	for (i = 0; i < PERFCTR_MAX_SLOTS; i++) {
+		if (!slots[i].used) {
+			continue;
+		}
+		printf("Thread %d counters:", i);
+		print_counters(slots[i].v, slots[i].src);
+		printf("\n");
+		for (e = 0; e < PERFCTR_NEVENTS; e++) {
+			total[e] += slots[i].v[e];
+			src[e] |= slots[i].src[e];
+		}
+	}
+	pthread_mutex_unlock(&slot_lock);
+
+	for (e = 0; e < PERFCTR_NEVENTS; e++) {
+		any |= src[e];
+	}
+	printf("Total counters:");
+	print_counters(total, src);
+	printf(" source=%s\n", src_names[any]);
+}
@@ -0,0 +1,218 @@
+/*
+ * Cache line sharing counter and sweep helpers, see sharing.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "sharing.h"
+
+#define TABLE_SIZE (2 * SHARING_MAX_LINES)	/* open addressing, half full */
+
+/* Distinct lines touched by one thread */
+struct line_set {
+	uintptr_t *lines;	/* TABLE_SIZE slots, line number + 1, 0 if free */
+	uintptr_t last;		/* most recent line, most touches repeat it */
+	int n;
+	int overflow;
+} __attribute__((aligned(64)));
+
+static struct line_set *sets;
+static int nsets;
+
+static int cmp_line(const void *a, const void *b)
+{
+	uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Parse a sweep axis into vals, at most max entries. Returns the
+ * number of values, or -1 if spec is not valid.
+ */
+int sharing_parse(const char *spec, int *vals, int max)
+{
+	char *end;
+	long lo, hi, v;
+	int n = 0;
+
+	lo = strtol(spec, &end, 10);
+	if (end == spec || lo < 1) {
+		return -1;
+	}
+	if (*end == '-') {
+		hi = strtol(end + 1, &end, 10);
+		if (*end != '\0' || hi < lo) {
+			return -1;
+		}
+		for (v = lo; v < hi && n < max; v *= 2) {
+			vals[n++] = v;
+		}
+		if (n < max) {
+			vals[n++] = hi;
+		}
+		return n;
+	}
+	vals[n++] = lo;
+	while (*end == ',' && n < max) {
+		spec = end + 1;
+		v = strtol(spec, &end, 10);
+		if (end == spec || v < 1) {
+			return -1;
+		}
+		vals[n++] = v;
+	}
+	return *end == '\0' ? n : -1;
+}
+
+/* Forget all touches and prepare for nthreads threads. Returns -1 if out of memory. */
+int sharing_reset(int nthreads)
+{
+	int i;
+
+	for (i = 0; i < nsets; i++) {
+		free(sets[i].lines);
+	}
+	free(sets);
+	nsets = 0;
+
+	sets = (struct line_set *)aligned_alloc(64, nthreads * sizeof(struct line_set));
+	if (sets == NULL) {
+		return -1;
+	}
+	memset(sets, 0, nthreads * sizeof(struct line_set));
+	for (i = 0; i < nthreads; i++) {
+		sets[i].lines = (uintptr_t *)calloc(TABLE_SIZE, sizeof(uintptr_t));
+		if (sets[i].lines == NULL) {
+			nsets = i;
+			return -1;
+		}
+	}
+	nsets = nthreads;
+	return 0;
+}
+
+/* Record that the calling thread, number thread, wrote p[0..size-1]. */
+void sharing_touch(int thread, const void *p, size_t size)
+{
+	struct line_set *s = &sets[thread];
+	uintptr_t line = (uintptr_t)p / SHARING_LINE + 1;
+	uintptr_t last = ((uintptr_t)p + (size ? size - 1 : 0)) / SHARING_LINE + 1;
+	unsigned int h;
+
+	for (; line <= last; line++) {
+		if (line == s->last) {
+			continue;
+		}
+		s->last = line;
+		h = (unsigned int)((line * 0x9E3779B97F4A7C15ULL) >> 40) & (TABLE_SIZE - 1);
+		while (s->lines[h] != 0 && s->lines[h] != line) {
+			h = (h + 1) & (TABLE_SIZE - 1);
+		}
+		if (s->lines[h] != 0) {
+			continue;
+		}
+		if (s->n == SHARING_MAX_LINES) {
+			s->overflow = 1;
+			continue;
+		}
+		s->lines[h] = line;
+		s->n++;
+	}
+}
+
+/*
+ * Number of lines touched by more than one thread since the last
+ * sharing_reset(). If touched is not NULL, it is set to the number
+ * of distinct lines touched by any thread.
+ */
+long sharing_count(long *touched)
+{
+	uintptr_t *all;
+	long n = 0, distinct = 0, shared = 0, i, j;
+	int t, h, overflow = 0;
+
+	for (t = 0; t < nsets; t++) {
+		n += sets[t].n;
+		overflow |= sets[t].overflow;
+	}
+	if (overflow) {
+		fprintf(stderr, "sharing: more than %d lines in one thread, some were not counted\n",
+			SHARING_MAX_LINES);
+	}
+	all = (uintptr_t *)malloc((n ? n : 1) * sizeof(uintptr_t));
+	if (all == NULL) {
+		return -1;
+	}
+	for (t = 0, n = 0; t < nsets; t++) {
+		for (h = 0; h < TABLE_SIZE; h++) {
+			if (sets[t].lines[h] != 0) {
+				all[n++] = sets[t].lines[h];
+			}
+		}
+	}
+
+	/* Each thread's lines are distinct, so a repeated line is shared */
+	qsort(all, n, sizeof(uintptr_t), cmp_line);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && all[j] == all[i]; j++)
+			;
+		distinct++;
+		if (j - i > 1) {
+			shared++;
+		}
+	}
+	free(all);
+
+	if (touched) {
+		*touched = distinct;
+	}
+	return shared;
+}
+
+/*
+ * Print cells, nsizes rows of nthreads values, as a table with one
+ * row per object size and one column per thread count. Each value is
+ * printed with fmt and followed by a shade from ' ' (zero) to '#'
+ * (the largest value in the table).
+ */
+void sharing_heatmap(const char *title, const int *sizes, int nsizes,
+		     const int *threads, int nthreads, const double *cells,
+		     const char *fmt)
+{
+	static const char shades[] = " .:-=+*#";
+	double max = 0;
+	char buf[32];
+	int r, c, k;
+
+	for (r = 0; r < nsizes * nthreads; r++) {
+		if (cells[r] > max) {
+			max = cells[r];
+		}
+	}
+
+	printf("%s\n", title);
+	printf("%8s", "size");
+	for (c = 0; c < nthreads; c++) {
+		snprintf(buf, sizeof(buf), "%dT", threads[c]);
+		printf(" %11s", buf);
+	}
+	printf("\n");
+	for (r = 0; r < nsizes; r++) {
+		printf("%8d", sizes[r]);
+		for (c = 0; c < nthreads; c++) {
+			double v = cells[r * nthreads + c];
+
+			k = 0;
+			if (v > 0 && max > 0) {
+				k = 1 + (int)((sizeof(shades) - 3) * v / max);
+			}
+			snprintf(buf, sizeof(buf), fmt, v);
+			printf(" %10s%c", buf, shades[k]);
+		}
+		printf("\n");
+	}
+}
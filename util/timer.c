@@ -1,5 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 #include "timer.h"
 
 double timespec_diff(struct timespec *start, struct timespec *end) {
@@ -16,3 +22,142 @@ double timespec_diff(struct timespec *start, struct timespec *end) {
 	}
 	return (double)(diff.tv_sec + (double)diff.tv_nsec/1000000000.0);
 }
+
+/* Cycle timer, see timer.h */
+
+int timer_use_tsc = 0;
+double timer_ns_per_tick = 1.0;
+
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+
+/* Calibration interval */
+#define CALIBRATE_NSEC	20000000ULL
+
+int timer_invariant_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+
+	/* CPUID.80000007H:EDX[8] is the invariant TSC flag */
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+		return 0;
+	}
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return (edx >> 8) & 1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Count TSC ticks over CALIBRATE_NSEC of CLOCK_MONOTONIC. Each end is
+ * read between two clock reads and the clock taken as their midpoint,
+ * so the cost of clock_gettime does not bias the rate.
+ */
+static void timer_calibrate(void)
+{
+	uint64_t c0, c1, c2, c3, t0, t1;
+	const char *env = getenv("MM_TIMER");
+
+	if ((env != NULL && strcmp(env, "clock") == 0) || !timer_invariant_tsc()) {
+		return;
+	}
+
+	timer_use_tsc = 1;
+	c0 = timer_clock_ns();
+	t0 = timer_start();
+	c1 = timer_clock_ns();
+	do {
+		c2 = timer_clock_ns();
+		t1 = timer_stop();
+		c3 = timer_clock_ns();
+	} while (c2 - c0 < CALIBRATE_NSEC);
+
+	if (t1 <= t0) {
+		timer_use_tsc = 0;
+		return;
+	}
+	timer_ns_per_tick = ((c2 + c3) / 2.0 - (c0 + c1) / 2.0) / (double)(t1 - t0);
+}
+
+void timer_init(void)
+{
+	pthread_once(&timer_once, timer_calibrate);
+}
+
+const char *timer_source(void)
+{
+	return timer_use_tsc ? "tsc" : "clock";
+}
+
+void hist_init(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min) {
+		dst->min = src->min;
+	}
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+/* Smallest value of a bucket */
+static uint64_t bucket_low(int b)
+{
+	int k;
+
+	if (b < HIST_SUB) {
+		return b;
+	}
+	k = b / HIST_SUB + HIST_SUB_BITS - 1;
+	return (uint64_t)(HIST_SUB + b % HIST_SUB) << (k - HIST_SUB_BITS);
+}
+
+/*
+ * Value below which a fraction p (0..1) of the recorded values lie,
+ * as the middle of the bucket that holds it, clamped to [min, max].
+ */
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+	uint64_t rank, seen = 0, v;
+	int b;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	rank = (uint64_t)(p * h->count);
+	if (rank >= h->count) {
+		rank = h->count - 1;
+	}
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen > rank) {
+			break;
+		}
+	}
+	v = bucket_low(b) + (b + 1 < HIST_BUCKETS ? (bucket_low(b + 1) - bucket_low(b)) / 2 : 0);
+	if (v < h->min) {
+		v = h->min;
+	}
+	if (v > h->max) {
+		v = h->max;
+	}
+	return v;
+}
+
+double hist_mean(const struct hist *h)
+{
+	return h->count ? (double)h->sum / h->count : 0.0;
+}